@@ -1,32 +1,362 @@
+// -pthread
+#define _GNU_SOURCE
 #include <errno.h>
 #include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/file.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "lockstats.h"
+#include "trace.h"
+
 #define LOCKFILE "/tmp/np_lockfile"
+#define SEMAPHORE_NAME "/np_lock_semaphore"
 #define FILE_MODE (S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)
 /* default permissions for new files */
+#define HISTOGRAM_BUCKETS 64
+#define MAX_SHARDS 64
+#define CACHE_LINE_SIZE 64
+#define MAX_STRIPES 64
+
+enum lock_type
+{
+    LOCK_FCNTL,
+    LOCK_FLOCK,
+    LOCK_SEMAPHORE,
+    LOCK_PTHREAD,
+    LOCK_FUTEX,
+    LOCK_OFD,
+    LOCK_TYPE_COUNT
+};
+char *lock_names[LOCK_TYPE_COUNT] = {"fcntl", "flock", "sem", "pthread", "futex", "ofd"};
+
+// How the counter is incremented: under the selected lock, with one atomic add on the shared counter, with an
+// atomic add on a counter of the process' own that readers add up with all the others, or in one of several stripes
+// each guarded by a byte-range lock of its own.
+enum counter_mode
+{
+    MODE_LOCKED,
+    MODE_ATOMIC,
+    MODE_SHARDED,
+    MODE_STRIPED,
+    MODE_COUNT
+};
+char *mode_names[MODE_COUNT] = {"locked", "atomic", "sharded", "striped"};
+
+// One process' part of the counter in sharded mode. Every shard is alone on its cache line, so processes incrementing
+// their own shards never make the line bounce between cores.
+struct shard
+{
+    long count;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+// Everything the processes share through the mapped file. The counter stays first so that files written before the
+// other lock types existed, which only hold the counter, keep working.
+struct shared_state
+{
+    int counter;
+    // 0 unlocked, 1 locked, 2 locked and someone may be sleeping on it
+    uint32_t futex_word;
+    // 0 not initialized, 1 being initialized by some process, 2 ready
+    int mutex_state;
+    pthread_mutex_t mutex;
+    struct shard shards[MAX_SHARDS];
+    // The part of the counter guarded by each stripe lock in striped mode, padded like the shards
+    struct shard stripes[MAX_STRIPES];
+};
+
+// How long the lock acquisitions of one benchmark process waited, in power of two buckets of nanoseconds.
+struct wait_stats
+{
+    uint64_t buckets[HISTOGRAM_BUCKETS];
+    uint64_t total_ns;
+    uint64_t max_ns;
+};
+
+// Lets the benchmark processes start incrementing together. Every child counts itself in "ready" once it is set up and
+// then sleeps until the parent sets "go", so neither the forks nor the setup of the children are timed.
+struct start_gate
+{
+    uint32_t ready;
+    uint32_t go;
+};
 
 static struct flock lock_it, unlock_it;
 static int lock_fd = -1;
 /* fcntl() will fail if my_lock_init() not called */
+static enum lock_type lock_type = LOCK_FCNTL;
+static enum counter_mode counter_mode = MODE_LOCKED;
+static int stripe_count = 1;
+static struct shared_state *shared;
+static sem_t *semaphore;
+static struct lock_stats_block *lock_stats_block;
+static struct trace_ring *trace_ring;
+static struct lock_stats *lock_stats;
+static int64_t lock_acquired_at_ns;
 
-void my_lock_init(char *pathname)
+// Returns the current time of the monotonic clock in nanoseconds.
+int64_t get_monotonic_time_ns()
+{
+    struct timespec now;
+    if (clock_gettime(CLOCK_MONOTONIC, &now) < 0)
+    {
+        perror("Failed to get monotonic time");
+        exit(1);
+    }
+    return now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// Maps the shared lock statistics when NP_LOCKSTATS is set in the environment. Without it the locks aren't timed at
+// all and lock_stats_find returns NULL.
+void lock_stats_open()
 {
-    // Hardcoded the lock file to be /tmp/np_lockfile
-    lock_fd = open(pathname, O_CREAT | O_WRONLY, FILE_MODE);
-    if (lock_fd < 0)
+    if (lock_stats_block != NULL || getenv("NP_LOCKSTATS") == NULL)
+        return;
+
+    int fd = shm_open(LOCK_STATS_NAME, O_RDWR | O_CREAT, FILE_MODE);
+    if (fd < 0)
     {
-        perror("lock file open failed");
+        perror("shm_open failed for lock statistics");
         exit(1);
     }
+    // A new object is filled with zeros, so every process can size it without caring who was first
+    if (ftruncate(fd, sizeof(struct lock_stats_block)) < 0)
+    {
+        perror("Failed to size lock statistics");
+        exit(1);
+    }
+    lock_stats_block = mmap(NULL, sizeof(struct lock_stats_block), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (lock_stats_block == MAP_FAILED)
+    {
+        perror("mmap failed for lock statistics");
+        exit(1);
+    }
+    close(fd);
+
+    lock_stats_check_layout(lock_stats_block);
+}
+
+// Returns the statistics of the named lock, claiming a free entry if no process has used the name yet.
+struct lock_stats *lock_stats_find(const char *name)
+{
+    if (lock_stats_block == NULL)
+        return NULL;
+
+    for (int i = 0; i < LOCK_STATS_MAX_LOCKS; i++)
+    {
+        struct lock_stats *stats = &lock_stats_block->locks[i];
+        uint32_t state = 0;
+        if (__atomic_compare_exchange_n(&stats->state, &state, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE))
+        {
+            strncpy(stats->name, name, LOCK_STATS_NAME_LENGTH - 1);
+            __atomic_store_n(&stats->state, 2, __ATOMIC_RELEASE);
+            return stats;
+        }
+        while (state == 1)
+        {
+            sched_yield();
+            state = __atomic_load_n(&stats->state, __ATOMIC_ACQUIRE);
+        }
+        if (strncmp(stats->name, name, LOCK_STATS_NAME_LENGTH - 1) == 0)
+            return stats;
+    }
+    fprintf(stderr, "No room for the statistics of lock %s, it won't be profiled\n", name);
+    return NULL;
+}
+
+void lock_stats_record(uint64_t *buckets, uint64_t *total_ns, uint64_t *max_ns, uint64_t ns)
+{
+    int bucket = ns == 0 ? 0 : 63 - __builtin_clzll(ns);
+    __atomic_add_fetch(&buckets[bucket], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(total_ns, ns, __ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(max_ns, __ATOMIC_RELAXED);
+    while (ns > max && !__atomic_compare_exchange_n(max_ns, &max, ns, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+// Records an acquisition that started waiting at "wait_start_ns". Returns the time the lock was acquired, which is
+// handed back to lock_stats_released.
+int64_t lock_stats_acquired(struct lock_stats *stats, int64_t wait_start_ns)
+{
+    int64_t now = get_monotonic_time_ns();
+    __atomic_add_fetch(&stats->acquisitions, 1, __ATOMIC_RELAXED);
+    lock_stats_record(stats->wait_buckets, &stats->wait_total_ns, &stats->wait_max_ns, now - wait_start_ns);
+    return now;
+}
+
+void lock_stats_released(struct lock_stats *stats, int64_t acquired_at_ns)
+{
+    lock_stats_record(stats->hold_buckets, &stats->hold_total_ns, &stats->hold_max_ns, get_monotonic_time_ns() - acquired_at_ns);
+}
+
+// Creates this process' trace ring when NP_TRACE is set in the environment. NP_TRACE_RECORDS can set how many records
+// the ring holds. Has to be called again after a fork, the child gets a ring of its own.
+void trace_open()
+{
+    if ((trace_ring != NULL && trace_ring->pid == getpid()) || getenv("NP_TRACE") == NULL)
+        return;
+
+    uint64_t capacity = getenv("NP_TRACE_RECORDS") != NULL ? strtoull(getenv("NP_TRACE_RECORDS"), NULL, 10) : 0;
+    if (capacity == 0)
+        capacity = TRACE_DEFAULT_CAPACITY;
+    size_t size = sizeof(struct trace_ring) + capacity * sizeof(struct trace_record);
+
+    char name[32];
+    snprintf(name, sizeof(name), TRACE_NAME_FORMAT, getpid());
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_TRUNC, FILE_MODE);
+    if (fd < 0)
+    {
+        perror("shm_open failed for trace ring");
+        exit(1);
+    }
+    if (ftruncate(fd, size) < 0)
+    {
+        perror("Failed to size trace ring");
+        exit(1);
+    }
+    trace_ring = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (trace_ring == MAP_FAILED)
+    {
+        perror("mmap failed for trace ring");
+        exit(1);
+    }
+    close(fd);
+
+    trace_ring->pid = getpid();
+    trace_ring->capacity = capacity;
+    trace_ring->record_size = sizeof(struct trace_record);
+    __atomic_store_n(&trace_ring->magic, TRACE_MAGIC, __ATOMIC_RELEASE);
+}
+
+// Records an event if tracing is on. Returns 0 when it is off so the caller can print the event instead.
+int trace_event(uint16_t tag, int64_t value, uint16_t detail)
+{
+    if (trace_ring == NULL)
+        return 0;
+
+    uint64_t head = trace_ring->head;
+    struct trace_record *record = &trace_ring->records[head % trace_ring->capacity];
+    record->time_ns = get_monotonic_time_ns();
+    record->value = value;
+    record->pid = trace_ring->pid;
+    record->tag = tag;
+    record->detail = detail;
+    __atomic_store_n(&trace_ring->head, head + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+// The futex word is in a file mapped by several processes, so the shared (non private) futex operations are needed.
+long futex(uint32_t *address, int operation, uint32_t value)
+{
+    return syscall(SYS_futex, address, operation, value, NULL, NULL, 0);
+}
+
+// Counts the calling child as ready and waits until the parent opens the gate.
+void start_gate_wait(struct start_gate *gate)
+{
+    __atomic_fetch_add(&gate->ready, 1, __ATOMIC_RELEASE);
+    if (futex(&gate->ready, FUTEX_WAKE, 1) < 0)
+        perror("futex wake failed");
+    while (__atomic_load_n(&gate->go, __ATOMIC_ACQUIRE) == 0)
+    {
+        if (futex(&gate->go, FUTEX_WAIT, 0) < 0 && errno != EAGAIN && errno != EINTR)
+        {
+            perror("futex wait failed");
+            exit(1);
+        }
+    }
+}
+
+// Waits until "processes" children are ready and lets them all go at once. Returns the time they were let go at.
+int64_t start_gate_open(struct start_gate *gate, int processes)
+{
+    uint32_t ready;
+    while ((ready = __atomic_load_n(&gate->ready, __ATOMIC_ACQUIRE)) < (uint32_t)processes)
+    {
+        if (futex(&gate->ready, FUTEX_WAIT, ready) < 0 && errno != EAGAIN && errno != EINTR)
+        {
+            perror("futex wait failed");
+            exit(1);
+        }
+    }
+    int64_t now = get_monotonic_time_ns();
+    __atomic_store_n(&gate->go, 1, __ATOMIC_RELEASE);
+    if (futex(&gate->go, FUTEX_WAKE, INT_MAX) < 0)
+        perror("futex wake failed");
+    return now;
+}
 
-    // Do not delete the file to ensure that the lock is also available to other processes
+// Initializes the process shared mutex in the mapped file exactly once, whichever process gets here first. It is
+// robust so a process dying while holding it doesn't leave the others waiting forever.
+void init_shared_mutex()
+{
+    int expected = 0;
+    if (__atomic_compare_exchange_n(&shared->mutex_state, &expected, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE))
+    {
+        pthread_mutexattr_t attributes;
+        pthread_mutexattr_init(&attributes);
+        pthread_mutexattr_setpshared(&attributes, PTHREAD_PROCESS_SHARED);
+        pthread_mutexattr_setrobust(&attributes, PTHREAD_MUTEX_ROBUST);
+        int result = pthread_mutex_init(&shared->mutex, &attributes);
+        pthread_mutexattr_destroy(&attributes);
+        if (result != 0)
+        {
+            fprintf(stderr, "pthread_mutex_init failed: %s\n", strerror(result));
+            exit(1);
+        }
+        __atomic_store_n(&shared->mutex_state, 2, __ATOMIC_RELEASE);
+        return;
+    }
+    while (__atomic_load_n(&shared->mutex_state, __ATOMIC_ACQUIRE) != 2)
+        sched_yield();
+}
+
+// Sets up the selected lock for this process. Has to be called in every process separately, as fcntl locks belong to
+// the process and flock locks to the open file description, neither of which a child shares with its parent.
+void my_lock_init(char *pathname)
+{
+    switch (lock_type)
+    {
+    case LOCK_FCNTL:
+    case LOCK_FLOCK:
+    case LOCK_OFD:
+        // Hardcoded the lock file to be /tmp/np_lockfile
+        lock_fd = open(pathname, O_CREAT | O_WRONLY, FILE_MODE);
+        if (lock_fd < 0)
+        {
+            perror("lock file open failed");
+            exit(1);
+        }
+        // Do not delete the file to ensure that the lock is also available to other processes
+        break;
+    case LOCK_SEMAPHORE:
+        semaphore = sem_open(SEMAPHORE_NAME, O_CREAT, FILE_MODE, 1);
+        if (semaphore == SEM_FAILED)
+        {
+            perror("sem_open failed");
+            exit(1);
+        }
+        break;
+    case LOCK_PTHREAD:
+        init_shared_mutex();
+        break;
+    default:
+        break;
+    }
 
     lock_it.l_type = F_WRLCK;
     lock_it.l_whence = SEEK_SET;
@@ -37,75 +367,615 @@ void my_lock_init(char *pathname)
     unlock_it.l_whence = SEEK_SET;
     unlock_it.l_start = 0;
     unlock_it.l_len = 0;
+
+    lock_stats_open();
+    char name[LOCK_STATS_NAME_LENGTH];
+    snprintf(name, sizeof(name), counter_mode == MODE_STRIPED ? "exercise2 %s stripes" : "exercise2 %s", lock_names[lock_type]);
+    lock_stats = lock_stats_find(name);
+}
+
+// Mutex from Drepper's "Futexes Are Tricky": taking a free lock is one compare and swap, and the futex system calls
+// are only made when the lock is contended.
+void futex_lock()
+{
+    uint32_t state = 0;
+    if (__atomic_compare_exchange_n(&shared->futex_word, &state, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        return;
+    if (state != 2)
+        state = __atomic_exchange_n(&shared->futex_word, 2, __ATOMIC_ACQUIRE);
+    while (state != 0)
+    {
+        if (futex(&shared->futex_word, FUTEX_WAIT, 2) < 0 && errno != EAGAIN && errno != EINTR)
+        {
+            perror("futex wait failed");
+            exit(1);
+        }
+        state = __atomic_exchange_n(&shared->futex_word, 2, __ATOMIC_ACQUIRE);
+    }
+}
+
+void futex_unlock()
+{
+    if (__atomic_fetch_sub(&shared->futex_word, 1, __ATOMIC_RELEASE) != 1)
+    {
+        __atomic_store_n(&shared->futex_word, 0, __ATOMIC_RELEASE);
+        if (futex(&shared->futex_word, FUTEX_WAKE, 1) < 0)
+        {
+            perror("futex wake failed");
+            exit(1);
+        }
+    }
 }
 
 void my_lock_wait()
 {
     int rc;
+    int64_t wait_start_ns = lock_stats != NULL ? get_monotonic_time_ns() : 0;
 
-    while ((rc = fcntl(lock_fd, F_SETLKW, &lock_it)) < 0)
+    switch (lock_type)
     {
-        if (errno == EINTR)
-            continue;
-        else
+    case LOCK_FCNTL:
+        while ((rc = fcntl(lock_fd, F_SETLKW, &lock_it)) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            else
+            {
+                perror("fcntl error for my_lock_wait");
+                exit(1);
+            }
+        }
+        break;
+    case LOCK_FLOCK:
+        while (flock(lock_fd, LOCK_EX) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("flock error for my_lock_wait");
+            exit(1);
+        }
+        break;
+    case LOCK_SEMAPHORE:
+        while (sem_wait(semaphore) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("sem_wait error for my_lock_wait");
+            exit(1);
+        }
+        break;
+    case LOCK_PTHREAD:
+        rc = pthread_mutex_lock(&shared->mutex);
+        // The previous owner died while holding the mutex. The counter is always consistent, so just carry on.
+        if (rc == EOWNERDEAD)
+            rc = pthread_mutex_consistent(&shared->mutex);
+        if (rc != 0)
+        {
+            fprintf(stderr, "pthread_mutex_lock error for my_lock_wait: %s\n", strerror(rc));
+            exit(1);
+        }
+        break;
+    case LOCK_FUTEX:
+        futex_lock();
+        break;
+    case LOCK_OFD:
+        while (fcntl(lock_fd, F_OFD_SETLKW, &lock_it) < 0)
         {
+            if (errno == EINTR)
+                continue;
             perror("fcntl error for my_lock_wait");
             exit(1);
         }
+        break;
+    default:
+        break;
     }
+
+    if (lock_stats != NULL)
+        lock_acquired_at_ns = lock_stats_acquired(lock_stats, wait_start_ns);
 }
 
 void my_lock_release()
 {
-    if (fcntl(lock_fd, F_SETLKW, &unlock_it) < 0)
+    int rc;
+
+    if (lock_stats != NULL)
+        lock_stats_released(lock_stats, lock_acquired_at_ns);
+
+    switch (lock_type)
     {
-        perror("fcntl error for my_lock_release");
-        exit(1);
+    case LOCK_FCNTL:
+        if (fcntl(lock_fd, F_SETLKW, &unlock_it) < 0)
+        {
+            perror("fcntl error for my_lock_release");
+            exit(1);
+        }
+        break;
+    case LOCK_FLOCK:
+        if (flock(lock_fd, LOCK_UN) < 0)
+        {
+            perror("flock error for my_lock_release");
+            exit(1);
+        }
+        break;
+    case LOCK_SEMAPHORE:
+        if (sem_post(semaphore) < 0)
+        {
+            perror("sem_post error for my_lock_release");
+            exit(1);
+        }
+        break;
+    case LOCK_PTHREAD:
+        if ((rc = pthread_mutex_unlock(&shared->mutex)) != 0)
+        {
+            fprintf(stderr, "pthread_mutex_unlock error for my_lock_release: %s\n", strerror(rc));
+            exit(1);
+        }
+        break;
+    case LOCK_FUTEX:
+        futex_unlock();
+        break;
+    case LOCK_OFD:
+        if (fcntl(lock_fd, F_OFD_SETLKW, &unlock_it) < 0)
+        {
+            perror("fcntl error for my_lock_release");
+            exit(1);
+        }
+        break;
+    default:
+        break;
     }
 }
 /* end my_lock_wait */
+
+// Locks or unlocks only the byte of the lock file at the offset of the stripe, so processes working on different
+// stripes don't wait for each other. Classic fcntl locks belong to the process and OFD locks to the open file
+// description, otherwise they behave the same here.
+void my_stripe_lock(int stripe, short type)
+{
+    struct flock range;
+    memset(&range, 0, sizeof(range));
+    range.l_type = type;
+    range.l_whence = SEEK_SET;
+    range.l_start = stripe;
+    range.l_len = 1;
+
+    while (fcntl(lock_fd, lock_type == LOCK_OFD ? F_OFD_SETLKW : F_SETLKW, &range) < 0)
+    {
+        if (errno == EINTR)
+            continue;
+        perror(type == F_UNLCK ? "fcntl error for my_stripe_lock_release" : "fcntl error for my_stripe_lock_wait");
+        exit(1);
+    }
+}
+
+void my_stripe_lock_wait(int stripe)
+{
+    int64_t wait_start_ns = lock_stats != NULL ? get_monotonic_time_ns() : 0;
+    my_stripe_lock(stripe, F_WRLCK);
+    if (lock_stats != NULL)
+        lock_acquired_at_ns = lock_stats_acquired(lock_stats, wait_start_ns);
+}
+
+void my_stripe_lock_release(int stripe)
+{
+    if (lock_stats != NULL)
+        lock_stats_released(lock_stats, lock_acquired_at_ns);
+    my_stripe_lock(stripe, F_UNLCK);
+}
+
+// Releases what my_lock_init set up in this process.
+void my_lock_close()
+{
+    if (lock_fd >= 0 && close(lock_fd) < 0)
+        perror("lock file close failed");
+    lock_fd = -1;
+    if (semaphore != NULL && sem_close(semaphore) < 0)
+        perror("sem_close failed");
+    semaphore = NULL;
+}
+
+// Returns the sum of the increments made in sharded and striped mode.
+long read_shards()
+{
+    long value = 0;
+    for (int i = 0; i < MAX_SHARDS; i++)
+        value += __atomic_load_n(&shared->shards[i].count, __ATOMIC_RELAXED);
+    for (int i = 0; i < MAX_STRIPES; i++)
+        value += __atomic_load_n(&shared->stripes[i].count, __ATOMIC_RELAXED);
+    return value;
+}
+
+// Returns the value of the counter, which is spread over the shared counter and the shards.
+long read_counter()
+{
+    return __atomic_load_n(&shared->counter, __ATOMIC_RELAXED) + read_shards();
+}
+
+// Increments the counter without a lock. Returns the value before the increment in atomic mode and the sum of
+// everything after it in sharded mode, as the shards only add up to a meaningful value when read together.
+long increment_lock_free(int shard)
+{
+    if (counter_mode == MODE_ATOMIC)
+        return __atomic_fetch_add(&shared->counter, 1, __ATOMIC_RELAXED) + read_shards();
+    __atomic_fetch_add(&shared->shards[shard % MAX_SHARDS].count, 1, __ATOMIC_RELAXED);
+    return read_counter();
+}
+
+int parse_lock_type(char *name)
+{
+    for (int type = 0; type < LOCK_TYPE_COUNT; type++)
+    {
+        if (strcmp(name, lock_names[type]) == 0)
+            return type;
+    }
+    return -1;
+}
+
+// Value below which the given percentage of the waits fell, as the upper edge of its histogram bucket.
+uint64_t histogram_percentile(struct wait_stats *stats, uint64_t count, double percent)
+{
+    uint64_t target = (uint64_t)(percent / 100 * count);
+    uint64_t seen = 0;
+    for (int bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++)
+    {
+        seen += stats->buckets[bucket];
+        if (seen > target)
+            return (uint64_t)1 << (bucket + 1);
+    }
+    return stats->max_ns;
+}
+
+// Runs "processes" processes that each increment the counter "nloop" times in the current mode and returns the
+// increments per second. With "verbose" set the time every lock acquisition takes is measured too, and the throughput
+// and the distribution of the waits are printed. Without it nothing but the increments is timed, from the moment all
+// processes are released together until the last one exits.
+double run_benchmark(char *pathname, int processes, int nloop, int verbose)
+{
+    struct wait_stats *results = mmap(NULL, processes * sizeof(struct wait_stats), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    struct start_gate *gate = mmap(NULL, sizeof(struct start_gate), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (results == MAP_FAILED || gate == MAP_FAILED)
+    {
+        perror("mmap failed");
+        exit(1);
+    }
+    memset(results, 0, processes * sizeof(struct wait_stats));
+
+    // Start from a clean lock, a previous run may have been killed while holding it
+    __atomic_store_n(&shared->futex_word, 0, __ATOMIC_RELAXED);
+    if (counter_mode == MODE_LOCKED && lock_type == LOCK_SEMAPHORE)
+        sem_unlink(SEMAPHORE_NAME);
+    long start_value = read_counter();
+    int uses_lock = counter_mode == MODE_LOCKED || counter_mode == MODE_STRIPED;
+    int record_waits = verbose && uses_lock;
+
+    // Nothing buffered may be left for the children to print again when they exit
+    fflush(stdout);
+    for (int child = 0; child < processes; child++)
+    {
+        pid_t pid = fork();
+        if (pid < 0)
+        {
+            perror("fork failed");
+            exit(1);
+        }
+        if (pid == 0)
+        {
+            if (uses_lock)
+                my_lock_init(pathname);
+            struct wait_stats *stats = &results[child];
+            // Stripes are picked at random, like accesses to unrelated parts of the mapping would be
+            uint32_t random_state = 2654435761u * (child + 1);
+            start_gate_wait(gate);
+            for (int i = 0; i < nloop; i++)
+            {
+                if (counter_mode == MODE_ATOMIC)
+                {
+                    __atomic_fetch_add(&shared->counter, 1, __ATOMIC_RELAXED);
+                    continue;
+                }
+                if (counter_mode == MODE_SHARDED)
+                {
+                    __atomic_fetch_add(&shared->shards[child % MAX_SHARDS].count, 1, __ATOMIC_RELAXED);
+                    continue;
+                }
+                int stripe = 0;
+                if (counter_mode == MODE_STRIPED)
+                {
+                    random_state ^= random_state << 13;
+                    random_state ^= random_state >> 17;
+                    random_state ^= random_state << 5;
+                    stripe = random_state % stripe_count;
+                }
+                if (!record_waits)
+                {
+                    if (counter_mode == MODE_STRIPED)
+                    {
+                        my_stripe_lock_wait(stripe);
+                        shared->stripes[stripe].count++;
+                        my_stripe_lock_release(stripe);
+                        continue;
+                    }
+                    my_lock_wait();
+                    shared->counter++;
+                    my_lock_release();
+                    continue;
+                }
+
+                int64_t before = get_monotonic_time_ns();
+                if (counter_mode == MODE_STRIPED)
+                    my_stripe_lock_wait(stripe);
+                else
+                    my_lock_wait();
+                uint64_t waited = get_monotonic_time_ns() - before;
+                if (counter_mode == MODE_STRIPED)
+                {
+                    shared->stripes[stripe].count++;
+                    my_stripe_lock_release(stripe);
+                }
+                else
+                {
+                    shared->counter++;
+                    my_lock_release();
+                }
+
+                stats->buckets[waited > 0 ? 63 - __builtin_clzll(waited) : 0]++;
+                stats->total_ns += waited;
+                if (waited > stats->max_ns)
+                    stats->max_ns = waited;
+            }
+            my_lock_close();
+            _exit(0);
+        }
+    }
+    int64_t start = start_gate_open(gate, processes);
+    int status;
+    while (wait(&status) > 0 || errno == EINTR)
+        ;
+    double seconds = (get_monotonic_time_ns() - start) / 1e9;
+    uint64_t count = (uint64_t)processes * nloop;
+    long lost = start_value + (long)count - read_counter();
+    if (lost != 0)
+        fprintf(stderr, "%s: counter is off by %ld after the benchmark\n", counter_mode == MODE_LOCKED ? lock_names[lock_type] : mode_names[counter_mode], lost);
+
+    if (verbose && counter_mode == MODE_STRIPED)
+        printf("%s with %d %s stripes: %d processes x %d increments in %.3fs, %.0f increments/s\n", mode_names[counter_mode], stripe_count, lock_names[lock_type], processes, nloop, seconds, count / seconds);
+    else if (verbose)
+        printf("%s: %d processes x %d increments in %.3fs, %.0f increments/s\n", counter_mode == MODE_LOCKED ? lock_names[lock_type] : mode_names[counter_mode], processes, nloop, seconds, count / seconds);
+    if (record_waits)
+    {
+        struct wait_stats total;
+        memset(&total, 0, sizeof(total));
+        for (int child = 0; child < processes; child++)
+        {
+            for (int bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++)
+                total.buckets[bucket] += results[child].buckets[bucket];
+            total.total_ns += results[child].total_ns;
+            if (results[child].max_ns > total.max_ns)
+                total.max_ns = results[child].max_ns;
+        }
+        printf("  wait: mean %.0fns, p50 <%luns, p90 <%luns, p99 <%luns, max %luns\n", (double)total.total_ns / count, histogram_percentile(&total, count, 50), histogram_percentile(&total, count, 90), histogram_percentile(&total, count, 99), total.max_ns);
+        for (int bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++)
+        {
+            if (total.buckets[bucket] > 0)
+                printf("  %10luns - %10luns: %lu\n", bucket == 0 ? 0 : (uint64_t)1 << bucket, ((uint64_t)1 << (bucket + 1)) - 1, total.buckets[bucket]);
+        }
+    }
+
+    if (munmap(results, processes * sizeof(struct wait_stats)) < 0 || munmap(gate, sizeof(struct start_gate)) < 0)
+        perror("munmap failed");
+    return count / seconds;
+}
+
+// Compares the selected lock with the atomic and sharded modes for 1, 2, 4 ... 64 processes. The gap between the
+// atomic and the sharded column is the cost of all processes bouncing the one cache line of the counter around.
+void run_sweep(char *pathname, int nloop)
+{
+    printf("%9s %14s %14s %14s   (million increments/s)\n", "processes", lock_names[lock_type], mode_names[MODE_ATOMIC], mode_names[MODE_SHARDED]);
+    for (int processes = 1; processes <= MAX_SHARDS; processes *= 2)
+    {
+        double rates[MODE_COUNT];
+        for (int mode = MODE_LOCKED; mode <= MODE_SHARDED; mode++)
+        {
+            counter_mode = mode;
+            rates[mode] = run_benchmark(pathname, processes, nloop, 0);
+        }
+        printf("%9d %14.2f %14.2f %14.2f\n", processes, rates[MODE_LOCKED] / 1e6, rates[MODE_ATOMIC] / 1e6, rates[MODE_SHARDED] / 1e6);
+    }
+}
+
+// Compares classic fcntl and OFD stripe locks for 1, 2, 4 ... MAX_STRIPES stripes with a fixed number of processes.
+// One stripe is the same as locking the whole file.
+void run_stripe_sweep(char *pathname, int processes, int nloop)
+{
+    counter_mode = MODE_STRIPED;
+    printf("%d processes\n%9s %14s %14s   (increments/s)\n", processes, "stripes", lock_names[LOCK_FCNTL], lock_names[LOCK_OFD]);
+    for (stripe_count = 1; stripe_count <= MAX_STRIPES; stripe_count *= 2)
+    {
+        lock_type = LOCK_FCNTL;
+        double fcntl_rate = run_benchmark(pathname, processes, nloop, 0);
+        lock_type = LOCK_OFD;
+        double ofd_rate = run_benchmark(pathname, processes, nloop, 0);
+        printf("%9d %14.0f %14.0f\n", stripe_count, fcntl_rate, ofd_rate);
+    }
+}
+
 int main(int argc, char **argv)
 {
-    int fd, i, nloop, zero = 0;
-    int *ptr;
+    int fd, i, nloop;
+    int bench_processes = 0;
+    int all_locks = 0;
+    int sweep = 0;
+    int stripe_sweep = 0;
 
-    if (argc != 3)
+    static struct option long_options[] = {
+        {"lock", required_argument, NULL, 'l'},
+        {"mode", required_argument, NULL, 'm'},
+        {"bench", required_argument, NULL, 'b'},
+        {"sweep", no_argument, NULL, 's'},
+        {"stripes", required_argument, NULL, 'k'},
+        {"stripe-sweep", no_argument, NULL, 'K'},
+        {NULL, 0, NULL, 0},
+    };
+    int option;
+    while ((option = getopt_long(argc, argv, "l:m:b:sk:K", long_options, NULL)) != -1)
     {
-        perror("usage: incr2 <pathname> <#loops>");
+        switch (option)
+        {
+        case 'k':
+            stripe_count = atoi(optarg);
+            if (stripe_count < 1 || stripe_count > MAX_STRIPES)
+            {
+                fprintf(stderr, "stripe count must be between 1 and %d\n", MAX_STRIPES);
+                exit(1);
+            }
+            counter_mode = MODE_STRIPED;
+            break;
+        case 'K':
+            stripe_sweep = 1;
+            break;
+        case 'm':
+            for (counter_mode = 0; counter_mode < MODE_COUNT; counter_mode++)
+            {
+                if (strcmp(optarg, mode_names[counter_mode]) == 0)
+                    break;
+            }
+            if (counter_mode == MODE_COUNT)
+            {
+                fprintf(stderr, "unknown mode %s, expected locked, atomic, sharded or striped\n", optarg);
+                exit(1);
+            }
+            break;
+        case 's':
+            sweep = 1;
+            break;
+        case 'l':
+            if (strcmp(optarg, "all") == 0)
+            {
+                all_locks = 1;
+                break;
+            }
+            if ((lock_type = parse_lock_type(optarg)) < 0)
+            {
+                fprintf(stderr, "unknown lock type %s, expected fcntl, flock, sem, pthread, futex, ofd or all\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'b':
+            bench_processes = atoi(optarg);
+            if (bench_processes < 1)
+            {
+                fprintf(stderr, "benchmark needs at least one process\n");
+                exit(1);
+            }
+            break;
+        default:
+            exit(1);
+        }
+    }
+
+    if (argc - optind != 2 || (all_locks && bench_processes == 0))
+    {
+        fprintf(stderr, "usage: incr2 [--lock fcntl|flock|sem|pthread|futex|ofd] [--mode locked|atomic|sharded|striped] [--stripes <count>] [--bench <#processes> [--lock all] | --sweep | --stripe-sweep] <pathname> <#loops>\n");
         exit(1);
     }
-    nloop = atoi(argv[2]);
+    if (counter_mode == MODE_STRIPED && lock_type != LOCK_FCNTL && lock_type != LOCK_OFD)
+    {
+        fprintf(stderr, "striped mode needs the fcntl or ofd lock\n");
+        exit(1);
+    }
+    nloop = atoi(argv[optind + 1]);
 
     /* 4open file, initialize to 0 if empty, map into memory */
-    if ((fd = open(argv[1], O_RDWR | O_CREAT, FILE_MODE)) < 0)
+    if ((fd = open(argv[optind], O_RDWR | O_CREAT, FILE_MODE)) < 0)
     {
         perror("open failed");
         exit(1);
     }
-    // Check if file is empty. If it is, write 0 to it
-    if (lseek(fd, 0, SEEK_END) == 0)
+    // Grow the file to hold the shared state. The new bytes read as zero, so an empty file starts the counter at 0.
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) < 0)
     {
-        write(fd, &zero, sizeof(int));
+        perror("fstat failed");
+        exit(1);
+    }
+    if ((size_t)file_stat.st_size < sizeof(struct shared_state) && ftruncate(fd, sizeof(struct shared_state)) < 0)
+    {
+        perror("ftruncate failed");
+        exit(1);
     }
 
-    ptr = mmap(NULL, sizeof(int), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-    if (ptr == MAP_FAILED)
+    shared = mmap(NULL, sizeof(struct shared_state), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (shared == MAP_FAILED)
     {
         perror("mmap failed");
         exit(1);
     }
     close(fd);
 
-    /* 4create, initialize, and unlink file lock */
-    my_lock_init(LOCKFILE);
+    if (stripe_sweep)
+    {
+        run_stripe_sweep(LOCKFILE, bench_processes > 0 ? bench_processes : 8, nloop);
+        exit(0);
+    }
+    if (sweep)
+    {
+        run_sweep(LOCKFILE, nloop);
+        exit(0);
+    }
+    if (bench_processes > 0)
+    {
+        for (int type = 0; type < LOCK_TYPE_COUNT; type++)
+        {
+            if ((counter_mode != MODE_LOCKED || !all_locks) && type != (int)lock_type)
+                continue;
+            lock_type = type;
+            run_benchmark(LOCKFILE, bench_processes, nloop, 1);
+        }
+        exit(0);
+    }
 
     setbuf(stdout, NULL); /* stdout is unbuffered */
+    // With NP_TRACE set the numbers go to the trace ring instead, printing them would make the critical section many
+    // times longer than the increment itself
+    trace_open();
+
+    if (counter_mode == MODE_STRIPED)
+    {
+        my_lock_init(LOCKFILE);
+        int stripe = getpid() % stripe_count;
+        for (i = 0; i < nloop; i++)
+        {
+            my_stripe_lock_wait(stripe);
+            shared->stripes[stripe].count++;
+            long value = read_counter();
+            if (!trace_event(TRACE_COUNTER, value, 0))
+                printf("Number: %ld\n", value);
+            my_stripe_lock_release(stripe);
+        }
+        exit(0);
+    }
+    if (counter_mode != MODE_LOCKED)
+    {
+        for (i = 0; i < nloop; i++)
+        {
+            long value = increment_lock_free(getpid());
+            if (!trace_event(TRACE_COUNTER, value, 0))
+                printf("Number: %ld\n", value);
+        }
+        exit(0);
+    }
+
+    /* 4create, initialize, and unlink file lock */
+    my_lock_init(LOCKFILE);
 
     for (i = 0; i < nloop; i++)
     {
         my_lock_wait();
-        printf("Number: %d\n", (*ptr)++);
+        long value = shared->counter++ + read_shards();
+        if (!trace_event(TRACE_COUNTER, value, 0))
+            printf("Number: %ld\n", value);
         my_lock_release();
     }
     exit(0);
-}
\ No newline at end of file
+}
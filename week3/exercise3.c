@@ -1,20 +1,216 @@
+#define _GNU_SOURCE
 #include <errno.h>
 #include <fcntl.h>
+#include <getopt.h>
+#include <sched.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "lockstats.h"
+#include "trace.h"
+
 #define LOCKFILE "/tmp/np_lockfile"
 #define FILE_MODE (S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)
 /* default permissions for new files */
+#define LOG_MAGIC 0x6e704c47
+// The log file grows by this much at a time, so growing is rare compared to appending.
+#define LOG_GROWTH_CHUNK (4 * 1024 * 1024)
+#define LOG_DATA_OFFSET 64
+#define RECORD_ALIGNMENT 8
+
+// Start of the append log file. "tail" is how many bytes of records have been reserved after LOG_DATA_OFFSET.
+struct log_header
+{
+    uint32_t magic;
+    uint32_t reserved;
+    uint64_t tail;
+};
+
+// Every record starts with this header. The writer fills in "length" right after reserving the space, then the rest
+// of the record, and sets "committed" last. Readers trust a record only once "committed" is set, and can skip one
+// still being written as long as its length is there.
+struct log_record
+{
+    uint32_t committed;
+    uint32_t length;
+    int32_t pid;
+    int32_t sequence;
+    char data[];
+};
+
+// This process' view of the log. Every process maps the file separately, so the size of the mapping is per process.
+struct append_log
+{
+    int fd;
+    char *base;
+    size_t mapped;
+};
 
 static struct flock lock_it, unlock_it;
 static int lock_fd = -1;
 /* fcntl() will fail if my_lock_init() not called */
+static struct lock_stats_block *lock_stats_block;
+static struct trace_ring *trace_ring;
+static struct lock_stats *lock_stats;
+static int64_t lock_acquired_at_ns;
+
+// Returns the current time of the monotonic clock in nanoseconds.
+int64_t get_monotonic_time_ns()
+{
+    struct timespec now;
+    if (clock_gettime(CLOCK_MONOTONIC, &now) < 0)
+    {
+        perror("Failed to get monotonic time");
+        exit(1);
+    }
+    return now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// Maps the shared lock statistics when NP_LOCKSTATS is set in the environment. Without it the locks aren't timed at
+// all and lock_stats_find returns NULL.
+void lock_stats_open()
+{
+    if (lock_stats_block != NULL || getenv("NP_LOCKSTATS") == NULL)
+        return;
+
+    int fd = shm_open(LOCK_STATS_NAME, O_RDWR | O_CREAT, FILE_MODE);
+    if (fd < 0)
+    {
+        perror("shm_open failed for lock statistics");
+        exit(1);
+    }
+    // A new object is filled with zeros, so every process can size it without caring who was first
+    if (ftruncate(fd, sizeof(struct lock_stats_block)) < 0)
+    {
+        perror("Failed to size lock statistics");
+        exit(1);
+    }
+    lock_stats_block = mmap(NULL, sizeof(struct lock_stats_block), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (lock_stats_block == MAP_FAILED)
+    {
+        perror("mmap failed for lock statistics");
+        exit(1);
+    }
+    close(fd);
+
+    lock_stats_check_layout(lock_stats_block);
+}
+
+// Returns the statistics of the named lock, claiming a free entry if no process has used the name yet.
+struct lock_stats *lock_stats_find(const char *name)
+{
+    if (lock_stats_block == NULL)
+        return NULL;
+
+    for (int i = 0; i < LOCK_STATS_MAX_LOCKS; i++)
+    {
+        struct lock_stats *stats = &lock_stats_block->locks[i];
+        uint32_t state = 0;
+        if (__atomic_compare_exchange_n(&stats->state, &state, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE))
+        {
+            strncpy(stats->name, name, LOCK_STATS_NAME_LENGTH - 1);
+            __atomic_store_n(&stats->state, 2, __ATOMIC_RELEASE);
+            return stats;
+        }
+        while (state == 1)
+        {
+            sched_yield();
+            state = __atomic_load_n(&stats->state, __ATOMIC_ACQUIRE);
+        }
+        if (strncmp(stats->name, name, LOCK_STATS_NAME_LENGTH - 1) == 0)
+            return stats;
+    }
+    fprintf(stderr, "No room for the statistics of lock %s, it won't be profiled\n", name);
+    return NULL;
+}
+
+void lock_stats_record(uint64_t *buckets, uint64_t *total_ns, uint64_t *max_ns, uint64_t ns)
+{
+    int bucket = ns == 0 ? 0 : 63 - __builtin_clzll(ns);
+    __atomic_add_fetch(&buckets[bucket], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(total_ns, ns, __ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(max_ns, __ATOMIC_RELAXED);
+    while (ns > max && !__atomic_compare_exchange_n(max_ns, &max, ns, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+// Records an acquisition that started waiting at "wait_start_ns". Returns the time the lock was acquired, which is
+// handed back to lock_stats_released.
+int64_t lock_stats_acquired(struct lock_stats *stats, int64_t wait_start_ns)
+{
+    int64_t now = get_monotonic_time_ns();
+    __atomic_add_fetch(&stats->acquisitions, 1, __ATOMIC_RELAXED);
+    lock_stats_record(stats->wait_buckets, &stats->wait_total_ns, &stats->wait_max_ns, now - wait_start_ns);
+    return now;
+}
+
+void lock_stats_released(struct lock_stats *stats, int64_t acquired_at_ns)
+{
+    lock_stats_record(stats->hold_buckets, &stats->hold_total_ns, &stats->hold_max_ns, get_monotonic_time_ns() - acquired_at_ns);
+}
+
+// Creates this process' trace ring when NP_TRACE is set in the environment. NP_TRACE_RECORDS can set how many records
+// the ring holds. Has to be called again after a fork, the child gets a ring of its own.
+void trace_open()
+{
+    if ((trace_ring != NULL && trace_ring->pid == getpid()) || getenv("NP_TRACE") == NULL)
+        return;
+
+    uint64_t capacity = getenv("NP_TRACE_RECORDS") != NULL ? strtoull(getenv("NP_TRACE_RECORDS"), NULL, 10) : 0;
+    if (capacity == 0)
+        capacity = TRACE_DEFAULT_CAPACITY;
+    size_t size = sizeof(struct trace_ring) + capacity * sizeof(struct trace_record);
+
+    char name[32];
+    snprintf(name, sizeof(name), TRACE_NAME_FORMAT, getpid());
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_TRUNC, FILE_MODE);
+    if (fd < 0)
+    {
+        perror("shm_open failed for trace ring");
+        exit(1);
+    }
+    if (ftruncate(fd, size) < 0)
+    {
+        perror("Failed to size trace ring");
+        exit(1);
+    }
+    trace_ring = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (trace_ring == MAP_FAILED)
+    {
+        perror("mmap failed for trace ring");
+        exit(1);
+    }
+    close(fd);
+
+    trace_ring->pid = getpid();
+    trace_ring->capacity = capacity;
+    trace_ring->record_size = sizeof(struct trace_record);
+    __atomic_store_n(&trace_ring->magic, TRACE_MAGIC, __ATOMIC_RELEASE);
+}
+
+// Records an event if tracing is on. Returns 0 when it is off so the caller can print the event instead.
+int trace_event(uint16_t tag, int64_t value, uint16_t detail)
+{
+    if (trace_ring == NULL)
+        return 0;
+
+    uint64_t head = trace_ring->head;
+    struct trace_record *record = &trace_ring->records[head % trace_ring->capacity];
+    record->time_ns = get_monotonic_time_ns();
+    record->value = value;
+    record->pid = trace_ring->pid;
+    record->tag = tag;
+    record->detail = detail;
+    __atomic_store_n(&trace_ring->head, head + 1, __ATOMIC_RELEASE);
+    return 1;
+}
 
 void my_lock_init(char *pathname)
 {
@@ -37,11 +233,15 @@ void my_lock_init(char *pathname)
     unlock_it.l_whence = SEEK_SET;
     unlock_it.l_start = 0;
     unlock_it.l_len = 0;
+
+    lock_stats_open();
+    lock_stats = lock_stats_find("exercise3 fcntl");
 }
 
 void my_lock_wait()
 {
     int rc;
+    int64_t wait_start_ns = lock_stats != NULL ? get_monotonic_time_ns() : 0;
 
     while ((rc = fcntl(lock_fd, F_SETLKW, &lock_it)) < 0)
     {
@@ -53,10 +253,15 @@ void my_lock_wait()
             exit(1);
         }
     }
+
+    if (lock_stats != NULL)
+        lock_acquired_at_ns = lock_stats_acquired(lock_stats, wait_start_ns);
 }
 
 void my_lock_release()
 {
+    if (lock_stats != NULL)
+        lock_stats_released(lock_stats, lock_acquired_at_ns);
     if (fcntl(lock_fd, F_SETLKW, &unlock_it) < 0)
     {
         perror("fcntl error for my_lock_release");
@@ -64,18 +269,186 @@ void my_lock_release()
     }
 }
 /* end my_lock_wait */
+
+// Makes sure the file and this process' mapping of it cover at least "needed" bytes. The file is extended with
+// fallocate, which only ever grows it, so processes growing it at the same time can't shrink it under each other.
+void log_ensure_mapped(struct append_log *log, size_t needed)
+{
+    if (needed <= log->mapped)
+        return;
+    size_t new_size = (needed + LOG_GROWTH_CHUNK - 1) / LOG_GROWTH_CHUNK * LOG_GROWTH_CHUNK;
+    int rc;
+    while ((rc = posix_fallocate(log->fd, 0, new_size)) == EINTR)
+        ;
+    if (rc != 0)
+    {
+        fprintf(stderr, "fallocate failed: %s\n", strerror(rc));
+        exit(1);
+    }
+    char *base = mremap(log->base, log->mapped, new_size, MREMAP_MAYMOVE);
+    if (base == MAP_FAILED)
+    {
+        perror("mremap failed");
+        exit(1);
+    }
+    log->base = base;
+    log->mapped = new_size;
+}
+
+void log_open(struct append_log *log, char *pathname)
+{
+    if ((log->fd = open(pathname, O_RDWR | O_CREAT, FILE_MODE)) < 0)
+    {
+        perror("open failed");
+        exit(1);
+    }
+    struct stat file_stat;
+    if (fstat(log->fd, &file_stat) < 0)
+    {
+        perror("fstat failed");
+        exit(1);
+    }
+    // Map what the file already has, at least the header. An empty file grows to its first chunk of zeroes, which is
+    // a valid empty log.
+    log->mapped = file_stat.st_size > LOG_DATA_OFFSET ? (size_t)file_stat.st_size : LOG_DATA_OFFSET;
+    if (file_stat.st_size < LOG_DATA_OFFSET && posix_fallocate(log->fd, 0, LOG_GROWTH_CHUNK) != 0)
+    {
+        perror("fallocate failed");
+        exit(1);
+    }
+    log->base = mmap(NULL, log->mapped, PROT_READ | PROT_WRITE, MAP_SHARED, log->fd, 0);
+    if (log->base == MAP_FAILED)
+    {
+        perror("mmap failed");
+        exit(1);
+    }
+
+    struct log_header *header = (struct log_header *)log->base;
+    uint32_t magic = 0;
+    if (!__atomic_compare_exchange_n(&header->magic, &magic, LOG_MAGIC, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED) && magic != LOG_MAGIC)
+    {
+        fprintf(stderr, "%s is not an append log, delete it first\n", pathname);
+        exit(1);
+    }
+}
+
+// Appends one record without any lock: the space is reserved with one atomic add on the tail of the log, after which
+// nobody else writes to it. Returns the offset of the record.
+uint64_t log_append(struct append_log *log, int sequence, char *data, uint32_t length)
+{
+    uint64_t size = (sizeof(struct log_record) + length + RECORD_ALIGNMENT - 1) / RECORD_ALIGNMENT * RECORD_ALIGNMENT;
+    struct log_header *header = (struct log_header *)log->base;
+    uint64_t offset = LOG_DATA_OFFSET + __atomic_fetch_add(&header->tail, size, __ATOMIC_RELAXED);
+    log_ensure_mapped(log, offset + size);
+
+    struct log_record *record = (struct log_record *)(log->base + offset);
+    __atomic_store_n(&record->length, length, __ATOMIC_RELAXED);
+    record->pid = getpid();
+    record->sequence = sequence;
+    memcpy(record->data, data, length);
+    __atomic_store_n(&record->committed, 1, __ATOMIC_RELEASE);
+    return offset;
+}
+
+// Prints every record in the log. Records still being written are reported and skipped if their length is known.
+// Without the length, because the writer hasn't got that far or died or failed before it, the rest of the log can't
+// be walked: the dump stops there and reports how many reserved bytes were left unread.
+void log_dump(struct append_log *log)
+{
+    struct log_header *header = (struct log_header *)log->base;
+    uint64_t end = LOG_DATA_OFFSET + __atomic_load_n(&header->tail, __ATOMIC_ACQUIRE);
+    log_ensure_mapped(log, end);
+    uint64_t committed = 0, in_flight = 0, unread = 0;
+    uint64_t offset = LOG_DATA_OFFSET;
+    while (offset < end)
+    {
+        struct log_record *record = (struct log_record *)(log->base + offset);
+        // The length is only read after "committed", otherwise it could be older than the record it is printed with
+        int is_committed = __atomic_load_n(&record->committed, __ATOMIC_ACQUIRE);
+        uint32_t length = __atomic_load_n(&record->length, __ATOMIC_RELAXED);
+        if (!is_committed)
+        {
+            in_flight++;
+            if (length == 0)
+            {
+                unread = end - offset;
+                printf("%lu: in flight, length not written yet, %lu bytes up to the tail can't be read\n", offset, unread);
+                break;
+            }
+            printf("%lu: in flight\n", offset);
+        }
+        else
+        {
+            committed++;
+            printf("%lu: pid %d, sequence %d: %.*s\n", offset, record->pid, record->sequence, (int)length, record->data);
+        }
+        offset += (sizeof(struct log_record) + length + RECORD_ALIGNMENT - 1) / RECORD_ALIGNMENT * RECORD_ALIGNMENT;
+    }
+    fprintf(stderr, "%lu committed records, %lu in flight, %lu bytes reserved, %lu of them unread\n", committed, in_flight, end - LOG_DATA_OFFSET, unread);
+}
+
 int main(int argc, char **argv)
 {
     int fd, i, nloop, zero = 0;
     int *ptr;
     char character;
+    int append = 0;
+    int dump = 0;
 
+    static struct option long_options[] = {
+        {"append", no_argument, NULL, 'a'},
+        {"dump", no_argument, NULL, 'd'},
+        {NULL, 0, NULL, 0},
+    };
+    int option;
+    while ((option = getopt_long(argc, argv, "ad", long_options, NULL)) != -1)
+    {
+        switch (option)
+        {
+        case 'a':
+            append = 1;
+            break;
+        case 'd':
+            dump = 1;
+            break;
+        default:
+            exit(1);
+        }
+    }
+    // Shift the options away so the positional arguments are where they always were
+    argv += optind - 1;
+    argc -= optind - 1;
+
+    if (dump && argc == 2)
+    {
+        struct append_log log;
+        log_open(&log, argv[1]);
+        log_dump(&log);
+        exit(0);
+    }
     if (argc != 4)
     {
-        perror("usage: incr2 <pathname> <#loops> <character>");
+        fprintf(stderr, "usage: incr2 [-a] <pathname> <#loops> <character or, with -a, record text> | incr2 -d <pathname>\n");
         exit(1);
     }
     nloop = atoi(argv[2]);
+
+    // Append log mode: every iteration appends a record with the text from the command line, without a global lock.
+    if (append)
+    {
+        struct append_log log;
+        log_open(&log, argv[1]);
+        uint32_t length = strlen(argv[3]);
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (i = 0; i < nloop; i++)
+            log_append(&log, i, argv[3], length);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+        fprintf(stderr, "Appended %d records in %.3fs (%.0f records/s)\n", nloop, seconds, nloop / seconds);
+        exit(0);
+    }
+
     if (strlen(argv[3]) != 1)
     {
         fprintf(stderr, "Character must be a single character of size 1 byte\n");
@@ -111,6 +484,8 @@ int main(int argc, char **argv)
     my_lock_init(LOCKFILE);
 
     setbuf(stdout, NULL); /* stdout is unbuffered */
+    // With NP_TRACE set the numbers go to the trace ring instead of being printed under the lock
+    trace_open();
 
     for (i = 0; i < nloop; i++)
     {
@@ -122,7 +497,8 @@ int main(int argc, char **argv)
             exit(1);
         }
         ((char *)ptr)[newVal + sizeof(int)] = character;
-        printf("Number: %d\n", newVal);
+        if (!trace_event(TRACE_COUNTER, newVal, character))
+            printf("Number: %d\n", newVal);
         my_lock_release();
     }
     exit(0);
@@ -1,7 +1,9 @@
 #include <arpa/inet.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <getopt.h>
 #include <netinet/in.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -10,6 +12,10 @@
 #include <sys/wait.h>
 #include <unistd.h>
 
+#if defined(__x86_64__)
+#include <x86intrin.h>
+#endif
+
 // I optionally added a signal handler for SIGPIPE.
 void sigpileHandler(__attribute__((unused)) int signum)
 {
@@ -69,53 +75,161 @@ ssize_t loopedWrite(int file, void* data, size_t length)
     return writeResult;
 }
 
+// CRC32C (Castagnoli) used to check that the data arrives unmodified. Computed with the SSE4.2 crc32
+// instruction when the CPU has it, otherwise with a slicing-by-8 table which processes 8 bytes per step.
+uint32_t crc32cTable[8][256];
+uint32_t (*crc32cUpdate)(uint32_t crc, const uint8_t* data, size_t length);
+
+uint32_t crc32cSoftware(uint32_t crc, const uint8_t* data, size_t length)
+{
+    while (length >= 8)
+    {
+        uint64_t word;
+        memcpy(&word, data, sizeof(word));
+        word ^= crc;
+        crc = crc32cTable[7][word & 0xff] ^ crc32cTable[6][(word >> 8) & 0xff] ^ crc32cTable[5][(word >> 16) & 0xff] ^ crc32cTable[4][(word >> 24) & 0xff] ^ crc32cTable[3][(word >> 32) & 0xff] ^ crc32cTable[2][(word >> 40) & 0xff] ^ crc32cTable[1][(word >> 48) & 0xff] ^ crc32cTable[0][word >> 56];
+        data += 8;
+        length -= 8;
+    }
+    while (length-- > 0)
+    {
+        crc = crc32cTable[0][(crc ^ *data++) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2"))) uint32_t crc32cHardware(uint32_t crc, const uint8_t* data, size_t length)
+{
+    uint64_t crc64 = crc;
+    while (length >= 8)
+    {
+        uint64_t word;
+        memcpy(&word, data, sizeof(word));
+        crc64 = _mm_crc32_u64(crc64, word);
+        data += 8;
+        length -= 8;
+    }
+    crc = (uint32_t)crc64;
+    while (length-- > 0)
+    {
+        crc = _mm_crc32_u8(crc, *data++);
+    }
+    return crc;
+}
+#endif
+
+// Builds the lookup tables and picks the fastest implementation available on this CPU.
+void crc32cInit()
+{
+    for (uint32_t i = 0; i < 256; i++)
+    {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++)
+        {
+            crc = (crc & 1) ? (crc >> 1) ^ 0x82f63b78 : crc >> 1;
+        }
+        crc32cTable[0][i] = crc;
+    }
+    for (uint32_t i = 0; i < 256; i++)
+    {
+        for (int table = 1; table < 8; table++)
+        {
+            crc32cTable[table][i] = crc32cTable[0][crc32cTable[table - 1][i] & 0xff] ^ (crc32cTable[table - 1][i] >> 8);
+        }
+    }
+
+    crc32cUpdate = crc32cSoftware;
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2"))
+        crc32cUpdate = crc32cHardware;
+#endif
+}
+
+// Continues the running checksum "crc" (0 for the start of the stream) over "length" bytes of "data".
+uint32_t crc32c(uint32_t crc, const void* data, size_t length)
+{
+    return ~crc32cUpdate(~crc, data, length);
+}
+
+// With integrity checking enabled every chunk is sent as a frame of a 4 byte payload length, the payload and a 4 byte
+// trailer holding the running CRC32C of all payload bytes sent so far. Both numbers are in network byte order.
+#define FRAME_HEADER_SIZE 4
+#define FRAME_TRAILER_SIZE 4
+
 // Generates random data and writes it to output in chunks of chunkSize until totalLength bytes have been written.
-void dataGenerator(int output, int totalLength, int chunkSize)
+// If "integrity" is set, every chunk is framed with its length and the running CRC32C.
+void dataGenerator(int output, int totalLength, int chunkSize, int integrity)
 {
-    char* buffer = malloc(chunkSize);
-    if (buffer == NULL)
+    char* frame = malloc(FRAME_HEADER_SIZE + chunkSize + FRAME_TRAILER_SIZE);
+    char* buffer = integrity ? frame + FRAME_HEADER_SIZE : frame;
+    uint32_t crc = 0;
+    if (frame == NULL)
     {
         perror("Failed to allocate buffer");
         exit(1);
     }
-    ssize_t bytesWritten;
     while (totalLength > 0)
     {
         for (int i = 0; i < chunkSize; i++)
         {
             buffer[i] = (char)(rand() % 256);
         }
-        bytesWritten = loopedWrite(output, buffer, chunkSize);
-        if (bytesWritten < 0)
+
+        size_t frameLength = chunkSize;
+        if (integrity)
+        {
+            uint32_t header = htonl(chunkSize);
+            memcpy(frame, &header, sizeof(header));
+            crc = crc32c(crc, buffer, chunkSize);
+            uint32_t trailer = htonl(crc);
+            memcpy(buffer + chunkSize, &trailer, sizeof(trailer));
+            frameLength = FRAME_HEADER_SIZE + chunkSize + FRAME_TRAILER_SIZE;
+        }
+        if (loopedWrite(output, frame, frameLength) < 0)
         {
             perror("Failed to write to output");
-            free(buffer);
+            free(frame);
             exit(1);
         }
-        totalLength -= bytesWritten;
+        totalLength -= chunkSize;
     }
-    free(buffer);
+    free(frame);
 }
 
 int main(__attribute__((unused)) int argc, __attribute__((unused)) char* argv[])
 {
     createSignalHandler();
+    crc32cInit();
 
     int serverPort;
     char* serverAddressString;
     int socketfd;
     struct sockaddr_in serverAddress;
 
+    int integrity = 0;
+    static struct option longOptions[] = {
+        {"crc", no_argument, NULL, 'c'},
+        {NULL, 0, NULL, 0},
+    };
+    int option;
+    while ((option = getopt_long(argc, argv, "c", longOptions, NULL)) != -1)
+    {
+        if (option != 'c')
+            return 1;
+        integrity = 1;
+    }
+
     // Read the server address and port from the command line arguments.
-    if (argc != 5)
+    if (argc - optind != 4)
     {
-        fprintf(stderr, "Usage: %s <server ip address> <server port> <total send amount> <chunk size>\n", argv[0]);
+        fprintf(stderr, "Usage: %s [--crc] <server ip address> <server port> <total send amount> <chunk size>\n", argv[0]);
         return 1;
     }
-    serverAddressString = argv[1];
-    serverPort = atoi(argv[2]);
-    int totalSendAmount = atoi(argv[3]);
-    int chunkSize = atoi(argv[4]);
+    serverAddressString = argv[optind];
+    serverPort = atoi(argv[optind + 1]);
+    int totalSendAmount = atoi(argv[optind + 2]);
+    int chunkSize = atoi(argv[optind + 3]);
 
     if (totalSendAmount <= 0 || chunkSize <= 0)
     {
@@ -154,7 +268,7 @@ int main(__attribute__((unused)) int argc, __attribute__((unused)) char* argv[])
     }
 
     printf("Connected to server, starting to send data\n");
-    dataGenerator(socketfd, totalSendAmount, chunkSize);
+    dataGenerator(socketfd, totalSendAmount, chunkSize, integrity);
     printf("Data sent to server, Sending fin packet and waiting for server to close the connection\n");
 
     // Send fin packet and wait for the server to close the connection
@@ -1,7 +1,9 @@
 #include <arpa/inet.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <getopt.h>
 #include <netinet/in.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -11,6 +13,10 @@
 #include <sys/wait.h>
 #include <unistd.h>
 
+#if defined(__x86_64__)
+#include <x86intrin.h>
+#endif
+
 // I optionally added a signal handler for SIGPIPE.
 void sigpileHandler(__attribute__((unused)) int signum)
 {
@@ -39,7 +45,169 @@ void createSignalHandler()
     }
 }
 
-void dataEater(int input, int readAmount)
+// CRC32C (Castagnoli) used to check that the data arrives unmodified. Computed with the SSE4.2 crc32
+// instruction when the CPU has it, otherwise with a slicing-by-8 table which processes 8 bytes per step.
+uint32_t crc32cTable[8][256];
+uint32_t (*crc32cUpdate)(uint32_t crc, const uint8_t* data, size_t length);
+
+uint32_t crc32cSoftware(uint32_t crc, const uint8_t* data, size_t length)
+{
+    while (length >= 8)
+    {
+        uint64_t word;
+        memcpy(&word, data, sizeof(word));
+        word ^= crc;
+        crc = crc32cTable[7][word & 0xff] ^ crc32cTable[6][(word >> 8) & 0xff] ^ crc32cTable[5][(word >> 16) & 0xff] ^ crc32cTable[4][(word >> 24) & 0xff] ^ crc32cTable[3][(word >> 32) & 0xff] ^ crc32cTable[2][(word >> 40) & 0xff] ^ crc32cTable[1][(word >> 48) & 0xff] ^ crc32cTable[0][word >> 56];
+        data += 8;
+        length -= 8;
+    }
+    while (length-- > 0)
+    {
+        crc = crc32cTable[0][(crc ^ *data++) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2"))) uint32_t crc32cHardware(uint32_t crc, const uint8_t* data, size_t length)
+{
+    uint64_t crc64 = crc;
+    while (length >= 8)
+    {
+        uint64_t word;
+        memcpy(&word, data, sizeof(word));
+        crc64 = _mm_crc32_u64(crc64, word);
+        data += 8;
+        length -= 8;
+    }
+    crc = (uint32_t)crc64;
+    while (length-- > 0)
+    {
+        crc = _mm_crc32_u8(crc, *data++);
+    }
+    return crc;
+}
+#endif
+
+// Builds the lookup tables and picks the fastest implementation available on this CPU.
+void crc32cInit()
+{
+    for (uint32_t i = 0; i < 256; i++)
+    {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++)
+        {
+            crc = (crc & 1) ? (crc >> 1) ^ 0x82f63b78 : crc >> 1;
+        }
+        crc32cTable[0][i] = crc;
+    }
+    for (uint32_t i = 0; i < 256; i++)
+    {
+        for (int table = 1; table < 8; table++)
+        {
+            crc32cTable[table][i] = crc32cTable[0][crc32cTable[table - 1][i] & 0xff] ^ (crc32cTable[table - 1][i] >> 8);
+        }
+    }
+
+    crc32cUpdate = crc32cSoftware;
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2"))
+        crc32cUpdate = crc32cHardware;
+#endif
+}
+
+// Continues the running checksum "crc" (0 for the start of the stream) over "length" bytes of "data".
+uint32_t crc32c(uint32_t crc, const void* data, size_t length)
+{
+    return ~crc32cUpdate(~crc, data, length);
+}
+
+// With integrity checking enabled the client sends every chunk as a frame of a 4 byte payload length, the payload and a
+// 4 byte trailer holding the running CRC32C of all payload bytes sent so far. Both numbers are in network byte order.
+// The checker is fed the stream in whatever pieces read returns and verifies each trailer as it completes.
+enum FrameState
+{
+    FRAME_HEADER,
+    FRAME_PAYLOAD,
+    FRAME_TRAILER
+};
+
+struct IntegrityChecker
+{
+    enum FrameState state;
+    uint8_t field[4];
+    size_t fieldFilled;
+    uint32_t payloadRemaining;
+    uint32_t crc;
+    uint64_t payloadBytes;
+    uint64_t frames;
+};
+
+void integrityCheckerInit(struct IntegrityChecker* checker)
+{
+    memset(checker, 0, sizeof(*checker));
+    checker->state = FRAME_HEADER;
+}
+
+// Feeds the next "length" bytes of the stream to the checker. Returns -1 if a trailer didn't match the data.
+int integrityCheckerFeed(struct IntegrityChecker* checker, uint8_t* data, size_t length)
+{
+    while (length > 0)
+    {
+        if (checker->state == FRAME_PAYLOAD)
+        {
+            size_t amount = length < checker->payloadRemaining ? length : checker->payloadRemaining;
+            checker->crc = crc32c(checker->crc, data, amount);
+            checker->payloadRemaining -= amount;
+            checker->payloadBytes += amount;
+            data += amount;
+            length -= amount;
+            if (checker->payloadRemaining == 0)
+                checker->state = FRAME_TRAILER;
+            continue;
+        }
+
+        // Collect the 4 byte header or trailer, which may be split across reads.
+        size_t amount = sizeof(checker->field) - checker->fieldFilled;
+        if (amount > length)
+            amount = length;
+        memcpy(checker->field + checker->fieldFilled, data, amount);
+        checker->fieldFilled += amount;
+        data += amount;
+        length -= amount;
+        if (checker->fieldFilled < sizeof(checker->field))
+            continue;
+        checker->fieldFilled = 0;
+
+        uint32_t value;
+        memcpy(&value, checker->field, sizeof(value));
+        value = ntohl(value);
+        if (checker->state == FRAME_HEADER)
+        {
+            checker->payloadRemaining = value;
+            checker->state = value > 0 ? FRAME_PAYLOAD : FRAME_TRAILER;
+        }
+        else
+        {
+            if (value != checker->crc)
+            {
+                fprintf(stderr, "Integrity check failed in frame %lu ending at payload byte %lu: expected crc %08x, computed %08x\n", checker->frames, checker->payloadBytes, value, checker->crc);
+                return -1;
+            }
+            checker->frames++;
+            checker->state = FRAME_HEADER;
+        }
+    }
+    return 0;
+}
+
+// Returns 1 if the stream ended on a frame boundary.
+int integrityCheckerComplete(struct IntegrityChecker* checker)
+{
+    return checker->state == FRAME_HEADER && checker->fieldFilled == 0;
+}
+
+void dataEater(int input, int readAmount, int integrity)
 {
     char* buffer = malloc(readAmount);
     if (buffer == NULL)
@@ -48,10 +216,16 @@ void dataEater(int input, int readAmount)
         exit(1);
     }
 
+    struct IntegrityChecker checker;
+    integrityCheckerInit(&checker);
     ssize_t bytesRead;
     while ((bytesRead = read(input, buffer, readAmount)) > 0)
     {
-        // Do nothing with the data.
+        if (integrity && integrityCheckerFeed(&checker, (uint8_t*)buffer, bytesRead) < 0)
+        {
+            free(buffer);
+            exit(1);
+        }
     }
     if (bytesRead < 0)
     {
@@ -60,22 +234,45 @@ void dataEater(int input, int readAmount)
         exit(1);
     }
     free(buffer);
+
+    if (integrity)
+    {
+        if (!integrityCheckerComplete(&checker))
+        {
+            fprintf(stderr, "Integrity check failed: stream ended in the middle of a frame after %lu payload bytes\n", checker.payloadBytes);
+            exit(1);
+        }
+        fprintf(stderr, "Integrity check passed: %lu payload bytes in %lu frames, crc %08x\n", checker.payloadBytes, checker.frames, checker.crc);
+    }
 }
 
 int main(__attribute__((unused)) int argc, __attribute__((unused)) char* argv[])
 {
     createSignalHandler();
+    crc32cInit();
 
     int serverPort;
+    int integrity = 0;
+    static struct option longOptions[] = {
+        {"crc", no_argument, NULL, 'c'},
+        {NULL, 0, NULL, 0},
+    };
+    int option;
+    while ((option = getopt_long(argc, argv, "c", longOptions, NULL)) != -1)
+    {
+        if (option != 'c')
+            exit(1);
+        integrity = 1;
+    }
 
     // Read the server port from the command line arguments.
-    if (argc != 3)
+    if (argc - optind != 2)
     {
-        fprintf(stderr, "usage: %s <server port> <read amount per read call>\n", argv[0]);
+        fprintf(stderr, "usage: %s [--crc] <server port> <read amount per read call>\n", argv[0]);
         exit(1);
     }
-    serverPort = atoi(argv[1]);
-    int readAmount = atoi(argv[2]);
+    serverPort = atoi(argv[optind]);
+    int readAmount = atoi(argv[optind + 1]);
 
     // Create a socket
     struct sockaddr_in serverAddress, clientAddress;
@@ -134,7 +331,7 @@ int main(__attribute__((unused)) int argc, __attribute__((unused)) char* argv[])
             close(listenSocketfd);
 
             fprintf(stderr, "Child process started eating data for client connection\n");
-            dataEater(clientSocketfd, readAmount);
+            dataEater(clientSocketfd, readAmount, integrity);
             fprintf(stderr, "Received EOF from client (client disconnected / sent all data)\n");
             if (close(clientSocketfd) < 0)
             {
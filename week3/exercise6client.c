@@ -1,16 +1,25 @@
 #include <arpa/inet.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <getopt.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
 #include <sys/time.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
 // I optionally added a signal handler for SIGPIPE.
 void sigpileHandler(__attribute__((unused)) int signum)
 {
@@ -61,6 +70,73 @@ int64_t getTimeSinceLastCall()
     return timeTaken;
 }
 
+// CPU time consumed so far by this process (user and system) and by the calling thread,
+// together with the cycle counter value at the time of sampling.
+struct CpuUsage
+{
+    int64_t userUs;
+    int64_t systemUs;
+    int64_t threadUs;
+    uint64_t cycles;
+};
+
+// Returns the value of the cycle counter or 0 if the architecture doesn't have one we know how to read.
+uint64_t readCycleCounter()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+// Samples the CPU time used so far. getrusage is used for the process wide user and system time and
+// CLOCK_THREAD_CPUTIME_ID for the time of just the calling thread.
+void getCpuUsage(struct CpuUsage* usage)
+{
+    struct rusage resourceUsage;
+    if (getrusage(RUSAGE_SELF, &resourceUsage) < 0)
+    {
+        perror("Failed to get resource usage");
+        exit(1);
+    }
+    struct timespec threadTime;
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &threadTime) < 0)
+    {
+        perror("Failed to get thread CPU time");
+        exit(1);
+    }
+
+    usage->userUs = resourceUsage.ru_utime.tv_sec * 1000000 + resourceUsage.ru_utime.tv_usec;
+    usage->systemUs = resourceUsage.ru_stime.tv_sec * 1000000 + resourceUsage.ru_stime.tv_usec;
+    usage->threadUs = threadTime.tv_sec * 1000000 + threadTime.tv_nsec / 1000;
+    usage->cycles = readCycleCounter();
+}
+
+// Prints the CPU time used between the two samples and what it cost per transferred byte.
+// The cycle counter is calibrated against the wall clock time of the same interval, so cycles/byte
+// is "CPU seconds spent * counter frequency / bytes".
+void printCpuCost(FILE* output, struct CpuUsage* before, struct CpuUsage* after, int64_t wallTimeUs, size_t bytes)
+{
+    int64_t userUs = after->userUs - before->userUs;
+    int64_t systemUs = after->systemUs - before->systemUs;
+    int64_t threadUs = after->threadUs - before->threadUs;
+    double cpuSeconds = (double)(userUs + systemUs) / 1000000;
+    double wallSeconds = (double)wallTimeUs / 1000000;
+
+    fprintf(output, "CPU time: user %.3fs, system %.3fs, thread %.3fs (%.1f%% of one core)\n", (double)userUs / 1000000, (double)systemUs / 1000000, (double)threadUs / 1000000, wallSeconds > 0 ? cpuSeconds / wallSeconds * 100 : 0);
+    if (bytes == 0)
+        return;
+
+    fprintf(output, "CPU cost: %.3f CPU-seconds/GB", cpuSeconds / ((double)bytes / 1024 / 1024 / 1024));
+    if (after->cycles > before->cycles && wallSeconds > 0)
+    {
+        double cyclesPerSecond = (double)(after->cycles - before->cycles) / wallSeconds;
+        fprintf(output, ", %.3f cycles/byte", cpuSeconds * cyclesPerSecond / bytes);
+    }
+    fprintf(output, "\n");
+}
+
 // Inclusively returns the number of characters until the next newline character.
 // Returns -1 if no newline character is found in "length" bytes.
 // Example: "abc\ndef\n" returns 4.
@@ -92,68 +168,480 @@ ssize_t loopedWrite(int file, void* data, size_t length)
     return writeResult;
 }
 
-// Generates random data and writes it to output in chunks of chunkSize until totalLength bytes have been written.
-void dataGenerator(int output, int totalLength, int chunkSize)
+// Returns the current time of the monotonic clock in microseconds.
+int64_t getMonotonicTimeUs()
+{
+    struct timespec now;
+    if (clock_gettime(CLOCK_MONOTONIC, &now) < 0)
+    {
+        perror("Failed to get monotonic time");
+        exit(1);
+    }
+    return now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+// Returns the current time of the monotonic clock in nanoseconds.
+int64_t getMonotonicTimeNs()
+{
+    struct timespec now;
+    if (clock_gettime(CLOCK_MONOTONIC, &now) < 0)
+    {
+        perror("Failed to get monotonic time");
+        exit(1);
+    }
+    return now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// Returns the current resident set size of this process in kilobytes or -1 if it could not be read.
+long getResidentSetSizeKb()
+{
+    FILE* statm = fopen("/proc/self/statm", "r");
+    if (statm == NULL)
+        return -1;
+    long totalPages, residentPages;
+    int matched = fscanf(statm, "%ld %ld", &totalPages, &residentPages);
+    fclose(statm);
+    if (matched != 2)
+        return -1;
+    return residentPages * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+// State for printing the throughput of the last interval every "intervalUs" microseconds, similar to iperf.
+struct IntervalReporter
+{
+    int64_t intervalUs;
+    int64_t startUs;
+    int64_t lastReportUs;
+    uint64_t bytesAtLastReport;
+};
+
+void intervalReporterInit(struct IntervalReporter* reporter, int64_t intervalUs)
+{
+    reporter->intervalUs = intervalUs;
+    reporter->startUs = getMonotonicTimeUs();
+    reporter->lastReportUs = reporter->startUs;
+    reporter->bytesAtLastReport = 0;
+}
+
+// Prints a line for the elapsed interval if one has passed. "now" is passed in by the caller as it usually has it anyway.
+void intervalReporterUpdate(struct IntervalReporter* reporter, FILE* output, int64_t now, uint64_t bytesTotal)
+{
+    if (reporter->intervalUs <= 0 || now - reporter->lastReportUs < reporter->intervalUs)
+        return;
+
+    uint64_t bytes = bytesTotal - reporter->bytesAtLastReport;
+    double seconds = (double)(now - reporter->lastReportUs) / 1000000;
+    fprintf(output, "[%8.1f-%8.1f s] %12.2f MB %10.2f MB/s  rss %ld KB\n", (double)(reporter->lastReportUs - reporter->startUs) / 1000000, (double)(now - reporter->startUs) / 1000000, (double)bytes / 1024 / 1024, (double)bytes / 1024 / 1024 / seconds, getResidentSetSizeKb());
+
+    reporter->lastReportUs = now;
+    reporter->bytesAtLastReport = bytesTotal;
+}
+
+// Parses a byte amount with an optional K, M or G (binary) suffix, eg. "4G" or "65536".
+// Returns -1 if the string is not a valid amount.
+int64_t parseSize(char* string)
+{
+    char* endPtr;
+    errno = 0;
+    long long parsed = strtoll(string, &endPtr, 10);
+    if (errno != 0 || endPtr == string || parsed < 0)
+        return -1;
+
+    int64_t multiplier = 1;
+    switch (*endPtr)
+    {
+    case 'k':
+    case 'K':
+        multiplier = 1024;
+        endPtr++;
+        break;
+    case 'm':
+    case 'M':
+        multiplier = 1024 * 1024;
+        endPtr++;
+        break;
+    case 'g':
+    case 'G':
+        multiplier = 1024 * 1024 * 1024;
+        endPtr++;
+        break;
+    }
+    if (*endPtr != '\0' || parsed > INT64_MAX / multiplier)
+        return -1;
+
+    return parsed * multiplier;
+}
+
+// CRC32C (Castagnoli) used to check that the data arrives unmodified. Computed with the SSE4.2 crc32
+// instruction when the CPU has it, otherwise with a slicing-by-8 table which processes 8 bytes per step.
+uint32_t crc32cTable[8][256];
+uint32_t (*crc32cUpdate)(uint32_t crc, const uint8_t* data, size_t length);
+
+uint32_t crc32cSoftware(uint32_t crc, const uint8_t* data, size_t length)
 {
-    char* buffer = malloc(chunkSize);
-    if (buffer == NULL)
+    while (length >= 8)
+    {
+        uint64_t word;
+        memcpy(&word, data, sizeof(word));
+        word ^= crc;
+        crc = crc32cTable[7][word & 0xff] ^ crc32cTable[6][(word >> 8) & 0xff] ^ crc32cTable[5][(word >> 16) & 0xff] ^ crc32cTable[4][(word >> 24) & 0xff] ^ crc32cTable[3][(word >> 32) & 0xff] ^ crc32cTable[2][(word >> 40) & 0xff] ^ crc32cTable[1][(word >> 48) & 0xff] ^ crc32cTable[0][word >> 56];
+        data += 8;
+        length -= 8;
+    }
+    while (length-- > 0)
+    {
+        crc = crc32cTable[0][(crc ^ *data++) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2"))) uint32_t crc32cHardware(uint32_t crc, const uint8_t* data, size_t length)
+{
+    uint64_t crc64 = crc;
+    while (length >= 8)
+    {
+        uint64_t word;
+        memcpy(&word, data, sizeof(word));
+        crc64 = _mm_crc32_u64(crc64, word);
+        data += 8;
+        length -= 8;
+    }
+    crc = (uint32_t)crc64;
+    while (length-- > 0)
+    {
+        crc = _mm_crc32_u8(crc, *data++);
+    }
+    return crc;
+}
+#endif
+
+// Builds the lookup tables and picks the fastest implementation available on this CPU.
+void crc32cInit()
+{
+    for (uint32_t i = 0; i < 256; i++)
+    {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++)
+        {
+            crc = (crc & 1) ? (crc >> 1) ^ 0x82f63b78 : crc >> 1;
+        }
+        crc32cTable[0][i] = crc;
+    }
+    for (uint32_t i = 0; i < 256; i++)
+    {
+        for (int table = 1; table < 8; table++)
+        {
+            crc32cTable[table][i] = crc32cTable[0][crc32cTable[table - 1][i] & 0xff] ^ (crc32cTable[table - 1][i] >> 8);
+        }
+    }
+
+    crc32cUpdate = crc32cSoftware;
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2"))
+        crc32cUpdate = crc32cHardware;
+#endif
+}
+
+// Continues the running checksum "crc" (0 for the start of the stream) over "length" bytes of "data".
+uint32_t crc32c(uint32_t crc, const void* data, size_t length)
+{
+    return ~crc32cUpdate(~crc, data, length);
+}
+
+// With integrity checking enabled every chunk is sent as a frame of a 4 byte payload length, the payload and a 4 byte
+// trailer holding the running CRC32C of all payload bytes sent so far. Both numbers are in network byte order.
+#define FRAME_HEADER_SIZE 4
+#define FRAME_TRAILER_SIZE 4
+
+// Generates random data and writes it to output in chunks of chunkSize until totalLength bytes have been written
+// or durationUs microseconds have passed. A zero totalLength or durationUs means no limit for that one.
+// The last chunk is shortened if totalLength is not a multiple of chunkSize. If "integrity" is set, every chunk is
+// framed with its length and the running CRC32C. Returns the number of payload bytes written.
+uint64_t dataGenerator(int output, int64_t totalLength, size_t chunkSize, int64_t durationUs, int64_t intervalUs, int integrity)
+{
+    char* frame = malloc(FRAME_HEADER_SIZE + chunkSize + FRAME_TRAILER_SIZE);
+    char* buffer = integrity ? frame + FRAME_HEADER_SIZE : frame;
+    uint32_t crc = 0;
+    if (frame == NULL)
     {
         perror("Failed to allocate buffer");
         exit(1);
     }
-    ssize_t bytesWritten;
-    while (totalLength > 0)
+
+    struct IntervalReporter reporter;
+    intervalReporterInit(&reporter, intervalUs);
+
+    uint64_t bytesWrittenTotal = 0;
+    while (totalLength == 0 || bytesWrittenTotal < (uint64_t)totalLength)
     {
-        for (int i = 0; i < chunkSize; i++)
+        size_t writeLength = chunkSize;
+        if (totalLength > 0 && (uint64_t)totalLength - bytesWrittenTotal < writeLength)
+            writeLength = totalLength - bytesWrittenTotal;
+
+        for (size_t i = 0; i < writeLength; i++)
         {
             buffer[i] = (char)(rand() % 256);
         }
-        bytesWritten = loopedWrite(output, buffer, chunkSize);
-        if (bytesWritten < 0)
+
+        size_t frameLength = writeLength;
+        if (integrity)
+        {
+            uint32_t header = htonl(writeLength);
+            memcpy(frame, &header, sizeof(header));
+            crc = crc32c(crc, buffer, writeLength);
+            uint32_t trailer = htonl(crc);
+            memcpy(buffer + writeLength, &trailer, sizeof(trailer));
+            frameLength = FRAME_HEADER_SIZE + writeLength + FRAME_TRAILER_SIZE;
+        }
+        if (loopedWrite(output, frame, frameLength) < 0)
         {
             perror("Failed to write to output");
-            free(buffer);
+            free(frame);
             exit(1);
         }
-        totalLength -= bytesWritten;
+        bytesWrittenTotal += writeLength;
+
+        int64_t now = getMonotonicTimeUs();
+        intervalReporterUpdate(&reporter, stdout, now, bytesWrittenTotal);
+        if (durationUs > 0 && now - reporter.startUs >= durationUs)
+            break;
+    }
+    free(frame);
+    return bytesWrittenTotal;
+}
+
+// In request/response mode every request starts with a header telling the server how long the whole request is
+// (header included) and how many bytes to answer with. Both fields are in network byte order.
+struct RequestHeader
+{
+    uint32_t requestLength;
+    uint32_t responseLength;
+};
+
+// Reads exactly "length" bytes from "file" to "data". Returns the number of bytes read, which is less than "length"
+// only if EOF was reached, or -1 if an error occurred. With "busyPoll" set the socket is polled with non-blocking
+// reads in a loop instead of sleeping in the kernel, trading a full core for lower wake-up latency.
+ssize_t loopedRead(int file, void* data, size_t length, int busyPoll)
+{
+    size_t charactersRead = 0;
+    while (charactersRead < length)
+    {
+        ssize_t readResult = recv(file, data + charactersRead, length - charactersRead, busyPoll ? MSG_DONTWAIT : 0);
+        if (readResult < 0)
+        {
+            if (errno == EINTR || (busyPoll && (errno == EAGAIN || errno == EWOULDBLOCK)))
+                continue;
+            return -1;
+        }
+        if (readResult == 0)
+            break;
+        charactersRead += readResult;
     }
-    free(buffer);
+    return charactersRead;
+}
+
+int compareInt64(const void* a, const void* b)
+{
+    int64_t first = *(const int64_t*)a;
+    int64_t second = *(const int64_t*)b;
+    return (first > second) - (first < second);
+}
+
+// Returns the given percentile of the sorted latencies.
+int64_t percentile(int64_t* sorted, size_t count, double percent)
+{
+    size_t index = (size_t)(percent / 100 * count);
+    if (index >= count)
+        index = count - 1;
+    return sorted[index];
+}
+
+// Runs request/response transactions of the given sizes until "count" transactions are done or "durationUs" has passed,
+// whichever limit is set, and prints the transaction rate and latency percentiles as one row of the result table.
+void requestResponseRun(int socketfd, size_t requestSize, size_t responseSize, int64_t count, int64_t durationUs, int busyPoll)
+{
+    if (requestSize < sizeof(struct RequestHeader))
+        requestSize = sizeof(struct RequestHeader);
+
+    char* request = calloc(1, requestSize);
+    char* response = malloc(responseSize > 0 ? responseSize : 1);
+    size_t latencyCapacity = count > 0 ? (size_t)count : 65536;
+    int64_t* latencies = malloc(latencyCapacity * sizeof(int64_t));
+    if (request == NULL || response == NULL || latencies == NULL)
+    {
+        perror("Failed to allocate request/response buffers");
+        exit(1);
+    }
+    struct RequestHeader header = {htonl(requestSize), htonl(responseSize)};
+    memcpy(request, &header, sizeof(header));
+
+    size_t transactions = 0;
+    int64_t startNs = getMonotonicTimeNs();
+    int64_t now = startNs;
+    while ((count > 0 && transactions < (size_t)count) || (count == 0 && now - startNs < durationUs * 1000))
+    {
+        int64_t sentAt = now;
+        if (loopedWrite(socketfd, request, requestSize) < 0)
+        {
+            perror("Failed to send request");
+            exit(1);
+        }
+        ssize_t readResult = loopedRead(socketfd, response, responseSize, busyPoll);
+        if (readResult < 0)
+        {
+            perror("Failed to read response");
+            exit(1);
+        }
+        if ((size_t)readResult < responseSize)
+        {
+            fprintf(stderr, "Server closed the connection in the middle of a response\n");
+            exit(1);
+        }
+        now = getMonotonicTimeNs();
+
+        if (transactions == latencyCapacity)
+        {
+            latencyCapacity *= 2;
+            latencies = realloc(latencies, latencyCapacity * sizeof(int64_t));
+            if (latencies == NULL)
+            {
+                perror("Failed to grow latency buffer");
+                exit(1);
+            }
+        }
+        latencies[transactions++] = now - sentAt;
+    }
+    double seconds = (double)(now - startNs) / 1000000000;
+
+    qsort(latencies, transactions, sizeof(int64_t), compareInt64);
+    printf("%10zu %10zu %12zu %12.0f %10.1f %10.1f %10.1f %10.1f\n", requestSize, responseSize, transactions, transactions / seconds, percentile(latencies, transactions, 50) / 1000.0, percentile(latencies, transactions, 99) / 1000.0, percentile(latencies, transactions, 99.9) / 1000.0, latencies[transactions - 1] / 1000.0);
+
+    free(latencies);
+    free(response);
+    free(request);
 }
 
 int main(__attribute__((unused)) int argc, __attribute__((unused)) char* argv[])
 {
     createSignalHandler();
+    crc32cInit();
 
     int serverPort;
     char* serverAddressString;
     int socketfd;
     struct sockaddr_in serverAddress;
 
-    // Read the server address and port from the command line arguments.
-    if (argc != 5)
+    int64_t durationUs = 0;
+    int64_t intervalUs = 0;
+    int integrity = 0;
+    char* requestSizes = NULL;
+    int64_t responseSize = -1;
+    int64_t transactionCount = 0;
+    int noDelay = 0;
+    int busyPoll = 0;
+    static struct option longOptions[] = {
+        {"time", required_argument, NULL, 't'},
+        {"interval", required_argument, NULL, 'i'},
+        {"crc", no_argument, NULL, 'c'},
+        {"rr", required_argument, NULL, 'r'},
+        {"response", required_argument, NULL, 'R'},
+        {"count", required_argument, NULL, 'n'},
+        {"nodelay", no_argument, NULL, 'N'},
+        {"busy-poll", no_argument, NULL, 'b'},
+        {NULL, 0, NULL, 0},
+    };
+    int option;
+    while ((option = getopt_long(argc, argv, "t:i:cr:R:n:Nb", longOptions, NULL)) != -1)
     {
-        fprintf(stderr, "Usage: %s <server ip address> <server port> <total send amount> <chunk size>\n", argv[0]);
-        return 1;
+        switch (option)
+        {
+        case 'r':
+            requestSizes = optarg;
+            break;
+        case 'R':
+            if ((responseSize = parseSize(optarg)) < 0 || responseSize > UINT32_MAX)
+            {
+                fprintf(stderr, "Response size must be a valid size that fits in 32 bits\n");
+                return 1;
+            }
+            break;
+        case 'n':
+            if ((transactionCount = atoll(optarg)) <= 0)
+            {
+                fprintf(stderr, "Transaction count must be positive\n");
+                return 1;
+            }
+            break;
+        case 'N':
+            noDelay = 1;
+            break;
+        case 'b':
+            busyPoll = 1;
+            break;
+        case 'c':
+            integrity = 1;
+            break;
+        case 't':
+            durationUs = (int64_t)(atof(optarg) * 1000000);
+            if (durationUs <= 0)
+            {
+                fprintf(stderr, "Time must be a positive number of seconds\n");
+                return 1;
+            }
+            break;
+        case 'i':
+            intervalUs = (int64_t)(atof(optarg) * 1000000);
+            if (intervalUs <= 0)
+            {
+                fprintf(stderr, "Interval must be a positive number of seconds\n");
+                return 1;
+            }
+            break;
+        default:
+            return 1;
+        }
     }
-    serverAddressString = argv[1];
-    serverPort = atoi(argv[2]);
-    int totalSendAmount = atoi(argv[3]);
-    int chunkSize = atoi(argv[4]);
 
-    if (totalSendAmount <= 0 || chunkSize <= 0)
+    // Read the server address and port from the command line arguments.
+    if (argc - optind != (requestSizes != NULL ? 2 : 4))
     {
-        fprintf(stderr, "Total send amount and chunk size must be positive\n");
+        fprintf(stderr, "Usage: %s [--time <seconds>] [--interval <seconds>] [--crc] <server ip address> <server port> <total send amount> <chunk size>\n", argv[0]);
+        fprintf(stderr, "       %s --rr <request size>[,<request size>...] [--response <size>] [--count <n> | --time <seconds>] [--nodelay] [--busy-poll] <server ip address> <server port>\n", argv[0]);
+        fprintf(stderr, "Sizes accept K, M and G suffixes. With --time the total send amount can be 0 to send until the time runs out.\n");
+        fprintf(stderr, "In --rr mode the --count or --time limit applies to each request size separately and the response size defaults to the request size.\n");
         return 1;
     }
-    if (chunkSize > totalSendAmount)
+    serverAddressString = argv[optind];
+    serverPort = atoi(argv[optind + 1]);
+    int64_t totalSendAmount = 0;
+    int64_t chunkSize = 0;
+
+    if (requestSizes != NULL)
     {
-        fprintf(stderr, "Chunk size must be less than or equal to total send amount\n");
-        return 1;
+        if (transactionCount == 0 && durationUs == 0)
+            transactionCount = 10000;
     }
-    if (totalSendAmount % chunkSize != 0)
+    else
     {
-        fprintf(stderr, "Total send amount must be a multiple of chunk size\n");
-        return 1;
+        totalSendAmount = parseSize(argv[optind + 2]);
+        chunkSize = parseSize(argv[optind + 3]);
+
+        if (totalSendAmount < 0 || chunkSize <= 0)
+        {
+            fprintf(stderr, "Total send amount and chunk size must be valid positive sizes\n");
+            return 1;
+        }
+        if (integrity && chunkSize > UINT32_MAX)
+        {
+            fprintf(stderr, "Chunk size must fit in 32 bits when integrity checking\n");
+            return 1;
+        }
+        if (totalSendAmount == 0 && durationUs == 0)
+        {
+            fprintf(stderr, "Total send amount can only be 0 when sending for a fixed time\n");
+            return 1;
+        }
     }
 
     // Create a stream socket for the connection
@@ -180,8 +668,44 @@ int main(__attribute__((unused)) int argc, __attribute__((unused)) char* argv[])
 
     int64_t timeTakenForConnect = getTimeSinceLastCall();
 
+    int enable = 1;
+    if (noDelay && setsockopt(socketfd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable)) < 0)
+    {
+        perror("Failed to set TCP_NODELAY");
+        return 1;
+    }
+    int busyPollUs = 50;
+    if (busyPoll && setsockopt(socketfd, SOL_SOCKET, SO_BUSY_POLL, &busyPollUs, sizeof(busyPollUs)) < 0)
+        perror("Warning: Failed to set SO_BUSY_POLL, polling only in user space");
+
+    if (requestSizes != NULL)
+    {
+        printf("Connected to server in %ldus, running request/response transactions\n", timeTakenForConnect);
+        printf("%10s %10s %12s %12s %10s %10s %10s %10s\n", "request", "response", "transactions", "trans/s", "p50 us", "p99 us", "p99.9 us", "max us");
+        for (char* sizeString = strtok(requestSizes, ","); sizeString != NULL; sizeString = strtok(NULL, ","))
+        {
+            int64_t requestSize = parseSize(sizeString);
+            if (requestSize < 0 || requestSize > UINT32_MAX)
+            {
+                fprintf(stderr, "Invalid request size \"%s\"\n", sizeString);
+                return 1;
+            }
+            requestResponseRun(socketfd, requestSize, responseSize >= 0 ? responseSize : requestSize, transactionCount, durationUs, busyPoll);
+        }
+
+        if (close(socketfd) < 0)
+        {
+            perror("Failed to close socket");
+            return 1;
+        }
+        return 0;
+    }
+
+    struct CpuUsage cpuBefore, cpuAfter;
+    getCpuUsage(&cpuBefore);
+
     printf("Connected to server, starting to send data\n");
-    dataGenerator(socketfd, totalSendAmount, chunkSize);
+    uint64_t bytesSent = dataGenerator(socketfd, totalSendAmount, chunkSize, durationUs, intervalUs, integrity);
     printf("Data sent to server, Sending fin packet and waiting for server to close the connection\n");
 
     // Send fin packet and wait for the server to close the connection
@@ -194,6 +718,7 @@ int main(__attribute__((unused)) int argc, __attribute__((unused)) char* argv[])
         // Do nothing with the data.
     }
     int64_t timeTakenForTransfer = getTimeSinceLastCall();
+    getCpuUsage(&cpuAfter);
     if (bytesRead < 0)
     {
         perror("Failed to wait for server to close connection");
@@ -211,7 +736,9 @@ int main(__attribute__((unused)) int argc, __attribute__((unused)) char* argv[])
     // Print time taken for transfer and transfer speed
     printf("Time taken for connect: %ldus\n", timeTakenForConnect);
     printf("Time taken for transfer: %ldus\n", timeTakenForTransfer);
-    printf("Transfer speed: %.2fMB/s\n", ((float)totalSendAmount / 1024 / 1024) / ((float)timeTakenForTransfer / 1000000));
+    printf("Bytes sent: %lu\n", bytesSent);
+    printf("Transfer speed: %.2fMB/s\n", ((double)bytesSent / 1024 / 1024) / ((double)timeTakenForTransfer / 1000000));
+    printCpuCost(stdout, &cpuBefore, &cpuAfter, timeTakenForTransfer, bytesSent);
 
     return 0;
 }
\ No newline at end of file
@@ -1,17 +1,26 @@
 #include <arpa/inet.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <getopt.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
 // I optionally added a signal handler for SIGPIPE.
 void sigpileHandler(__attribute__((unused)) int signum)
 {
@@ -62,7 +71,293 @@ int64_t getTimeSinceLastCall()
     return timeTaken;
 }
 
-void dataEater(int input, int readAmount)
+// CPU time consumed so far by this process (user and system) and by the calling thread,
+// together with the cycle counter value at the time of sampling.
+struct CpuUsage
+{
+    int64_t userUs;
+    int64_t systemUs;
+    int64_t threadUs;
+    uint64_t cycles;
+};
+
+// Returns the value of the cycle counter or 0 if the architecture doesn't have one we know how to read.
+uint64_t readCycleCounter()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+// Samples the CPU time used so far. getrusage is used for the process wide user and system time and
+// CLOCK_THREAD_CPUTIME_ID for the time of just the calling thread.
+void getCpuUsage(struct CpuUsage* usage)
+{
+    struct rusage resourceUsage;
+    if (getrusage(RUSAGE_SELF, &resourceUsage) < 0)
+    {
+        perror("Failed to get resource usage");
+        exit(1);
+    }
+    struct timespec threadTime;
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &threadTime) < 0)
+    {
+        perror("Failed to get thread CPU time");
+        exit(1);
+    }
+
+    usage->userUs = resourceUsage.ru_utime.tv_sec * 1000000 + resourceUsage.ru_utime.tv_usec;
+    usage->systemUs = resourceUsage.ru_stime.tv_sec * 1000000 + resourceUsage.ru_stime.tv_usec;
+    usage->threadUs = threadTime.tv_sec * 1000000 + threadTime.tv_nsec / 1000;
+    usage->cycles = readCycleCounter();
+}
+
+// Prints the CPU time used between the two samples and what it cost per transferred byte.
+// The cycle counter is calibrated against the wall clock time of the same interval, so cycles/byte
+// is "CPU seconds spent * counter frequency / bytes".
+void printCpuCost(FILE* output, struct CpuUsage* before, struct CpuUsage* after, int64_t wallTimeUs, size_t bytes)
+{
+    int64_t userUs = after->userUs - before->userUs;
+    int64_t systemUs = after->systemUs - before->systemUs;
+    int64_t threadUs = after->threadUs - before->threadUs;
+    double cpuSeconds = (double)(userUs + systemUs) / 1000000;
+    double wallSeconds = (double)wallTimeUs / 1000000;
+
+    fprintf(output, "CPU time: user %.3fs, system %.3fs, thread %.3fs (%.1f%% of one core)\n", (double)userUs / 1000000, (double)systemUs / 1000000, (double)threadUs / 1000000, wallSeconds > 0 ? cpuSeconds / wallSeconds * 100 : 0);
+    if (bytes == 0)
+        return;
+
+    fprintf(output, "CPU cost: %.3f CPU-seconds/GB", cpuSeconds / ((double)bytes / 1024 / 1024 / 1024));
+    if (after->cycles > before->cycles && wallSeconds > 0)
+    {
+        double cyclesPerSecond = (double)(after->cycles - before->cycles) / wallSeconds;
+        fprintf(output, ", %.3f cycles/byte", cpuSeconds * cyclesPerSecond / bytes);
+    }
+    fprintf(output, "\n");
+}
+
+// Returns the current time of the monotonic clock in microseconds.
+int64_t getMonotonicTimeUs()
+{
+    struct timespec now;
+    if (clock_gettime(CLOCK_MONOTONIC, &now) < 0)
+    {
+        perror("Failed to get monotonic time");
+        exit(1);
+    }
+    return now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+// Returns the current resident set size of this process in kilobytes or -1 if it could not be read.
+long getResidentSetSizeKb()
+{
+    FILE* statm = fopen("/proc/self/statm", "r");
+    if (statm == NULL)
+        return -1;
+    long totalPages, residentPages;
+    int matched = fscanf(statm, "%ld %ld", &totalPages, &residentPages);
+    fclose(statm);
+    if (matched != 2)
+        return -1;
+    return residentPages * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+// State for printing the throughput of the last interval every "intervalUs" microseconds, similar to iperf.
+struct IntervalReporter
+{
+    int64_t intervalUs;
+    int64_t startUs;
+    int64_t lastReportUs;
+    uint64_t bytesAtLastReport;
+};
+
+void intervalReporterInit(struct IntervalReporter* reporter, int64_t intervalUs)
+{
+    reporter->intervalUs = intervalUs;
+    reporter->startUs = getMonotonicTimeUs();
+    reporter->lastReportUs = reporter->startUs;
+    reporter->bytesAtLastReport = 0;
+}
+
+// Prints a line for the elapsed interval if one has passed. "now" is passed in by the caller as it usually has it anyway.
+void intervalReporterUpdate(struct IntervalReporter* reporter, FILE* output, int64_t now, uint64_t bytesTotal)
+{
+    if (reporter->intervalUs <= 0 || now - reporter->lastReportUs < reporter->intervalUs)
+        return;
+
+    uint64_t bytes = bytesTotal - reporter->bytesAtLastReport;
+    double seconds = (double)(now - reporter->lastReportUs) / 1000000;
+    fprintf(output, "[%8.1f-%8.1f s] %12.2f MB %10.2f MB/s  rss %ld KB\n", (double)(reporter->lastReportUs - reporter->startUs) / 1000000, (double)(now - reporter->startUs) / 1000000, (double)bytes / 1024 / 1024, (double)bytes / 1024 / 1024 / seconds, getResidentSetSizeKb());
+
+    reporter->lastReportUs = now;
+    reporter->bytesAtLastReport = bytesTotal;
+}
+
+// CRC32C (Castagnoli) used to check that the data arrives unmodified. Computed with the SSE4.2 crc32
+// instruction when the CPU has it, otherwise with a slicing-by-8 table which processes 8 bytes per step.
+uint32_t crc32cTable[8][256];
+uint32_t (*crc32cUpdate)(uint32_t crc, const uint8_t* data, size_t length);
+
+uint32_t crc32cSoftware(uint32_t crc, const uint8_t* data, size_t length)
+{
+    while (length >= 8)
+    {
+        uint64_t word;
+        memcpy(&word, data, sizeof(word));
+        word ^= crc;
+        crc = crc32cTable[7][word & 0xff] ^ crc32cTable[6][(word >> 8) & 0xff] ^ crc32cTable[5][(word >> 16) & 0xff] ^ crc32cTable[4][(word >> 24) & 0xff] ^ crc32cTable[3][(word >> 32) & 0xff] ^ crc32cTable[2][(word >> 40) & 0xff] ^ crc32cTable[1][(word >> 48) & 0xff] ^ crc32cTable[0][word >> 56];
+        data += 8;
+        length -= 8;
+    }
+    while (length-- > 0)
+    {
+        crc = crc32cTable[0][(crc ^ *data++) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2"))) uint32_t crc32cHardware(uint32_t crc, const uint8_t* data, size_t length)
+{
+    uint64_t crc64 = crc;
+    while (length >= 8)
+    {
+        uint64_t word;
+        memcpy(&word, data, sizeof(word));
+        crc64 = _mm_crc32_u64(crc64, word);
+        data += 8;
+        length -= 8;
+    }
+    crc = (uint32_t)crc64;
+    while (length-- > 0)
+    {
+        crc = _mm_crc32_u8(crc, *data++);
+    }
+    return crc;
+}
+#endif
+
+// Builds the lookup tables and picks the fastest implementation available on this CPU.
+void crc32cInit()
+{
+    for (uint32_t i = 0; i < 256; i++)
+    {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++)
+        {
+            crc = (crc & 1) ? (crc >> 1) ^ 0x82f63b78 : crc >> 1;
+        }
+        crc32cTable[0][i] = crc;
+    }
+    for (uint32_t i = 0; i < 256; i++)
+    {
+        for (int table = 1; table < 8; table++)
+        {
+            crc32cTable[table][i] = crc32cTable[0][crc32cTable[table - 1][i] & 0xff] ^ (crc32cTable[table - 1][i] >> 8);
+        }
+    }
+
+    crc32cUpdate = crc32cSoftware;
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2"))
+        crc32cUpdate = crc32cHardware;
+#endif
+}
+
+// Continues the running checksum "crc" (0 for the start of the stream) over "length" bytes of "data".
+uint32_t crc32c(uint32_t crc, const void* data, size_t length)
+{
+    return ~crc32cUpdate(~crc, data, length);
+}
+
+// With integrity checking enabled the client sends every chunk as a frame of a 4 byte payload length, the payload and a
+// 4 byte trailer holding the running CRC32C of all payload bytes sent so far. Both numbers are in network byte order.
+// The checker is fed the stream in whatever pieces read returns and verifies each trailer as it completes.
+enum FrameState
+{
+    FRAME_HEADER,
+    FRAME_PAYLOAD,
+    FRAME_TRAILER
+};
+
+struct IntegrityChecker
+{
+    enum FrameState state;
+    uint8_t field[4];
+    size_t fieldFilled;
+    uint32_t payloadRemaining;
+    uint32_t crc;
+    uint64_t payloadBytes;
+    uint64_t frames;
+};
+
+void integrityCheckerInit(struct IntegrityChecker* checker)
+{
+    memset(checker, 0, sizeof(*checker));
+    checker->state = FRAME_HEADER;
+}
+
+// Feeds the next "length" bytes of the stream to the checker. Returns -1 if a trailer didn't match the data.
+int integrityCheckerFeed(struct IntegrityChecker* checker, uint8_t* data, size_t length)
+{
+    while (length > 0)
+    {
+        if (checker->state == FRAME_PAYLOAD)
+        {
+            size_t amount = length < checker->payloadRemaining ? length : checker->payloadRemaining;
+            checker->crc = crc32c(checker->crc, data, amount);
+            checker->payloadRemaining -= amount;
+            checker->payloadBytes += amount;
+            data += amount;
+            length -= amount;
+            if (checker->payloadRemaining == 0)
+                checker->state = FRAME_TRAILER;
+            continue;
+        }
+
+        // Collect the 4 byte header or trailer, which may be split across reads.
+        size_t amount = sizeof(checker->field) - checker->fieldFilled;
+        if (amount > length)
+            amount = length;
+        memcpy(checker->field + checker->fieldFilled, data, amount);
+        checker->fieldFilled += amount;
+        data += amount;
+        length -= amount;
+        if (checker->fieldFilled < sizeof(checker->field))
+            continue;
+        checker->fieldFilled = 0;
+
+        uint32_t value;
+        memcpy(&value, checker->field, sizeof(value));
+        value = ntohl(value);
+        if (checker->state == FRAME_HEADER)
+        {
+            checker->payloadRemaining = value;
+            checker->state = value > 0 ? FRAME_PAYLOAD : FRAME_TRAILER;
+        }
+        else
+        {
+            if (value != checker->crc)
+            {
+                fprintf(stderr, "Integrity check failed in frame %lu ending at payload byte %lu: expected crc %08x, computed %08x\n", checker->frames, checker->payloadBytes, value, checker->crc);
+                return -1;
+            }
+            checker->frames++;
+            checker->state = FRAME_HEADER;
+        }
+    }
+    return 0;
+}
+
+// Returns 1 if the stream ended on a frame boundary.
+int integrityCheckerComplete(struct IntegrityChecker* checker)
+{
+    return checker->state == FRAME_HEADER && checker->fieldFilled == 0;
+}
+
+void dataEater(int input, int readAmount, int64_t intervalUs, int integrity)
 {
     char* buffer = malloc(readAmount);
     if (buffer == NULL)
@@ -72,19 +367,32 @@ void dataEater(int input, int readAmount)
     }
 
     ssize_t bytesRead;
-    size_t bytesReadTotal = 0;
+    uint64_t bytesReadTotal = 0;
     int firstRead = 1;
+    struct IntervalReporter reporter;
+    struct CpuUsage cpuBefore, cpuAfter;
+    struct IntegrityChecker checker;
+    integrityCheckerInit(&checker);
     while ((bytesRead = read(input, buffer, readAmount)) > 0)
     {
         bytesReadTotal += bytesRead;
+        if (integrity && integrityCheckerFeed(&checker, (uint8_t*)buffer, bytesRead) < 0)
+        {
+            free(buffer);
+            exit(1);
+        }
         if (firstRead)
         {
             getTimeSinceLastCall();
+            getCpuUsage(&cpuBefore);
+            intervalReporterInit(&reporter, intervalUs);
             firstRead = 0;
         }
-        // Do nothing with the data.
+        if (intervalUs > 0)
+            intervalReporterUpdate(&reporter, stderr, getMonotonicTimeUs(), bytesReadTotal);
     }
     int64_t timeToReadData = getTimeSinceLastCall();
+    getCpuUsage(&cpuAfter);
     if (bytesRead < 0)
     {
         perror("Failed to read from input");
@@ -101,23 +409,196 @@ void dataEater(int input, int readAmount)
 
     // Print the time taken to eat the data and speed
     fprintf(stderr, "Time to read data: %ldus\n", timeToReadData);
-    fprintf(stderr, "Speed: %fMB/s\n", ((float)bytesReadTotal / 1024 / 1024) / ((float)timeToReadData / 1000000));
+    fprintf(stderr, "Bytes read: %lu\n", bytesReadTotal);
+    fprintf(stderr, "Speed: %fMB/s\n", ((double)bytesReadTotal / 1024 / 1024) / ((double)timeToReadData / 1000000));
+    printCpuCost(stderr, &cpuBefore, &cpuAfter, timeToReadData, bytesReadTotal);
+
+    if (integrity)
+    {
+        if (!integrityCheckerComplete(&checker))
+        {
+            fprintf(stderr, "Integrity check failed: stream ended in the middle of a frame after %lu payload bytes\n", checker.payloadBytes);
+            exit(1);
+        }
+        fprintf(stderr, "Integrity check passed: %lu payload bytes in %lu frames, crc %08x\n", checker.payloadBytes, checker.frames, checker.crc);
+    }
+}
+
+// In request/response mode every request starts with a header telling the server how long the whole request is
+// (header included) and how many bytes to answer with. Both fields are in network byte order.
+struct RequestHeader
+{
+    uint32_t requestLength;
+    uint32_t responseLength;
+};
+
+// Reads exactly "length" bytes from "file" to "data". Returns the number of bytes read, which is less than "length"
+// only if EOF was reached, or -1 if an error occurred. With "busyPoll" set the socket is polled with non-blocking
+// reads in a loop instead of sleeping in the kernel, trading a full core for lower wake-up latency.
+ssize_t loopedRead(int file, void* data, size_t length, int busyPoll)
+{
+    size_t charactersRead = 0;
+    while (charactersRead < length)
+    {
+        ssize_t readResult = recv(file, data + charactersRead, length - charactersRead, busyPoll ? MSG_DONTWAIT : 0);
+        if (readResult < 0)
+        {
+            if (errno == EINTR || (busyPoll && (errno == EAGAIN || errno == EWOULDBLOCK)))
+                continue;
+            return -1;
+        }
+        if (readResult == 0)
+            break;
+        charactersRead += readResult;
+    }
+    return charactersRead;
+}
+
+// Writes "length" bytes from "data" to "file" and returns the number of bytes written or -1 if an error occurred.
+// Implemented because write does not guarantee to write all bytes if the output file is eg. full or a signal causes the write to be interrupted.
+ssize_t loopedWrite(int file, void* data, size_t length)
+{
+    ssize_t writeResult;
+    size_t charactersWritten = 0;
+    while ((writeResult = write(file, data + charactersWritten, length - charactersWritten)) >= 0)
+    {
+        charactersWritten += writeResult;
+        if (charactersWritten == length)
+            break;
+    }
+    return writeResult;
+}
+
+// Answers request/response transactions until the client closes the connection.
+void requestResponder(int socketfd, int busyPoll)
+{
+    size_t bufferSize = 65536;
+    char* buffer = calloc(1, bufferSize);
+    if (buffer == NULL)
+    {
+        perror("Failed to allocate buffer for requests");
+        exit(1);
+    }
+
+    uint64_t transactions = 0;
+    while (1)
+    {
+        struct RequestHeader header;
+        ssize_t readResult = loopedRead(socketfd, &header, sizeof(header), busyPoll);
+        if (readResult == 0)
+            break;
+        if (readResult < (ssize_t)sizeof(header))
+        {
+            if (readResult < 0)
+                perror("Failed to read request header");
+            else
+                fprintf(stderr, "Client closed the connection in the middle of a request header\n");
+            exit(1);
+        }
+        size_t requestLength = ntohl(header.requestLength);
+        size_t responseLength = ntohl(header.responseLength);
+        if (requestLength < sizeof(header))
+        {
+            fprintf(stderr, "Invalid request length %zu\n", requestLength);
+            exit(1);
+        }
+
+        // Grow the buffer so that both the rest of the request and the response fit in one call.
+        size_t needed = requestLength - sizeof(header) > responseLength ? requestLength - sizeof(header) : responseLength;
+        if (needed > bufferSize)
+        {
+            free(buffer);
+            bufferSize = needed;
+            if ((buffer = calloc(1, bufferSize)) == NULL)
+            {
+                perror("Failed to grow buffer for requests");
+                exit(1);
+            }
+        }
+
+        size_t bodyLength = requestLength - sizeof(header);
+        if (loopedRead(socketfd, buffer, bodyLength, busyPoll) != (ssize_t)bodyLength)
+        {
+            fprintf(stderr, "Failed to read the whole request\n");
+            exit(1);
+        }
+        if (responseLength > 0 && loopedWrite(socketfd, buffer, responseLength) < 0)
+        {
+            perror("Failed to send response");
+            exit(1);
+        }
+        transactions++;
+    }
+    free(buffer);
+
+    fprintf(stderr, "Answered %lu transactions\n", transactions);
 }
 
 int main(__attribute__((unused)) int argc, __attribute__((unused)) char* argv[])
 {
     createSignalHandler();
+    crc32cInit();
 
     int serverPort;
+    int64_t intervalUs = 0;
+    int integrity = 0;
+    int requestResponse = 0;
+    int noDelay = 0;
+    int busyPoll = 0;
+    static struct option longOptions[] = {
+        {"interval", required_argument, NULL, 'i'},
+        {"crc", no_argument, NULL, 'c'},
+        {"rr", no_argument, NULL, 'r'},
+        {"nodelay", no_argument, NULL, 'N'},
+        {"busy-poll", no_argument, NULL, 'b'},
+        {NULL, 0, NULL, 0},
+    };
+    int option;
+    while ((option = getopt_long(argc, argv, "i:crNb", longOptions, NULL)) != -1)
+    {
+        switch (option)
+        {
+        case 'r':
+            requestResponse = 1;
+            break;
+        case 'N':
+            noDelay = 1;
+            break;
+        case 'b':
+            busyPoll = 1;
+            break;
+        case 'c':
+            integrity = 1;
+            break;
+        case 'i':
+            intervalUs = (int64_t)(atof(optarg) * 1000000);
+            if (intervalUs <= 0)
+            {
+                fprintf(stderr, "Interval must be a positive number of seconds\n");
+                exit(1);
+            }
+            break;
+        default:
+            exit(1);
+        }
+    }
 
-    // Read the server port from the command line arguments.
-    if (argc != 3)
+    // Read the server port from the command line arguments. Request/response mode reads whole requests, so it has no
+    // use for the read amount.
+    if (argc - optind != 2 && !(requestResponse && argc - optind == 1))
     {
-        fprintf(stderr, "usage: %s <server port> <read amount per read call>\n", argv[0]);
+        fprintf(stderr, "usage: %s [--interval <seconds>] [--crc] <server port> <read amount per read call>\n"
+                        "       %s [--interval <seconds>] [--crc] --rr [--nodelay] [--busy-poll] <server port>\n",
+                argv[0], argv[0]);
+        exit(1);
+    }
+    serverPort = atoi(argv[optind]);
+    int readAmount = argc - optind == 2 ? atoi(argv[optind + 1]) : 0;
+    if (!requestResponse && readAmount <= 0)
+    {
+        fprintf(stderr, "Read amount must be positive\n");
         exit(1);
     }
-    serverPort = atoi(argv[1]);
-    int readAmount = atoi(argv[2]);
 
     // Create a socket
     struct sockaddr_in serverAddress, clientAddress;
@@ -175,8 +656,26 @@ int main(__attribute__((unused)) int argc, __attribute__((unused)) char* argv[])
             // Child process
             close(listenSocketfd);
 
-            fprintf(stderr, "Child process started eating data for client connection\n");
-            dataEater(clientSocketfd, readAmount);
+            if (requestResponse)
+            {
+                int enable = 1;
+                if (noDelay && setsockopt(clientSocketfd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable)) < 0)
+                {
+                    perror("Failed to set TCP_NODELAY");
+                    exit(1);
+                }
+                int busyPollUs = 50;
+                if (busyPoll && setsockopt(clientSocketfd, SOL_SOCKET, SO_BUSY_POLL, &busyPollUs, sizeof(busyPollUs)) < 0)
+                    perror("Warning: Failed to set SO_BUSY_POLL, polling only in user space");
+
+                fprintf(stderr, "Child process started answering requests for client connection\n");
+                requestResponder(clientSocketfd, busyPoll);
+            }
+            else
+            {
+                fprintf(stderr, "Child process started eating data for client connection\n");
+                dataEater(clientSocketfd, readAmount, intervalUs, integrity);
+            }
             fprintf(stderr, "Received EOF from client (client disconnected / sent all data)\n");
             if (close(clientSocketfd) < 0)
             {
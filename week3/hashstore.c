@@ -0,0 +1,492 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+// A fixed capacity hash table of string keys and 64 bit values in a mapped file, shared by any number of processes
+// the same way exercise2.c shares its counter. Nothing is ever locked: a slot is claimed for a key with one compare and
+// swap and values are changed with atomic adds and stores, so a process dying at any point leaves nothing held.
+
+#define FILE_MODE (S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)
+/* default permissions for new files */
+#define STORE_MAGIC 0x6e704853
+#define CACHE_LINE_SIZE 64
+#define KEY_SIZE 44
+#define DEFAULT_CAPACITY 65536
+// How many times a lookup yields to a process filling in a slot before checking if that process is still alive
+#define CLAIM_PATIENCE 1000
+
+// The state of a slot is the low half of its control word. While a slot is claimed the high half is the pid of the
+// claiming process, so that others can tell when it died before finishing.
+#define SLOT_EMPTY 0
+#define SLOT_CLAIMED 1
+#define SLOT_READY 2
+// A slot whose claimer died. It is never used again, lookups just step over it.
+#define SLOT_ABANDONED 3
+
+// Start of the store file, the slots start at the next cache line.
+struct store_header
+{
+    uint32_t magic;
+    uint32_t key_size;
+    uint64_t capacity;
+    uint64_t used;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+// One key and its value, alone on a cache line so that updates to different keys don't slow each other down.
+struct slot
+{
+    uint64_t control;
+    int64_t value;
+    uint32_t hash;
+    char key[KEY_SIZE];
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+// A longer key would spill the slot onto a second cache line, doubling the size of the store
+_Static_assert(sizeof(struct slot) == CACHE_LINE_SIZE, "a slot must fill exactly one cache line");
+
+// Lets the benchmark processes start together, as in exercise2.c. Every child counts itself in "ready" and then sleeps
+// until the parent sets "go", so the forks aren't timed.
+struct start_gate
+{
+    uint32_t ready;
+    uint32_t go;
+};
+
+struct store
+{
+    struct store_header *header;
+    struct slot *slots;
+    size_t size;
+};
+
+// Returns the current time of the monotonic clock in nanoseconds.
+int64_t get_monotonic_time_ns()
+{
+    struct timespec now;
+    if (clock_gettime(CLOCK_MONOTONIC, &now) < 0)
+    {
+        perror("Failed to get monotonic time");
+        exit(1);
+    }
+    return now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// The start gate is in an anonymous shared mapping, so the shared (non private) futex operations are needed.
+long futex(uint32_t *address, int operation, uint32_t value)
+{
+    return syscall(SYS_futex, address, operation, value, NULL, NULL, 0);
+}
+
+// Counts the calling child as ready and waits until the parent opens the gate.
+void start_gate_wait(struct start_gate *gate)
+{
+    __atomic_fetch_add(&gate->ready, 1, __ATOMIC_RELEASE);
+    if (futex(&gate->ready, FUTEX_WAKE, 1) < 0)
+        perror("futex wake failed");
+    while (__atomic_load_n(&gate->go, __ATOMIC_ACQUIRE) == 0)
+    {
+        if (futex(&gate->go, FUTEX_WAIT, 0) < 0 && errno != EAGAIN && errno != EINTR)
+        {
+            perror("futex wait failed");
+            exit(1);
+        }
+    }
+}
+
+// Waits until "processes" children are ready and lets them all go at once. Returns the time they were let go at.
+int64_t start_gate_open(struct start_gate *gate, int processes)
+{
+    uint32_t ready;
+    while ((ready = __atomic_load_n(&gate->ready, __ATOMIC_ACQUIRE)) < (uint32_t)processes)
+    {
+        if (futex(&gate->ready, FUTEX_WAIT, ready) < 0 && errno != EAGAIN && errno != EINTR)
+        {
+            perror("futex wait failed");
+            exit(1);
+        }
+    }
+    int64_t now = get_monotonic_time_ns();
+    __atomic_store_n(&gate->go, 1, __ATOMIC_RELEASE);
+    if (futex(&gate->go, FUTEX_WAKE, INT_MAX) < 0)
+        perror("futex wake failed");
+    return now;
+}
+
+// 32 bit FNV-1a
+uint32_t hash_key(const char *key)
+{
+    uint32_t hash = 2166136261u;
+    for (; *key != '\0'; key++)
+    {
+        hash ^= (unsigned char)*key;
+        hash *= 16777619;
+    }
+    return hash;
+}
+
+// Opens the store, creating it with the given capacity if the file is empty. The capacity of an existing store is
+// kept. Creating is done under flock so that two processes starting at the same time don't both initialize it.
+void store_open(struct store *store, char *pathname, uint64_t capacity)
+{
+    int fd = open(pathname, O_RDWR | O_CREAT, FILE_MODE);
+    if (fd < 0)
+    {
+        perror("open failed");
+        exit(1);
+    }
+    if (flock(fd, LOCK_EX) < 0)
+    {
+        perror("flock failed");
+        exit(1);
+    }
+
+    struct stat info;
+    if (fstat(fd, &info) < 0)
+    {
+        perror("fstat failed");
+        exit(1);
+    }
+    struct store_header header;
+    if (info.st_size == 0)
+    {
+        memset(&header, 0, sizeof(header));
+        header.magic = STORE_MAGIC;
+        header.key_size = KEY_SIZE;
+        header.capacity = capacity;
+        if (ftruncate(fd, sizeof(struct store_header) + capacity * sizeof(struct slot)) < 0 || pwrite(fd, &header, sizeof(header), 0) != sizeof(header))
+        {
+            perror("Failed to create store");
+            exit(1);
+        }
+    }
+    else if (pread(fd, &header, sizeof(header), 0) != sizeof(header))
+    {
+        perror("Failed to read store header");
+        exit(1);
+    }
+    if (header.magic != STORE_MAGIC || header.key_size != KEY_SIZE || (header.capacity & (header.capacity - 1)) != 0)
+    {
+        fprintf(stderr, "%s is not a hash store\n", pathname);
+        exit(1);
+    }
+
+    store->size = sizeof(struct store_header) + header.capacity * sizeof(struct slot);
+    if ((size_t)info.st_size != 0 && (size_t)info.st_size < store->size)
+    {
+        fprintf(stderr, "%s is truncated\n", pathname);
+        exit(1);
+    }
+    store->header = mmap(NULL, store->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (store->header == MAP_FAILED)
+    {
+        perror("mmap failed");
+        exit(1);
+    }
+    store->slots = (struct slot *)(store->header + 1);
+    flock(fd, LOCK_UN);
+    close(fd);
+}
+
+// Waits for another process to finish claiming the slot and returns the state it ends up in. If the claiming process
+// died the slot is abandoned instead, otherwise every lookup for keys after it would wait forever.
+uint64_t wait_for_claim(struct slot *slot, uint64_t control)
+{
+    int tries = 0;
+    while ((control & 0xffffffff) == SLOT_CLAIMED)
+    {
+        if (++tries % CLAIM_PATIENCE == 0 && kill((pid_t)(control >> 32), 0) < 0 && errno == ESRCH)
+        {
+            __atomic_compare_exchange_n(&slot->control, &control, SLOT_ABANDONED, 0, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE);
+            continue;
+        }
+        sched_yield();
+        control = __atomic_load_n(&slot->control, __ATOMIC_ACQUIRE);
+    }
+    return control;
+}
+
+// Returns the slot of the key, or NULL if it isn't in the store. With "create" set a missing key is added with the
+// value 0. Linear probing: keys are never removed, so the first empty slot ends the search.
+struct slot *store_find(struct store *store, const char *key, int create)
+{
+    uint32_t hash = hash_key(key);
+    uint64_t mask = store->header->capacity - 1;
+    for (uint64_t i = 0; i <= mask; i++)
+    {
+        struct slot *slot = &store->slots[(hash + i) & mask];
+        uint64_t control = __atomic_load_n(&slot->control, __ATOMIC_ACQUIRE);
+        if (control == SLOT_EMPTY)
+        {
+            if (!create)
+                return NULL;
+            uint64_t claimed = SLOT_CLAIMED | (uint64_t)getpid() << 32;
+            if (__atomic_compare_exchange_n(&slot->control, &control, claimed, 0, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE))
+            {
+                slot->hash = hash;
+                strcpy(slot->key, key);
+                __atomic_store_n(&slot->value, 0, __ATOMIC_RELAXED);
+                __atomic_store_n(&slot->control, SLOT_READY, __ATOMIC_RELEASE);
+                __atomic_add_fetch(&store->header->used, 1, __ATOMIC_RELAXED);
+                return slot;
+            }
+            // Another process got the slot first, it may have been for this same key
+        }
+        control = wait_for_claim(slot, control);
+        if (control == SLOT_READY && slot->hash == hash && strcmp(slot->key, key) == 0)
+            return slot;
+    }
+    if (create)
+    {
+        fprintf(stderr, "Store is full, no room for %s\n", key);
+        exit(1);
+    }
+    return NULL;
+}
+
+void check_key(const char *key)
+{
+    if (strlen(key) >= KEY_SIZE)
+    {
+        fprintf(stderr, "Key %s is too long, at most %d characters fit\n", key, KEY_SIZE - 1);
+        exit(1);
+    }
+}
+
+int64_t store_get(struct store *store, const char *key, int *found)
+{
+    struct slot *slot = store_find(store, key, 0);
+    *found = slot != NULL;
+    return slot != NULL ? __atomic_load_n(&slot->value, __ATOMIC_RELAXED) : 0;
+}
+
+int64_t store_incr(struct store *store, const char *key, int64_t delta)
+{
+    return __atomic_add_fetch(&store_find(store, key, 1)->value, delta, __ATOMIC_RELAXED);
+}
+
+void store_put(struct store *store, const char *key, int64_t value)
+{
+    __atomic_store_n(&store_find(store, key, 1)->value, value, __ATOMIC_RELAXED);
+}
+
+void store_list(struct store *store)
+{
+    for (uint64_t i = 0; i < store->header->capacity; i++)
+    {
+        struct slot *slot = &store->slots[i];
+        if (__atomic_load_n(&slot->control, __ATOMIC_ACQUIRE) == SLOT_READY)
+            printf("%s %ld\n", slot->key, __atomic_load_n(&slot->value, __ATOMIC_RELAXED));
+    }
+}
+
+// Runs "processes" processes that each do "nloop" operations on random keys out of "key_count", "read_percent"
+// percent of them gets and the rest increments, and prints the operations per second. The time runs from all processes
+// being let go together until the last one exits. The keys are checked afterwards to make sure no increment was lost.
+void run_benchmark(struct store *store, int processes, int nloop, int key_count, int read_percent)
+{
+    char (*keys)[KEY_SIZE] = malloc(key_count * sizeof(*keys));
+    if (keys == NULL)
+    {
+        perror("malloc failed");
+        exit(1);
+    }
+    int64_t start_total = 0;
+    for (int i = 0; i < key_count; i++)
+    {
+        snprintf(keys[i], KEY_SIZE, "bench:%d", i);
+        start_total += store_incr(store, keys[i], 0);
+    }
+
+    // Every process tells how many increments it made through this mapping
+    int64_t *increments = mmap(NULL, processes * sizeof(int64_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    struct start_gate *gate = mmap(NULL, sizeof(struct start_gate), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (increments == MAP_FAILED || gate == MAP_FAILED)
+    {
+        perror("mmap failed");
+        exit(1);
+    }
+
+    fflush(stdout);
+    for (int child = 0; child < processes; child++)
+    {
+        pid_t pid = fork();
+        if (pid < 0)
+        {
+            perror("fork failed");
+            exit(1);
+        }
+        if (pid == 0)
+        {
+            uint32_t random_state = 2654435761u * (child + 1);
+            int64_t made = 0;
+            int found;
+            start_gate_wait(gate);
+            for (int i = 0; i < nloop; i++)
+            {
+                random_state ^= random_state << 13;
+                random_state ^= random_state >> 17;
+                random_state ^= random_state << 5;
+                char *key = keys[random_state % key_count];
+                if ((int)(random_state >> 8) % 100 < read_percent)
+                {
+                    store_get(store, key, &found);
+                    continue;
+                }
+                store_incr(store, key, 1);
+                made++;
+            }
+            increments[child] = made;
+            _exit(0);
+        }
+    }
+    int64_t start = start_gate_open(gate, processes);
+    int status;
+    for (int child = 0; child < processes; child++)
+    {
+        if (wait(&status) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        {
+            fprintf(stderr, "benchmark process failed\n");
+            exit(1);
+        }
+    }
+    double seconds = (get_monotonic_time_ns() - start) / 1e9;
+
+    int64_t made = 0;
+    for (int child = 0; child < processes; child++)
+        made += increments[child];
+    int64_t total = 0;
+    int found;
+    for (int i = 0; i < key_count; i++)
+        total += store_get(store, keys[i], &found);
+    if (total - start_total != made)
+        fprintf(stderr, "keys are off by %ld after the benchmark\n", made - (total - start_total));
+
+    long count = (long)processes * nloop;
+    printf("%d processes x %d operations on %d keys (%d%% gets) in %.3fs, %.0f operations/s\n", processes, nloop, key_count, read_percent, seconds, count / seconds);
+
+    munmap(increments, processes * sizeof(int64_t));
+    munmap(gate, sizeof(struct start_gate));
+    free(keys);
+}
+
+void usage()
+{
+    fprintf(stderr, "usage: hashstore [--capacity <slots>] <pathname> get <key> | incr <key> [delta] | put <key> <value> | list\n"
+                    "       hashstore [--capacity <slots>] [--processes <count>] [--keys <count>] [--reads <percent>] <pathname> bench <#operations>\n");
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    uint64_t capacity = DEFAULT_CAPACITY;
+    int processes = 4;
+    int key_count = 1000;
+    int read_percent = 0;
+
+    static struct option long_options[] = {
+        {"capacity", required_argument, NULL, 'c'},
+        {"processes", required_argument, NULL, 'p'},
+        {"keys", required_argument, NULL, 'k'},
+        {"reads", required_argument, NULL, 'r'},
+        {NULL, 0, NULL, 0},
+    };
+    int option;
+    while ((option = getopt_long(argc, argv, "+c:p:k:r:", long_options, NULL)) != -1)
+    {
+        switch (option)
+        {
+        case 'c':
+            capacity = strtoull(optarg, NULL, 10);
+            // Rounded up to a power of two so that probing can mask instead of dividing
+            if (capacity < 2)
+                capacity = 2;
+            if ((capacity & (capacity - 1)) != 0)
+                capacity = (uint64_t)1 << (64 - __builtin_clzll(capacity));
+            break;
+        case 'p':
+            processes = atoi(optarg);
+            break;
+        case 'k':
+            key_count = atoi(optarg);
+            break;
+        case 'r':
+            read_percent = atoi(optarg);
+            break;
+        default:
+            usage();
+        }
+    }
+    if (argc - optind < 2 || processes < 1 || key_count < 1 || read_percent < 0 || read_percent > 100)
+        usage();
+
+    char *pathname = argv[optind];
+    char *command = argv[optind + 1];
+    int arguments = argc - optind - 2;
+    char **argument = &argv[optind + 2];
+
+    struct store store;
+    store_open(&store, pathname, capacity);
+
+    if (strcmp(command, "get") == 0 && arguments == 1)
+    {
+        check_key(argument[0]);
+        int found;
+        int64_t value = store_get(&store, argument[0], &found);
+        if (!found)
+        {
+            fprintf(stderr, "%s not found\n", argument[0]);
+            exit(1);
+        }
+        printf("%ld\n", value);
+    }
+    else if (strcmp(command, "incr") == 0 && (arguments == 1 || arguments == 2))
+    {
+        check_key(argument[0]);
+        printf("%ld\n", store_incr(&store, argument[0], arguments == 2 ? strtoll(argument[1], NULL, 10) : 1));
+    }
+    else if (strcmp(command, "put") == 0 && arguments == 2)
+    {
+        check_key(argument[0]);
+        store_put(&store, argument[0], strtoll(argument[1], NULL, 10));
+    }
+    else if (strcmp(command, "list") == 0 && arguments == 0)
+        store_list(&store);
+    else if (strcmp(command, "bench") == 0 && arguments == 1)
+    {
+        // Keys left over from an earlier run are reused, only the missing ones need free slots
+        uint64_t missing = 0;
+        char key[KEY_SIZE];
+        for (int i = 0; i < key_count; i++)
+        {
+            snprintf(key, KEY_SIZE, "bench:%d", i);
+            if (store_find(&store, key, 0) == NULL)
+                missing++;
+        }
+        if (missing > store.header->capacity - store.header->used)
+        {
+            fprintf(stderr, "Not enough room for %lu new keys\n", missing);
+            exit(1);
+        }
+        run_benchmark(&store, processes, atoi(argument[0]), key_count, read_percent);
+    }
+    else
+        usage();
+
+    exit(0);
+}
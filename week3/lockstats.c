@@ -0,0 +1,265 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "lockstats.h"
+
+// Prints the lock contention statistics that week3/exercise2.c, week3/exercise3.c and week4/exercise4.c collect when
+// they are run with NP_LOCKSTATS=1 in the environment. Can be started before or while the workload runs.
+
+#define FILE_MODE (S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)
+/* default permissions for new files */
+#define BAR_WIDTH 30
+
+static struct lock_stats_block *lock_stats_block;
+
+// Maps the shared lock statistics, creating them if no profiled workload has started yet.
+void lock_stats_open()
+{
+    int fd = shm_open(LOCK_STATS_NAME, O_RDWR | O_CREAT, FILE_MODE);
+    if (fd < 0)
+    {
+        perror("shm_open failed for lock statistics");
+        exit(1);
+    }
+    // A new object is filled with zeros, so every process can size it without caring who was first
+    if (ftruncate(fd, sizeof(struct lock_stats_block)) < 0)
+    {
+        perror("Failed to size lock statistics");
+        exit(1);
+    }
+    lock_stats_block = mmap(NULL, sizeof(struct lock_stats_block), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (lock_stats_block == MAP_FAILED)
+    {
+        perror("mmap failed for lock statistics");
+        exit(1);
+    }
+    close(fd);
+
+    lock_stats_check_layout(lock_stats_block);
+}
+
+
+// Copies the statistics of one lock. The fields are read one by one, so a copy taken while processes are using the
+// lock can be off by the few acquisitions that happened during the copy.
+void lock_stats_snapshot(struct lock_stats *stats, struct lock_stats *copy)
+{
+    memcpy(copy->name, stats->name, LOCK_STATS_NAME_LENGTH);
+    copy->acquisitions = __atomic_load_n(&stats->acquisitions, __ATOMIC_RELAXED);
+    copy->wait_total_ns = __atomic_load_n(&stats->wait_total_ns, __ATOMIC_RELAXED);
+    copy->wait_max_ns = __atomic_load_n(&stats->wait_max_ns, __ATOMIC_RELAXED);
+    copy->hold_total_ns = __atomic_load_n(&stats->hold_total_ns, __ATOMIC_RELAXED);
+    copy->hold_max_ns = __atomic_load_n(&stats->hold_max_ns, __ATOMIC_RELAXED);
+    for (int bucket = 0; bucket < LOCK_STATS_BUCKETS; bucket++)
+    {
+        copy->wait_buckets[bucket] = __atomic_load_n(&stats->wait_buckets[bucket], __ATOMIC_RELAXED);
+        copy->hold_buckets[bucket] = __atomic_load_n(&stats->hold_buckets[bucket], __ATOMIC_RELAXED);
+    }
+}
+
+// Turns "current" into the difference from "previous". The maximums can't be split by interval, so they stay totals.
+// A counter that went backwards means the statistics were reset in between, and then everything in "current" happened
+// since the previous report, so it is left as is.
+void lock_stats_subtract(struct lock_stats *current, struct lock_stats *previous)
+{
+    int was_reset = current->acquisitions < previous->acquisitions || current->wait_total_ns < previous->wait_total_ns || current->hold_total_ns < previous->hold_total_ns;
+    for (int bucket = 0; bucket < LOCK_STATS_BUCKETS; bucket++)
+        was_reset |= current->wait_buckets[bucket] < previous->wait_buckets[bucket] || current->hold_buckets[bucket] < previous->hold_buckets[bucket];
+    if (was_reset)
+        return;
+
+    current->acquisitions -= previous->acquisitions;
+    current->wait_total_ns -= previous->wait_total_ns;
+    current->hold_total_ns -= previous->hold_total_ns;
+    for (int bucket = 0; bucket < LOCK_STATS_BUCKETS; bucket++)
+    {
+        current->wait_buckets[bucket] -= previous->wait_buckets[bucket];
+        current->hold_buckets[bucket] -= previous->hold_buckets[bucket];
+    }
+}
+
+// Returns the upper edge of the bucket the given percentile falls in.
+uint64_t histogram_percentile(uint64_t *buckets, uint64_t count, double percent)
+{
+    uint64_t target = (uint64_t)(percent / 100 * count);
+    uint64_t seen = 0;
+    for (int bucket = 0; bucket < LOCK_STATS_BUCKETS; bucket++)
+    {
+        seen += buckets[bucket];
+        if (seen > target)
+            return (uint64_t)1 << (bucket + 1);
+    }
+    return 0;
+}
+
+uint64_t histogram_largest(uint64_t *buckets)
+{
+    uint64_t largest = 0;
+    for (int bucket = 0; bucket < LOCK_STATS_BUCKETS; bucket++)
+    {
+        if (buckets[bucket] > largest)
+            largest = buckets[bucket];
+    }
+    return largest;
+}
+
+void print_bar(uint64_t value, uint64_t largest)
+{
+    char bar[BAR_WIDTH + 1];
+    int length = largest == 0 ? 0 : (int)((value * BAR_WIDTH + largest - 1) / largest);
+    memset(bar, '#', length);
+    bar[length] = '\0';
+    printf("%-*s", BAR_WIDTH, bar);
+}
+
+// Prints the summary line of one lock and its wait and hold histograms side by side.
+void print_lock(struct lock_stats *stats, double seconds)
+{
+    uint64_t count = stats->acquisitions;
+    printf("%s: %lu acquisitions", stats->name, count);
+    if (seconds > 0)
+        printf(" (%.0f/s)", count / seconds);
+    printf("\n");
+    if (count == 0)
+        return;
+
+    printf("  wait: mean %.0fns, p50 <%luns, p99 <%luns, max %luns\n", (double)stats->wait_total_ns / count, histogram_percentile(stats->wait_buckets, count, 50), histogram_percentile(stats->wait_buckets, count, 99), stats->wait_max_ns);
+    printf("  hold: mean %.0fns, p50 <%luns, p99 <%luns, max %luns\n", (double)stats->hold_total_ns / count, histogram_percentile(stats->hold_buckets, count, 50), histogram_percentile(stats->hold_buckets, count, 99), stats->hold_max_ns);
+
+    uint64_t largest_wait = histogram_largest(stats->wait_buckets);
+    uint64_t largest_hold = histogram_largest(stats->hold_buckets);
+    printf("%32s%10s%*s%10s\n", "", "wait", BAR_WIDTH + 4, "", "hold");
+    for (int bucket = 0; bucket < LOCK_STATS_BUCKETS; bucket++)
+    {
+        if (stats->wait_buckets[bucket] == 0 && stats->hold_buckets[bucket] == 0)
+            continue;
+        printf("  %10luns - %10luns   %10lu ", bucket == 0 ? 0 : (uint64_t)1 << bucket, ((uint64_t)1 << (bucket + 1)) - 1, stats->wait_buckets[bucket]);
+        print_bar(stats->wait_buckets[bucket], largest_wait);
+        printf("   %10lu ", stats->hold_buckets[bucket]);
+        print_bar(stats->hold_buckets[bucket], largest_hold);
+        printf("\n");
+    }
+}
+
+// Zeroes the counters of every lock but keeps the names, so running workloads keep using the same entries.
+void lock_stats_reset()
+{
+    for (int i = 0; i < LOCK_STATS_MAX_LOCKS; i++)
+    {
+        struct lock_stats *stats = &lock_stats_block->locks[i];
+        if (__atomic_load_n(&stats->state, __ATOMIC_ACQUIRE) != 2)
+            continue;
+        __atomic_store_n(&stats->acquisitions, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&stats->wait_total_ns, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&stats->wait_max_ns, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&stats->hold_total_ns, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&stats->hold_max_ns, 0, __ATOMIC_RELAXED);
+        for (int bucket = 0; bucket < LOCK_STATS_BUCKETS; bucket++)
+        {
+            __atomic_store_n(&stats->wait_buckets[bucket], 0, __ATOMIC_RELAXED);
+            __atomic_store_n(&stats->hold_buckets[bucket], 0, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    int interval = 1000;
+    int count = 0;
+    int total = 0;
+
+    static struct option long_options[] = {
+        {"interval", required_argument, NULL, 'i'},
+        {"count", required_argument, NULL, 'c'},
+        {"total", no_argument, NULL, 't'},
+        {"reset", no_argument, NULL, 'r'},
+        {"unlink", no_argument, NULL, 'u'},
+        {NULL, 0, NULL, 0},
+    };
+    int option;
+    while ((option = getopt_long(argc, argv, "i:c:tru", long_options, NULL)) != -1)
+    {
+        switch (option)
+        {
+        case 'i':
+            interval = atoi(optarg);
+            if (interval < 1)
+            {
+                fprintf(stderr, "interval must be at least 1ms\n");
+                exit(1);
+            }
+            break;
+        case 'c':
+            count = atoi(optarg);
+            break;
+        case 't':
+            total = 1;
+            break;
+        case 'r':
+            lock_stats_open();
+            lock_stats_reset();
+            exit(0);
+        case 'u':
+            if (shm_unlink(LOCK_STATS_NAME) < 0)
+            {
+                perror("shm_unlink failed");
+                exit(1);
+            }
+            exit(0);
+        default:
+            fprintf(stderr, "usage: lockstats [--interval <ms>] [--count <#reports>] [--total] | --reset | --unlink\n");
+            exit(1);
+        }
+    }
+
+    lock_stats_open();
+
+    // With --total every report has everything since the statistics were created or reset, otherwise only what
+    // happened since the previous report.
+    static struct lock_stats previous[LOCK_STATS_MAX_LOCKS];
+    static struct lock_stats current;
+    for (int i = 0; i < LOCK_STATS_MAX_LOCKS; i++)
+        lock_stats_snapshot(&lock_stats_block->locks[i], &previous[i]);
+
+    struct timespec delay = {interval / 1000, (interval % 1000) * 1000000L};
+    for (int report = 0; count == 0 || report < count; report++)
+    {
+        while (nanosleep(&delay, NULL) < 0)
+        {
+            if (errno != EINTR)
+            {
+                perror("nanosleep failed");
+                exit(1);
+            }
+        }
+
+        printf("----\n");
+        for (int i = 0; i < LOCK_STATS_MAX_LOCKS; i++)
+        {
+            struct lock_stats *stats = &lock_stats_block->locks[i];
+            if (__atomic_load_n(&stats->state, __ATOMIC_ACQUIRE) != 2)
+                continue;
+            lock_stats_snapshot(stats, &current);
+            if (total)
+            {
+                print_lock(&current, 0);
+                continue;
+            }
+            struct lock_stats snapshot = current;
+            lock_stats_subtract(&current, &previous[i]);
+            previous[i] = snapshot;
+            print_lock(&current, interval / 1000.0);
+        }
+        fflush(stdout);
+    }
+
+    exit(0);
+}
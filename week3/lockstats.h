@@ -0,0 +1,59 @@
+#ifndef NP_LOCKSTATS_H
+#define NP_LOCKSTATS_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// Layout of the lock contention statistics that week3/exercise2.c, week3/exercise3.c and week4/exercise4.c collect
+// and week3/lockstats.c prints. Every one of them includes this, so the layout only has to change here.
+
+#ifndef CACHE_LINE_SIZE
+#define CACHE_LINE_SIZE 64
+#endif
+#define LOCK_STATS_NAME "/np_lockstats"
+#define LOCK_STATS_MAGIC 0x6e704c53
+#define LOCK_STATS_MAX_LOCKS 16
+#define LOCK_STATS_NAME_LENGTH 32
+#define LOCK_STATS_BUCKETS 64
+
+// Contention statistics of one named lock, updated with atomics by every process using it. The histograms count
+// acquire waits and hold times in power of two buckets of nanoseconds, bucket b holding times from 2^b to 2^(b+1).
+struct lock_stats
+{
+    // 0 free, 1 being claimed by some process, 2 ready
+    uint32_t state;
+    char name[LOCK_STATS_NAME_LENGTH];
+    uint64_t acquisitions;
+    uint64_t wait_total_ns;
+    uint64_t wait_max_ns;
+    uint64_t hold_total_ns;
+    uint64_t hold_max_ns;
+    uint64_t wait_buckets[LOCK_STATS_BUCKETS];
+    uint64_t hold_buckets[LOCK_STATS_BUCKETS];
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+// The shared memory object with the statistics of all the instrumented locks, one entry per named lock. "stats_size"
+// is sizeof(struct lock_stats) of the program that created it, so a program built with a different layout notices.
+struct lock_stats_block
+{
+    uint32_t magic;
+    uint32_t stats_size;
+    struct lock_stats locks[LOCK_STATS_MAX_LOCKS];
+};
+
+// Stamps a freshly zeroed block with the magic and the entry size, or checks that an existing one has the layout of
+// this program. Exits if it doesn't, the entries would be read at the wrong offsets.
+static inline void lock_stats_check_layout(struct lock_stats_block *block)
+{
+    uint32_t magic = 0;
+    uint32_t stats_size = 0;
+    if ((!__atomic_compare_exchange_n(&block->magic, &magic, LOCK_STATS_MAGIC, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) && magic != LOCK_STATS_MAGIC) ||
+        (!__atomic_compare_exchange_n(&block->stats_size, &stats_size, sizeof(struct lock_stats), 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) && stats_size != sizeof(struct lock_stats)))
+    {
+        fprintf(stderr, "%s has an unknown layout, remove /dev/shm%s\n", LOCK_STATS_NAME, LOCK_STATS_NAME);
+        exit(1);
+    }
+}
+
+#endif
@@ -0,0 +1,45 @@
+#ifndef NP_TRACE_H
+#define NP_TRACE_H
+
+#include <stdint.h>
+
+// Layout of the trace rings that week3/exercise2.c, week3/exercise3.c and week4/exercise4.c write and
+// week3/tracedump.c decodes. Every one of them includes this, so the layout only has to change here.
+
+#define TRACE_NAME_FORMAT "/np_trace.%d"
+#define TRACE_MAGIC 0x6e705452
+#define TRACE_DEFAULT_CAPACITY 65536
+
+// What a trace record is about.
+enum trace_tag
+{
+    TRACE_COUNTER = 1,
+    TRACE_OPERATION = 2,
+};
+
+// One traced event. Fixed size so that writing one is a few stores into the ring and no formatting at all.
+struct trace_record
+{
+    int64_t time_ns;
+    int64_t value;
+    int32_t pid;
+    uint16_t tag;
+    // Tag specific, the character written for the counter and operation events
+    uint16_t detail;
+};
+
+// Start of the shared memory ring of one process. Only the owning process writes, so "head", the number of records
+// ever written, is published with a release store after the record and nothing else needs to be atomic. Once the ring
+// is full the oldest records are overwritten. "record_size" is sizeof(struct trace_record) of the writer, so a reader
+// built with a different layout can skip the ring instead of misreading it.
+struct trace_ring
+{
+    uint32_t magic;
+    uint32_t record_size;
+    int32_t pid;
+    uint64_t capacity;
+    uint64_t head;
+    struct trace_record records[];
+};
+
+#endif
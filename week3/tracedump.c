@@ -0,0 +1,208 @@
+#include <dirent.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+// Decodes the trace rings that week3/exercise2.c, week3/exercise3.c and week4/exercise4.c write when they are run with
+// NP_TRACE set, and prints the events of all the processes merged in time order.
+
+#define SHM_DIRECTORY "/dev/shm"
+#define TRACE_PREFIX "np_trace."
+
+// A mapped ring and the position of the next record of it to print.
+struct ring_cursor
+{
+    struct trace_ring *ring;
+    size_t size;
+    uint64_t next;
+    uint64_t end;
+    char name[NAME_MAX + 2];
+};
+
+char *tag_names[] = {"?", "counter", "operation"};
+
+// Maps the named ring. Returns 0 if it isn't a complete trace ring.
+int open_ring(char *name, struct ring_cursor *cursor)
+{
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0)
+    {
+        perror("shm_open failed");
+        return 0;
+    }
+    struct stat info;
+    if (fstat(fd, &info) < 0)
+    {
+        perror("fstat failed");
+        close(fd);
+        return 0;
+    }
+    if ((size_t)info.st_size < sizeof(struct trace_ring))
+    {
+        close(fd);
+        return 0;
+    }
+    struct trace_ring *ring = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (ring == MAP_FAILED)
+    {
+        perror("mmap failed");
+        return 0;
+    }
+    if (__atomic_load_n(&ring->magic, __ATOMIC_ACQUIRE) != TRACE_MAGIC || sizeof(struct trace_ring) + ring->capacity * sizeof(struct trace_record) > (size_t)info.st_size)
+    {
+        fprintf(stderr, "%s is not a trace ring, skipping it\n", name);
+        munmap(ring, info.st_size);
+        return 0;
+    }
+    if (ring->record_size != sizeof(struct trace_record))
+    {
+        fprintf(stderr, "%s has %u byte records instead of %zu, skipping it\n", name, ring->record_size, sizeof(struct trace_record));
+        munmap(ring, info.st_size);
+        return 0;
+    }
+
+    cursor->ring = ring;
+    cursor->size = info.st_size;
+    cursor->end = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    // Only the last "capacity" records are still in a ring that has wrapped around
+    cursor->next = cursor->end > ring->capacity ? cursor->end - ring->capacity : 0;
+    snprintf(cursor->name, sizeof(cursor->name), "%s", name);
+    return 1;
+}
+
+void print_record(struct trace_record *record, int64_t first_ns, int absolute)
+{
+    if (absolute)
+        printf("%14ld", record->time_ns);
+    else
+        printf("%12.3fus", (record->time_ns - first_ns) / 1e3);
+    printf(" %7d %-9s %ld", record->pid, record->tag < sizeof(tag_names) / sizeof(tag_names[0]) ? tag_names[record->tag] : tag_names[0], record->value);
+    if (record->detail >= 32 && record->detail < 127)
+        printf(" %c", record->detail);
+    printf("\n");
+}
+
+int main(int argc, char **argv)
+{
+    int unlink_rings = 0;
+    int absolute = 0;
+
+    static struct option long_options[] = {
+        {"unlink", no_argument, NULL, 'u'},
+        {"absolute", no_argument, NULL, 'a'},
+        {NULL, 0, NULL, 0},
+    };
+    int option;
+    while ((option = getopt_long(argc, argv, "ua", long_options, NULL)) != -1)
+    {
+        switch (option)
+        {
+        case 'u':
+            unlink_rings = 1;
+            break;
+        case 'a':
+            absolute = 1;
+            break;
+        default:
+            fprintf(stderr, "usage: tracedump [--absolute] [--unlink]\n");
+            exit(1);
+        }
+    }
+
+    DIR *directory = opendir(SHM_DIRECTORY);
+    if (directory == NULL)
+    {
+        perror("opendir failed");
+        exit(1);
+    }
+    struct ring_cursor *cursors = NULL;
+    int ring_count = 0;
+    int ring_capacity = 0;
+    struct dirent *entry;
+    while ((entry = readdir(directory)) != NULL)
+    {
+        if (strncmp(entry->d_name, TRACE_PREFIX, strlen(TRACE_PREFIX)) != 0)
+            continue;
+        if (ring_count == ring_capacity)
+        {
+            ring_capacity = ring_capacity == 0 ? 16 : ring_capacity * 2;
+            cursors = realloc(cursors, ring_capacity * sizeof(struct ring_cursor));
+            if (cursors == NULL)
+            {
+                perror("realloc failed");
+                exit(1);
+            }
+        }
+        char name[NAME_MAX + 2];
+        snprintf(name, sizeof(name), "/%s", entry->d_name);
+        if (open_ring(name, &cursors[ring_count]))
+            ring_count++;
+    }
+    closedir(directory);
+    if (ring_count == 0)
+    {
+        fprintf(stderr, "No trace rings found, run a program with NP_TRACE=1 first\n");
+        exit(1);
+    }
+
+    // Every ring is in time order already, so merging is picking the earliest next record of all the rings.
+    int64_t first_ns = INT64_MAX;
+    uint64_t overwritten = 0;
+    for (int i = 0; i < ring_count; i++)
+    {
+        overwritten += cursors[i].next;
+        if (cursors[i].next < cursors[i].end)
+        {
+            struct trace_ring *ring = cursors[i].ring;
+            int64_t time_ns = ring->records[cursors[i].next % ring->capacity].time_ns;
+            if (time_ns < first_ns)
+                first_ns = time_ns;
+        }
+    }
+    uint64_t events = 0;
+    while (1)
+    {
+        struct ring_cursor *earliest = NULL;
+        int64_t earliest_ns = 0;
+        for (int i = 0; i < ring_count; i++)
+        {
+            struct ring_cursor *cursor = &cursors[i];
+            if (cursor->next == cursor->end)
+                continue;
+            int64_t time_ns = cursor->ring->records[cursor->next % cursor->ring->capacity].time_ns;
+            if (earliest == NULL || time_ns < earliest_ns)
+            {
+                earliest = cursor;
+                earliest_ns = time_ns;
+            }
+        }
+        if (earliest == NULL)
+            break;
+        print_record(&earliest->ring->records[earliest->next % earliest->ring->capacity], first_ns, absolute);
+        earliest->next++;
+        events++;
+    }
+    fprintf(stderr, "%lu events from %d processes", events, ring_count);
+    if (overwritten > 0)
+        fprintf(stderr, ", %lu older events were overwritten", overwritten);
+    fprintf(stderr, "\n");
+
+    for (int i = 0; i < ring_count; i++)
+    {
+        munmap(cursors[i].ring, cursors[i].size);
+        if (unlink_rings && shm_unlink(cursors[i].name) < 0)
+            perror("shm_unlink failed");
+    }
+    free(cursors);
+    exit(0);
+}
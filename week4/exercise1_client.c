@@ -1,16 +1,186 @@
+#define _GNU_SOURCE
 #include <arpa/inet.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <getopt.h>
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
 #include <netinet/in.h>
+#include <netinet/udp.h>
+#include <poll.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
 #include <sys/socket.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
-#define BUFFER_SIZE 100
+// Large enough for the biggest possible UDP datagram and for the coalesced segments handed over by UDP_GRO.
+#define BUFFER_SIZE 65536
+// Largest UDP payload that fits in an IPv4 datagram.
+#define MAX_DATAGRAM_SIZE 65507
+#define REQUEST_MAGIC 0x6e705251
+#define REPLIES_PER_REQUEST 2
+#define DEFAULT_MAX_WINDOW 256
+#define MAX_RETRANSMITS 16
+#define INITIAL_RETRANSMISSION_TIMEOUT_NS 100000000
+#define MIN_RETRANSMISSION_TIMEOUT_NS 1000000
+#define MAX_RETRANSMISSION_TIMEOUT_NS 2000000000
+// A request is retransmitted without waiting for its timer once this many later requests have been answered.
+#define FAST_RETRANSMIT_THRESHOLD 3
+
+// Every line is sent with this header in front of it. The server echoes the datagram back as is, so the header comes
+// back with the replies, which is why the fields are kept in host byte order. The only fields the server touches are
+// the timings, which it fills in when it has timestamping enabled and are zero otherwise. The send time of the first
+// reply is only known once it has been sent, so it comes in the second reply.
+struct RequestHeader
+{
+    uint32_t magic;
+    uint32_t sequence;
+    int64_t sentAtNs;
+    int64_t serverQueueNs;
+    int64_t serverProcessingNs;
+    int64_t serverSendNs;
+};
+
+// The parts the round trip of a request is split into with kernel timestamps enabled: from sendto to the kernel
+// sending the request, waiting in the server's socket queue, from the server's receive call to its send call, from
+// its send call to the kernel sending the reply, the rest of the time between the request leaving and the reply
+// arriving, and waiting in this client's socket queue.
+enum LatencyPart
+{
+    PART_CLIENT_SEND,
+    PART_SERVER_QUEUE,
+    PART_SERVER_PROCESSING,
+    PART_SERVER_SEND,
+    PART_NETWORK,
+    PART_CLIENT_QUEUE,
+    PART_COUNT
+};
+char* latencyPartNames[PART_COUNT] = {"Client send", "Server queue", "Server processing", "Server send", "Network and stack", "Client queue"};
+
+// The header eats into the maximum line length.
+#define MAX_LINE_LENGTH (MAX_DATAGRAM_SIZE - (int)sizeof(struct RequestHeader))
+// The input is read in small steps, so one read of short lines can't send thousands of requests before any replies are
+// read, or put many more of them in flight than the congestion window of the reliability layer allows. Longer lines
+// are still read whole over several steps.
+#define READ_STEP_SIZE 128
+
+// What is known about each sent request. Indexed by the sequence number.
+struct RequestState
+{
+    int64_t sentAtNs;
+    // Realtime clock time of the sendto call and of the kernel transmit timestamp, for the timestamping breakdown.
+    int64_t sentAtRealTimeNs;
+    int64_t transmittedAtNs;
+    // Number of the latest transmission of the request, the timestamps of earlier ones are ignored.
+    uint32_t transmitKey;
+    // What the first reply to the latest transmission brought, kept until the second one brings the server's send time.
+    int64_t replyReceivedAtNs;
+    int64_t replyReadAtNs;
+    int64_t serverQueueNs;
+    int64_t serverProcessingNs;
+    int64_t serverSendNs;
+    uint32_t replies;
+    uint32_t failed;
+};
+
+// A line that has been sent but not answered yet, kept for retransmitting it.
+struct PendingLine
+{
+    char* line;
+    size_t length;
+    size_t capacity;
+    int64_t timeoutNs;
+    int64_t retransmissionTimeoutNs;
+    int retransmits;
+    int fastRetransmitted;
+};
+
+// Optional reliability layer between the line framer and sendto. The server answers every request, so its replies
+// double as selective acknowledgements: a request is delivered once any reply to it has arrived. Unanswered requests
+// are retransmitted when their timer runs out or when enough later requests have been answered. The number of requests
+// in flight is limited by a congestion window that grows by one per answered request in slow start and by one per
+// window after that, and is halved at most once per window of requests when one is found lost.
+struct ReliableState
+{
+    int enabled;
+    int maxWindow;
+    // The window holds READ_STEP_SIZE more entries than maxWindow as one read from the input may contain many lines.
+    int windowCapacity;
+    struct PendingLine* window;
+    double congestionWindow;
+    double slowStartThreshold;
+    int64_t smoothedRttNs;
+    int64_t rttVarianceNs;
+    int64_t retransmissionTimeoutNs;
+    // All requests before this one have been answered or given up on.
+    uint32_t lowestUnanswered;
+    int64_t highestAnswered;
+    uint32_t recoveryPoint;
+    uint32_t inFlight;
+    uint64_t retransmissions;
+    uint64_t timeouts;
+    uint64_t fastRetransmissions;
+    uint64_t failed;
+};
+
+struct ClientStats
+{
+    struct RequestState* requests;
+    size_t requestCapacity;
+    uint32_t requestsSent;
+    uint64_t repliesReceived;
+    uint64_t duplicates;
+    uint64_t reordered;
+    uint64_t invalid;
+    uint64_t truncated;
+    uint64_t coalesced;
+    int gro;
+    int timestamps;
+    // With SOF_TIMESTAMPING_OPT_ID the kernel numbers transmit timestamps by datagram sent on the socket. This maps
+    // those numbers back to the sequence number of the request in the datagram.
+    uint32_t* transmitSequences;
+    size_t transmitCount;
+    size_t transmitCapacity;
+    int64_t* latencyParts[PART_COUNT];
+    size_t latencyPartCount;
+    int64_t highestSequenceSeen;
+    // Round trip time of the first reply to each request.
+    int64_t* roundTripTimes;
+    size_t roundTripCount;
+    // Probability of dropping each outgoing and incoming datagram on purpose to test the reliability layer.
+    double lossProbability;
+    uint64_t injectedLosses;
+    struct ReliableState reliable;
+};
+
+// Returns the current time of the realtime clock in nanoseconds, the clock the kernel timestamps are taken with.
+int64_t getRealTimeNs()
+{
+    struct timespec now;
+    if (clock_gettime(CLOCK_REALTIME, &now) < 0)
+    {
+        perror("Failed to get realtime");
+        exit(1);
+    }
+    return now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// Returns the current time of the monotonic clock in nanoseconds.
+int64_t getMonotonicTimeNs()
+{
+    struct timespec now;
+    if (clock_gettime(CLOCK_MONOTONIC, &now) < 0)
+    {
+        perror("Failed to get monotonic time");
+        exit(1);
+    }
+    return now.tv_sec * 1000000000 + now.tv_nsec;
+}
 
 // Inclusively returns the number of characters until the next newline character.
 // Returns -1 if no newline character is found in "length" bytes.
@@ -43,134 +213,624 @@ ssize_t loopedWrite(int file, void* data, size_t length)
     return writeResult;
 }
 
-void lineProcesser(int input, int output, int processSocket, struct sockaddr* serverAddress, int serverAddressLength)
+int compareInt64(const void* a, const void* b)
 {
-    // Forking to read from input and processSocket at the same time
-    pid_t child_pid = fork();
-    if (child_pid < 0)
+    int64_t first = *(const int64_t*)a;
+    int64_t second = *(const int64_t*)b;
+    return (first > second) - (first < second);
+}
+
+// Returns the given percentile of the sorted values.
+int64_t percentile(int64_t* sorted, size_t count, double percent)
+{
+    size_t index = (size_t)(percent / 100 * count);
+    if (index >= count)
+        index = count - 1;
+    return sorted[index];
+}
+
+// Returns 1 if the datagram should be dropped by the loss injection.
+int injectLoss(struct ClientStats* stats)
+{
+    if (stats->lossProbability <= 0 || drand48() >= stats->lossProbability)
+        return 0;
+    stats->injectedLosses++;
+    return 1;
+}
+
+// Sends the request with the given sequence number with a fresh timestamp. The timestamp is echoed back in the
+// replies, so the round trip time can be measured even for retransmitted requests.
+void transmitRequest(int processSocket, struct sockaddr* serverAddress, int serverAddressLength, struct ClientStats* stats, uint32_t sequence, char* line, size_t length)
+{
+    char message[BUFFER_SIZE];
+    struct RequestHeader header = {REQUEST_MAGIC, sequence, getMonotonicTimeNs(), 0, 0, 0};
+    memcpy(message, &header, sizeof(header));
+    memcpy(message + sizeof(header), line, length);
+    stats->requests[sequence].sentAtNs = header.sentAtNs;
+    stats->requests[sequence].sentAtRealTimeNs = stats->timestamps ? getRealTimeNs() : 0;
+    stats->requests[sequence].transmittedAtNs = 0;
+    stats->requests[sequence].replyReceivedAtNs = 0;
+    stats->requests[sequence].serverSendNs = 0;
+
+    if (injectLoss(stats))
+        return;
+    if (sendto(processSocket, message, sizeof(header) + length, 0, serverAddress, serverAddressLength) < 0)
     {
-        perror("Fork failed");
+        perror("Failed to send data to processing server");
         exit(1);
     }
-    else if (child_pid == 0) // Child process
+
+    if (stats->timestamps)
     {
-        // Child process reads from processSocket and writes to output
-        char responseMessage[BUFFER_SIZE];
-        ssize_t readResult;
-        while ((readResult = recvfrom(processSocket, responseMessage, BUFFER_SIZE, 0, NULL, NULL)) >= 0)
+        if (stats->transmitCount == stats->transmitCapacity)
         {
-            if (loopedWrite(output, responseMessage, readResult) < 0)
+            stats->transmitCapacity = stats->transmitCapacity > 0 ? stats->transmitCapacity * 2 : 1024;
+            if ((stats->transmitSequences = realloc(stats->transmitSequences, stats->transmitCapacity * sizeof(uint32_t))) == NULL)
             {
-                perror("Failed to write to output");
+                perror("Failed to grow transmit table");
                 exit(1);
             }
         }
-        // Error occurred, exit with failure
-        perror("Failed to read from processSocket");
-        exit(1);
+        stats->requests[sequence].transmitKey = stats->transmitCount;
+        stats->transmitSequences[stats->transmitCount++] = sequence;
+    }
+}
+
+// Reads the transmit timestamps the kernel has queued on the error queue of the socket and records them for the
+// requests they belong to.
+void receiveTransmitTimestamps(int processSocket, struct ClientStats* stats)
+{
+    while (1)
+    {
+        union
+        {
+            char buffer[CMSG_SPACE(sizeof(struct scm_timestamping)) + CMSG_SPACE(sizeof(struct sock_extended_err) + sizeof(struct sockaddr_in))];
+            struct cmsghdr align;
+        } control;
+        struct msghdr message;
+        memset(&message, 0, sizeof(message));
+        message.msg_control = &control;
+        message.msg_controllen = sizeof(control);
+        if (recvmsg(processSocket, &message, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return;
+            if (errno == EINTR)
+                continue;
+            perror("Failed to read the socket error queue");
+            exit(1);
+        }
+
+        int64_t timestamp = 0;
+        int64_t key = -1;
+        for (struct cmsghdr* header = CMSG_FIRSTHDR(&message); header != NULL; header = CMSG_NXTHDR(&message, header))
+        {
+            if (header->cmsg_level == SOL_SOCKET && header->cmsg_type == SO_TIMESTAMPING)
+            {
+                struct scm_timestamping timestamps;
+                memcpy(&timestamps, CMSG_DATA(header), sizeof(timestamps));
+                timestamp = timestamps.ts[0].tv_sec * 1000000000 + timestamps.ts[0].tv_nsec;
+            }
+            else if (header->cmsg_level == SOL_IP && header->cmsg_type == IP_RECVERR)
+            {
+                struct sock_extended_err error;
+                memcpy(&error, CMSG_DATA(header), sizeof(error));
+                if (error.ee_origin == SO_EE_ORIGIN_TIMESTAMPING)
+                    key = error.ee_data;
+            }
+        }
+        if (timestamp > 0 && key >= 0 && (size_t)key < stats->transmitCount)
+        {
+            struct RequestState* request = &stats->requests[stats->transmitSequences[key]];
+            if (request->transmitKey == key)
+                request->transmittedAtNs = timestamp;
+        }
+    }
+}
+
+// Sends one line with a sequence number and timestamp in front of it and records it as waiting for replies.
+void sendLine(int processSocket, struct sockaddr* serverAddress, int serverAddressLength, struct ClientStats* stats, char* line, size_t length)
+{
+    if (stats->requestsSent == stats->requestCapacity)
+    {
+        stats->requestCapacity = stats->requestCapacity > 0 ? stats->requestCapacity * 2 : 1024;
+        stats->requests = realloc(stats->requests, stats->requestCapacity * sizeof(struct RequestState));
+        stats->roundTripTimes = realloc(stats->roundTripTimes, stats->requestCapacity * sizeof(int64_t));
+        for (int part = 0; part < PART_COUNT && stats->timestamps; part++)
+        {
+            if ((stats->latencyParts[part] = realloc(stats->latencyParts[part], stats->requestCapacity * sizeof(int64_t))) == NULL)
+            {
+                perror("Failed to grow latency table");
+                exit(1);
+            }
+        }
+        if (stats->requests == NULL || stats->roundTripTimes == NULL)
+        {
+            perror("Failed to grow request table");
+            exit(1);
+        }
     }
-    else // Parent process
+
+    uint32_t sequence = stats->requestsSent++;
+    memset(&stats->requests[sequence], 0, sizeof(struct RequestState));
+
+    struct ReliableState* reliable = &stats->reliable;
+    if (reliable->enabled)
     {
-        // Keep reading max 100 characters to "data" until EOF is reached.
-        // Data is read to "data + readBufferOffset" to allow continuation of reading a line
-        // if the previous read ended without a newline.
-        char data[BUFFER_SIZE];
-        ssize_t charactersRead;
-        size_t readBufferOffset = 0;
-        char shouldSkipUntilNewline = 0;
-        while ((charactersRead = read(input, data + readBufferOffset, BUFFER_SIZE - readBufferOffset)) > 0)
+        struct PendingLine* pending = &reliable->window[sequence % reliable->windowCapacity];
+        if (pending->capacity < length)
         {
-            charactersRead += readBufferOffset;
+            pending->capacity = length;
+            if ((pending->line = realloc(pending->line, pending->capacity)) == NULL)
+            {
+                perror("Failed to allocate retransmission buffer");
+                exit(1);
+            }
+        }
+        memcpy(pending->line, line, length);
+        pending->length = length;
+        pending->retransmits = 0;
+        pending->fastRetransmitted = 0;
+        pending->retransmissionTimeoutNs = reliable->retransmissionTimeoutNs;
+        pending->timeoutNs = getMonotonicTimeNs() + pending->retransmissionTimeoutNs;
+        reliable->inFlight++;
+    }
+
+    transmitRequest(processSocket, serverAddress, serverAddressLength, stats, sequence, line, length);
+}
 
-            // Keep writing lines to processTo until the read buffer is empty or no newlines are found.
-            // If there is no newline in the read buffer, the start of the line is copied to the start of the buffer
-            // and readBufferOffset is set to the number of characters copied for the next read to continue reading the line.
-            size_t charactersWritten = 0;
-            while (charactersWritten < (size_t)charactersRead)
+// Returns 1 if the request is still waiting for its first reply.
+int isUnanswered(struct ClientStats* stats, uint32_t sequence)
+{
+    return stats->requests[sequence].replies == 0 && !stats->requests[sequence].failed;
+}
+
+void advanceLowestUnanswered(struct ClientStats* stats)
+{
+    struct ReliableState* reliable = &stats->reliable;
+    while (reliable->lowestUnanswered < stats->requestsSent && !isUnanswered(stats, reliable->lowestUnanswered))
+    {
+        reliable->lowestUnanswered++;
+    }
+}
+
+// Updates the round trip time estimate and the congestion window for the first reply to a request.
+void onRequestAnswered(struct ClientStats* stats, uint32_t sequence, int64_t roundTripNs)
+{
+    struct ReliableState* reliable = &stats->reliable;
+    reliable->inFlight--;
+    if ((int64_t)sequence > reliable->highestAnswered)
+        reliable->highestAnswered = sequence;
+
+    // Retransmission timeout as in RFC 6298.
+    if (reliable->smoothedRttNs == 0)
+    {
+        reliable->smoothedRttNs = roundTripNs;
+        reliable->rttVarianceNs = roundTripNs / 2;
+    }
+    else
+    {
+        int64_t difference = reliable->smoothedRttNs - roundTripNs;
+        reliable->rttVarianceNs = (3 * reliable->rttVarianceNs + (difference < 0 ? -difference : difference)) / 4;
+        reliable->smoothedRttNs = (7 * reliable->smoothedRttNs + roundTripNs) / 8;
+    }
+    reliable->retransmissionTimeoutNs = reliable->smoothedRttNs + 4 * reliable->rttVarianceNs;
+    if (reliable->retransmissionTimeoutNs < MIN_RETRANSMISSION_TIMEOUT_NS)
+        reliable->retransmissionTimeoutNs = MIN_RETRANSMISSION_TIMEOUT_NS;
+    if (reliable->retransmissionTimeoutNs > MAX_RETRANSMISSION_TIMEOUT_NS)
+        reliable->retransmissionTimeoutNs = MAX_RETRANSMISSION_TIMEOUT_NS;
+
+    if (reliable->congestionWindow < reliable->slowStartThreshold)
+        reliable->congestionWindow += 1;
+    else
+        reliable->congestionWindow += 1 / reliable->congestionWindow;
+    if (reliable->congestionWindow > reliable->maxWindow)
+        reliable->congestionWindow = reliable->maxWindow;
+
+    advanceLowestUnanswered(stats);
+}
+
+// Halves the congestion window, unless it was already halved for a loss within the current window of requests.
+void onRequestLost(struct ClientStats* stats, uint32_t sequence)
+{
+    struct ReliableState* reliable = &stats->reliable;
+    if (sequence < reliable->recoveryPoint)
+        return;
+    reliable->slowStartThreshold = reliable->congestionWindow / 2 < 2 ? 2 : reliable->congestionWindow / 2;
+    reliable->congestionWindow = reliable->slowStartThreshold;
+    reliable->recoveryPoint = stats->requestsSent;
+}
+
+// Retransmits every unanswered request whose timer has run out or that has been overtaken by enough answered requests.
+// Returns the time the next timer runs out or -1 if nothing is in flight.
+int64_t checkRetransmissions(int processSocket, struct sockaddr* serverAddress, int serverAddressLength, struct ClientStats* stats)
+{
+    struct ReliableState* reliable = &stats->reliable;
+    int64_t now = getMonotonicTimeNs();
+    int64_t nextTimeout = -1;
+    for (uint32_t sequence = reliable->lowestUnanswered; sequence < stats->requestsSent; sequence++)
+    {
+        if (!isUnanswered(stats, sequence))
+            continue;
+        struct PendingLine* pending = &reliable->window[sequence % reliable->windowCapacity];
+
+        int timedOut = now >= pending->timeoutNs;
+        int overtaken = !pending->fastRetransmitted && reliable->highestAnswered - (int64_t)sequence >= FAST_RETRANSMIT_THRESHOLD;
+        if (timedOut || overtaken)
+        {
+            if (pending->retransmits == MAX_RETRANSMITS)
             {
-                // Find the number of characters until the next newline.
-                // If no newline is found, break out of the loop to read more data.
-                ssize_t count = charactersUntilNewline(data + charactersWritten, charactersRead - charactersWritten);
-                if (count < 0)
-                    break;
-
-                // If the buffer was full previously, but now a newline was found, we should skip all the additional characters until the next (this) newline.
-                if (!shouldSkipUntilNewline)
-                {
-                    if (sendto(processSocket, data + charactersWritten, count, 0, serverAddress, serverAddressLength) < 0)
-                    {
-                        perror("Failed to send data to processing server");
-                        exit(1);
-                    }
-                }
-
-                // As we got to the end of the line, we can stop skipping characters until the next newline.
-                shouldSkipUntilNewline = 0;
-
-                // Update the number of characters written.
-                charactersWritten += count;
+                stats->requests[sequence].failed = 1;
+                reliable->failed++;
+                reliable->inFlight--;
+                continue;
             }
 
-            // If there were less characters written than read (because there was no newline), copy the remaining characters to the start
-            // of the buffer and set readBufferOffset to the number of characters copied.
-            // Otherwise, set readBufferOffset to 0 to indicate that the buffer is empty.
-            if (charactersWritten < (size_t)charactersRead)
+            onRequestLost(stats, sequence);
+            if (timedOut)
             {
-                readBufferOffset = charactersRead - charactersWritten;
-                memmove(data, data + charactersWritten, readBufferOffset);
+                // Back off exponentially for requests that keep timing out.
+                reliable->timeouts++;
+                pending->retransmissionTimeoutNs *= 2;
+                if (pending->retransmissionTimeoutNs > MAX_RETRANSMISSION_TIMEOUT_NS)
+                    pending->retransmissionTimeoutNs = MAX_RETRANSMISSION_TIMEOUT_NS;
             }
             else
             {
-                readBufferOffset = 0;
+                reliable->fastRetransmissions++;
+                pending->fastRetransmitted = 1;
+            }
+            pending->retransmits++;
+            reliable->retransmissions++;
+            pending->timeoutNs = now + pending->retransmissionTimeoutNs;
+            transmitRequest(processSocket, serverAddress, serverAddressLength, stats, sequence, pending->line, pending->length);
+        }
+
+        if (nextTimeout < 0 || pending->timeoutNs < nextTimeout)
+            nextTimeout = pending->timeoutNs;
+    }
+    advanceLowestUnanswered(stats);
+    return nextTimeout;
+}
+
+// Splits the round trip of a request into its parts using the kernel timestamps of both ends. "receivedAtNs" is the
+// kernel receive timestamp of the reply and "readAtNs" the realtime clock time it was read at. The first reply brings
+// the server's queueing and processing times and the second one how long the first took through the server's send
+// path, so the parts are recorded once both have arrived. The client side timestamps belong to the latest transmission
+// of the request, so replies to an earlier one are skipped.
+void recordLatencyParts(struct ClientStats* stats, struct RequestState* request, struct RequestHeader* header, int64_t receivedAtNs, int64_t readAtNs)
+{
+    if (header->sentAtNs != request->sentAtNs || request->transmittedAtNs == 0)
+        return;
+    if (header->serverSendNs > 0)
+        request->serverSendNs = header->serverSendNs;
+    else if (receivedAtNs > 0 && header->serverQueueNs > 0 && request->replyReceivedAtNs == 0)
+    {
+        request->replyReceivedAtNs = receivedAtNs;
+        request->replyReadAtNs = readAtNs;
+        request->serverQueueNs = header->serverQueueNs;
+        request->serverProcessingNs = header->serverProcessingNs;
+    }
+    if (request->replyReceivedAtNs == 0 || request->serverSendNs == 0)
+        return;
+
+    size_t index = stats->latencyPartCount++;
+    stats->latencyParts[PART_CLIENT_SEND][index] = request->transmittedAtNs - request->sentAtRealTimeNs;
+    stats->latencyParts[PART_SERVER_QUEUE][index] = request->serverQueueNs;
+    stats->latencyParts[PART_SERVER_PROCESSING][index] = request->serverProcessingNs;
+    stats->latencyParts[PART_SERVER_SEND][index] = request->serverSendNs;
+    stats->latencyParts[PART_NETWORK][index] = request->replyReceivedAtNs - request->transmittedAtNs - request->serverQueueNs - request->serverProcessingNs - request->serverSendNs;
+    stats->latencyParts[PART_CLIENT_QUEUE][index] = request->replyReadAtNs - request->replyReceivedAtNs;
+}
+
+// Matches one reply to its request and writes the line in it to output.
+void handleReply(int output, struct ClientStats* stats, char* responseMessage, size_t length, int64_t now, int64_t receivedAtNs, int64_t readAtNs)
+{
+    struct RequestHeader header;
+    if (length < sizeof(header))
+    {
+        stats->invalid++;
+        return;
+    }
+    memcpy(&header, responseMessage, sizeof(header));
+    if (header.magic != REQUEST_MAGIC || header.sequence >= stats->requestsSent || header.sentAtNs > now)
+    {
+        stats->invalid++;
+        return;
+    }
+
+    struct RequestState* request = &stats->requests[header.sequence];
+    if (request->failed)
+    {
+        stats->invalid++;
+        return;
+    }
+    request->replies++;
+    stats->repliesReceived++;
+    if (request->replies > REPLIES_PER_REQUEST)
+    {
+        stats->duplicates++;
+        return;
+    }
+    if (stats->timestamps)
+        recordLatencyParts(stats, request, &header, receivedAtNs, readAtNs);
+    if (request->replies == 1)
+    {
+        stats->roundTripTimes[stats->roundTripCount++] = now - header.sentAtNs;
+        if (stats->reliable.enabled)
+            onRequestAnswered(stats, header.sequence, now - header.sentAtNs);
+        if ((int64_t)header.sequence < stats->highestSequenceSeen)
+            stats->reordered++;
+        else
+            stats->highestSequenceSeen = header.sequence;
+    }
+
+    if (loopedWrite(output, responseMessage + sizeof(header), length - sizeof(header)) < 0)
+    {
+        perror("Failed to write to output");
+        exit(1);
+    }
+}
+
+// Reads one message from the socket without blocking and handles the replies in it. With GRO enabled the message
+// may hold several replies of the same size back to back. Returns 0 if there was nothing left to read and 1 otherwise.
+int receiveReply(int processSocket, int output, struct ClientStats* stats)
+{
+    static char responseMessage[BUFFER_SIZE];
+    union
+    {
+        char buffer[CMSG_SPACE(sizeof(int)) + CMSG_SPACE(sizeof(struct scm_timestamping))];
+        struct cmsghdr align;
+    } control;
+    struct iovec vector = {responseMessage, BUFFER_SIZE};
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &vector;
+    message.msg_iovlen = 1;
+    if (stats->gro || stats->timestamps)
+    {
+        message.msg_control = &control;
+        message.msg_controllen = sizeof(control);
+    }
+
+    ssize_t readResult = recvmsg(processSocket, &message, MSG_DONTWAIT);
+    int64_t now = getMonotonicTimeNs();
+    int64_t readAtNs = stats->timestamps ? getRealTimeNs() : 0;
+    if (readResult < 0)
+    {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return 0;
+        if (errno == EINTR || errno == ECONNREFUSED)
+            return 1;
+        perror("Failed to read from processSocket");
+        exit(1);
+    }
+    if (message.msg_flags & MSG_TRUNC)
+    {
+        stats->truncated++;
+        return 1;
+    }
+
+    size_t segmentSize = readResult;
+    int64_t receivedAtNs = 0;
+    for (struct cmsghdr* header = CMSG_FIRSTHDR(&message); header != NULL; header = CMSG_NXTHDR(&message, header))
+    {
+        if (header->cmsg_level == SOL_SOCKET && header->cmsg_type == SO_TIMESTAMPING)
+        {
+            struct scm_timestamping timestamps;
+            memcpy(&timestamps, CMSG_DATA(header), sizeof(timestamps));
+            receivedAtNs = timestamps.ts[0].tv_sec * 1000000000 + timestamps.ts[0].tv_nsec;
+        }
+        if (header->cmsg_level == SOL_UDP && header->cmsg_type == UDP_GRO)
+        {
+            int groSize;
+            memcpy(&groSize, CMSG_DATA(header), sizeof(groSize));
+            if (groSize > 0 && (size_t)groSize < segmentSize)
+            {
+                segmentSize = groSize;
+                stats->coalesced++;
             }
+        }
+    }
 
-            // If the read buffer is full and there is still no newline, the line is too long to fit in the buffer.
-            if (readBufferOffset >= BUFFER_SIZE)
+    for (size_t offset = 0; offset < (size_t)readResult; offset += segmentSize)
+    {
+        if (injectLoss(stats))
+            continue;
+        size_t length = (size_t)readResult - offset < segmentSize ? (size_t)readResult - offset : segmentSize;
+        handleReply(output, stats, responseMessage + offset, length, now, receivedAtNs, readAtNs);
+    }
+    return 1;
+}
+
+void printStats(struct ClientStats* stats)
+{
+    uint64_t expected = (uint64_t)stats->requestsSent * REPLIES_PER_REQUEST;
+    uint64_t unanswered = 0, halfAnswered = 0;
+    for (uint32_t i = 0; i < stats->requestsSent; i++)
+    {
+        if (stats->requests[i].replies == 0)
+            unanswered++;
+        else if (stats->requests[i].replies < REPLIES_PER_REQUEST)
+            halfAnswered++;
+    }
+    uint64_t missing = unanswered * REPLIES_PER_REQUEST + halfAnswered * (REPLIES_PER_REQUEST - 1);
+
+    fprintf(stderr, "Requests sent: %u, replies received: %lu of %lu expected\n", stats->requestsSent, stats->repliesReceived - stats->duplicates, expected);
+    fprintf(stderr, "Lost replies: %lu (%.2f%%), requests without any reply: %lu, with only one reply: %lu\n", missing, expected > 0 ? (double)missing * 100 / expected : 0, unanswered, halfAnswered);
+    fprintf(stderr, "Duplicate replies: %lu, reordered requests: %lu, invalid datagrams: %lu, truncated datagrams: %lu\n", stats->duplicates, stats->reordered, stats->invalid, stats->truncated);
+    if (stats->gro)
+        fprintf(stderr, "Receives carrying several coalesced replies: %lu\n", stats->coalesced);
+    if (stats->lossProbability > 0)
+        fprintf(stderr, "Datagrams dropped by loss injection: %lu\n", stats->injectedLosses);
+    if (stats->reliable.enabled)
+    {
+        struct ReliableState* reliable = &stats->reliable;
+        fprintf(stderr, "Retransmissions: %lu (%lu after timeout, %lu fast), requests given up on: %lu\n", reliable->retransmissions, reliable->timeouts, reliable->fastRetransmissions, reliable->failed);
+        fprintf(stderr, "Final congestion window: %.1f, smoothed rtt: %.1fus, retransmission timeout: %.1fus\n", reliable->congestionWindow, reliable->smoothedRttNs / 1000.0, reliable->retransmissionTimeoutNs / 1000.0);
+    }
+    if (stats->roundTripCount > 0)
+    {
+        qsort(stats->roundTripTimes, stats->roundTripCount, sizeof(int64_t), compareInt64);
+        fprintf(stderr, "Round trip time: min %.1fus, p50 %.1fus, p90 %.1fus, p99 %.1fus, p99.9 %.1fus, max %.1fus\n", stats->roundTripTimes[0] / 1000.0, percentile(stats->roundTripTimes, stats->roundTripCount, 50) / 1000.0, percentile(stats->roundTripTimes, stats->roundTripCount, 90) / 1000.0, percentile(stats->roundTripTimes, stats->roundTripCount, 99) / 1000.0, percentile(stats->roundTripTimes, stats->roundTripCount, 99.9) / 1000.0, stats->roundTripTimes[stats->roundTripCount - 1] / 1000.0);
+    }
+    if (stats->timestamps)
+    {
+        fprintf(stderr, "Requests with kernel timestamps from both ends: %zu\n", stats->latencyPartCount);
+        for (int part = 0; part < PART_COUNT && stats->latencyPartCount > 0; part++)
+        {
+            int64_t* values = stats->latencyParts[part];
+            size_t count = stats->latencyPartCount;
+            double sum = 0;
+            for (size_t i = 0; i < count; i++)
             {
-                fprintf(stderr, "Warning: Encountered a line longer than max line length\n");
-                readBufferOffset = 0;
-                shouldSkipUntilNewline = 1;
+                sum += values[i];
             }
+            qsort(values, count, sizeof(int64_t), compareInt64);
+            fprintf(stderr, "%s: mean %.1fus, p50 %.1fus, p90 %.1fus, p99 %.1fus, max %.1fus\n", latencyPartNames[part], sum / count / 1000, percentile(values, count, 50) / 1000.0, percentile(values, count, 90) / 1000.0, percentile(values, count, 99) / 1000.0, values[count - 1] / 1000.0);
         }
-        // Check if EOF was actually reached or if an error occurred.
-        if (charactersRead < 0)
+    }
+}
+
+// Reads lines from input and sends each of them to the server while writing the replies to output, all from one
+// process by polling both the input and the socket. After EOF on the input the replies still in flight are waited for
+// until all have arrived or nothing has been received for "drainTimeoutMs". With the reliability layer enabled new
+// lines are only read while the congestion window has room, and unanswered requests are retransmitted until answered.
+void lineProcesser(int input, int output, int processSocket, struct sockaddr* serverAddress, int serverAddressLength, int drainTimeoutMs, struct ClientStats* stats)
+{
+
+    // Keep reading max MAX_LINE_LENGTH characters to "data" until EOF is reached.
+    // Data is read to "data + readBufferOffset" to allow continuation of reading a line
+    // if the previous read ended without a newline.
+    char data[MAX_LINE_LENGTH];
+    ssize_t charactersRead;
+    size_t readBufferOffset = 0;
+    char shouldSkipUntilNewline = 0;
+    int inputOpen = 1;
+
+    struct pollfd pollfds[2] = {
+        {processSocket, POLLIN, 0},
+        {input, POLLIN, 0},
+    };
+    struct ReliableState* reliable = &stats->reliable;
+    while (inputOpen || stats->repliesReceived - stats->duplicates < (uint64_t)stats->requestsSent * REPLIES_PER_REQUEST)
+    {
+        // Without the reliability layer, or once every request has been answered at least once, wait for the rest
+        // of the replies until the drain timeout. Otherwise wait until the next retransmission timer runs out.
+        int64_t timeoutNs = inputOpen ? -1 : (int64_t)drainTimeoutMs * 1000000;
+        int readInput = inputOpen;
+        if (reliable->enabled)
         {
-            perror("Failed to read from input");
+            int64_t nextTimeout = checkRetransmissions(processSocket, serverAddress, serverAddressLength, stats);
+            if (nextTimeout >= 0)
+            {
+                timeoutNs = nextTimeout - getMonotonicTimeNs();
+                if (timeoutNs < 0)
+                    timeoutNs = 0;
+            }
+            readInput = inputOpen && stats->requestsSent - reliable->lowestUnanswered < (uint32_t)reliable->congestionWindow;
+        }
+
+        struct timespec timeout = {timeoutNs / 1000000000, timeoutNs % 1000000000};
+        int ready = ppoll(pollfds, readInput ? 2 : 1, timeoutNs >= 0 ? &timeout : NULL, NULL);
+        if (ready < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("Failed to poll input and socket");
             exit(1);
         }
-        // If there are still characters in the read buffer and EOF was reached, the file ended without a newline.
-        if (readBufferOffset > 0)
+        if (ready == 0)
         {
-            fprintf(stderr, "Warning: Input ended without a newline\n");
+            if (reliable->enabled && reliable->inFlight > 0)
+                continue;
+            fprintf(stderr, "No replies for %dms, giving up on the rest\n", drainTimeoutMs);
+            break;
         }
 
-        // Send SIGTERM to the child process to indicate that it should exit.
-        fprintf(stderr, "Received EOF from input. Waiting for response reader to exit\n");
-        kill(child_pid, SIGTERM);
+        // Take every reply that is already queued, as they arrive twice as fast as the requests go out.
+        if (pollfds[0].revents & (POLLIN | POLLERR))
+        {
+            // Transmit timestamps are read first, so they are known when the replies to the requests are handled.
+            if (stats->timestamps)
+                receiveTransmitTimestamps(processSocket, stats);
+            while (receiveReply(processSocket, output, stats))
+                ;
+        }
 
-        // Wait for the child process to finish
-        int status;
-        if (waitpid(child_pid, &status, 0) < 0)
+        if (!readInput || !(pollfds[1].revents & (POLLIN | POLLHUP | POLLERR)))
+            continue;
+
+        size_t readSize = MAX_LINE_LENGTH - readBufferOffset;
+        if (readSize > READ_STEP_SIZE)
+            readSize = READ_STEP_SIZE;
+        charactersRead = read(input, data + readBufferOffset, readSize);
+        if (charactersRead < 0)
         {
-            perror("Failed to wait for response reader process");
+            if (errno == EINTR)
+                continue;
+            perror("Failed to read from input");
             exit(1);
         }
+        if (charactersRead == 0)
+        {
+            // If there are still characters in the read buffer and EOF was reached, the file ended without a newline.
+            if (readBufferOffset > 0)
+            {
+                fprintf(stderr, "Warning: Input ended without a newline\n");
+            }
+            fprintf(stderr, "Received EOF from input. Waiting for the remaining replies\n");
+            inputOpen = 0;
+            continue;
+        }
+        charactersRead += readBufferOffset;
 
-        // Check if the child process exited via the expected signal
-        if (WIFSIGNALED(status) && WTERMSIG(status) == SIGTERM)
+        // Keep sending lines until the read buffer is empty or no newlines are found.
+        // If there is no newline in the read buffer, the start of the line is copied to the start of the buffer
+        // and readBufferOffset is set to the number of characters copied for the next read to continue reading the line.
+        size_t charactersWritten = 0;
+        while (charactersWritten < (size_t)charactersRead)
         {
-            fprintf(stderr, "Response reader process exited\n");
+            // Find the number of characters until the next newline.
+            // If no newline is found, break out of the loop to read more data.
+            ssize_t count = charactersUntilNewline(data + charactersWritten, charactersRead - charactersWritten);
+            if (count < 0)
+                break;
+
+            // If the buffer was full previously, but now a newline was found, we should skip all the additional characters until the next (this) newline.
+            if (!shouldSkipUntilNewline)
+                sendLine(processSocket, serverAddress, serverAddressLength, stats, data + charactersWritten, count);
+
+            // As we got to the end of the line, we can stop skipping characters until the next newline.
+            shouldSkipUntilNewline = 0;
+
+            // Update the number of characters written.
+            charactersWritten += count;
+        }
+
+        // If there were less characters written than read (because there was no newline), copy the remaining characters to the start
+        // of the buffer and set readBufferOffset to the number of characters copied.
+        // Otherwise, set readBufferOffset to 0 to indicate that the buffer is empty.
+        if (charactersWritten < (size_t)charactersRead)
+        {
+            readBufferOffset = charactersRead - charactersWritten;
+            memmove(data, data + charactersWritten, readBufferOffset);
         }
         else
         {
-            if (WIFSIGNALED(status))
-                fprintf(stderr, "Response reader process exited with signal %d\n", WTERMSIG(status));
-            else if (WIFEXITED(status))
-                fprintf(stderr, "Response reader process exited with status %d\n", WEXITSTATUS(status));
-            else
-                fprintf(stderr, "Response reader process exited for unknown reason\n");
+            readBufferOffset = 0;
+        }
+
+        // If the read buffer is full and there is still no newline, the line is too long to fit in the buffer.
+        if (readBufferOffset >= MAX_LINE_LENGTH)
+        {
+            fprintf(stderr, "Warning: Encountered a line longer than max line length\n");
+            readBufferOffset = 0;
+            shouldSkipUntilNewline = 1;
         }
     }
+
+    printStats(stats);
 }
 
 int main(__attribute__((unused)) int argc, __attribute__((unused)) char* argv[])
@@ -179,22 +839,110 @@ int main(__attribute__((unused)) int argc, __attribute__((unused)) char* argv[])
     char* serverAddressString;
     int socketfd;
     struct sockaddr_in serverAddress;
+    int drainTimeoutMs = 1000;
+    struct ClientStats stats;
+    memset(&stats, 0, sizeof(stats));
+    stats.highestSequenceSeen = -1;
+    stats.reliable.maxWindow = DEFAULT_MAX_WINDOW;
+
+    static struct option longOptions[] = {
+        {"drain-timeout", required_argument, NULL, 'd'},
+        {"reliable", no_argument, NULL, 'r'},
+        {"window", required_argument, NULL, 'w'},
+        {"loss", required_argument, NULL, 'l'},
+        {"gro", no_argument, NULL, 'g'},
+        {"timestamps", no_argument, NULL, 'T'},
+        {NULL, 0, NULL, 0},
+    };
+    int option;
+    while ((option = getopt_long(argc, argv, "d:rw:l:gT", longOptions, NULL)) != -1)
+    {
+        switch (option)
+        {
+        case 'T':
+            stats.timestamps = 1;
+            break;
+        case 'g':
+            stats.gro = 1;
+            break;
+        case 'r':
+            stats.reliable.enabled = 1;
+            break;
+        case 'w':
+            stats.reliable.maxWindow = atoi(optarg);
+            if (stats.reliable.maxWindow < 2)
+            {
+                fprintf(stderr, "Window must be at least 2 requests\n");
+                return 1;
+            }
+            break;
+        case 'l':
+            stats.lossProbability = atof(optarg) / 100;
+            if (stats.lossProbability < 0 || stats.lossProbability >= 1)
+            {
+                fprintf(stderr, "Loss must be a percentage from 0 up to but not including 100\n");
+                return 1;
+            }
+            break;
+        case 'd':
+            drainTimeoutMs = atoi(optarg);
+            if (drainTimeoutMs <= 0)
+            {
+                fprintf(stderr, "Drain timeout must be a positive number of milliseconds\n");
+                return 1;
+            }
+            break;
+        default:
+            return 1;
+        }
+    }
 
     // Read the server address and port from the command line arguments.
-    if (argc != 3)
+    if (argc - optind != 2)
     {
-        fprintf(stderr, "Usage: %s <server ip address> <server port>\n", argv[0]);
+        fprintf(stderr, "Usage: %s [--drain-timeout <ms>] [--reliable [--window <max requests in flight>]] [--loss <percent>] [--gro] [--timestamps] <server ip address> <server port>\n", argv[0]);
         return 1;
     }
-    serverAddressString = argv[1];
-    serverPort = atoi(argv[2]);
+    serverAddressString = argv[optind];
+    serverPort = atoi(argv[optind + 1]);
 
-    // Create a stream socket for the connection
+    srand48(getpid() ^ getMonotonicTimeNs());
+    if (stats.reliable.enabled)
+    {
+        struct ReliableState* reliable = &stats.reliable;
+        reliable->windowCapacity = reliable->maxWindow + READ_STEP_SIZE;
+        reliable->window = calloc(reliable->windowCapacity, sizeof(struct PendingLine));
+        if (reliable->window == NULL)
+        {
+            perror("Failed to allocate retransmission window");
+            return 1;
+        }
+        reliable->congestionWindow = 4;
+        reliable->slowStartThreshold = reliable->maxWindow;
+        reliable->retransmissionTimeoutNs = INITIAL_RETRANSMISSION_TIMEOUT_NS;
+        reliable->highestAnswered = -1;
+    }
+
+    // Create a datagram socket for the connection
     if ((socketfd = socket(PF_INET, SOCK_DGRAM, 0)) < 0)
     {
         perror("Failed to create socket");
         return 1; // Exit with error if socket creation fails
     }
+    int enable = 1;
+    if (stats.gro && setsockopt(socketfd, IPPROTO_UDP, UDP_GRO, &enable, sizeof(enable)) < 0)
+    {
+        perror("Failed to enable UDP_GRO");
+        return 1;
+    }
+    // Software timestamps for both directions. OPT_ID numbers the transmit timestamps and OPT_TSONLY leaves the
+    // datagram itself out of the error queue messages they arrive in.
+    int timestampFlags = SOF_TIMESTAMPING_TX_SOFTWARE | SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE | SOF_TIMESTAMPING_OPT_ID | SOF_TIMESTAMPING_OPT_TSONLY;
+    if (stats.timestamps && setsockopt(socketfd, SOL_SOCKET, SO_TIMESTAMPING, &timestampFlags, sizeof(timestampFlags)) < 0)
+    {
+        perror("Failed to enable SO_TIMESTAMPING");
+        return 1;
+    }
 
     // Initialize serverAddress struct with server IP address and port
     memset(&serverAddress, 0, sizeof(serverAddress));
@@ -207,7 +955,19 @@ int main(__attribute__((unused)) int argc, __attribute__((unused)) char* argv[])
     serverAddress.sin_port = htons(serverPort);
 
     // Start client program that reads from standard input, sends to server and reads from server, writes to standard output
-    lineProcesser(STDIN_FILENO, STDOUT_FILENO, socketfd, (struct sockaddr*)&serverAddress, sizeof(serverAddress));
+    lineProcesser(STDIN_FILENO, STDOUT_FILENO, socketfd, (struct sockaddr*)&serverAddress, sizeof(serverAddress), drainTimeoutMs, &stats);
+    free(stats.requests);
+    free(stats.roundTripTimes);
+    free(stats.transmitSequences);
+    for (int part = 0; part < PART_COUNT; part++)
+    {
+        free(stats.latencyParts[part]);
+    }
+    for (int i = 0; i < stats.reliable.windowCapacity; i++)
+    {
+        free(stats.reliable.window[i].line);
+    }
+    free(stats.reliable.window);
 
     // Close the socket
     if (close(socketfd) < 0)
@@ -217,4 +977,4 @@ int main(__attribute__((unused)) int argc, __attribute__((unused)) char* argv[])
     }
 
     return 0;
-}
\ No newline at end of file
+}
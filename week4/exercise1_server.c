@@ -1,7 +1,17 @@
+// -pthread
+#define _GNU_SOURCE
 #include <arpa/inet.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <getopt.h>
+#include <linux/errqueue.h>
+#include <linux/filter.h>
+#include <linux/net_tstamp.h>
 #include <netinet/in.h>
+#include <netinet/udp.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -9,76 +19,693 @@
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
-#define BUFFER_SIZE 100
+// Large enough for the biggest possible UDP datagram and for the coalesced segments handed over by UDP_GRO.
+#define BUFFER_SIZE 65536
+#define DEFAULT_BATCH_SIZE 64
+// sendmmsg sends at most 1024 messages per call and every datagram is answered twice.
+#define MAX_BATCH_SIZE 512
+#define MAX_THREADS 256
+#define REQUEST_MAGIC 0x6e705251
 
-int main(__attribute__((unused)) int argc, __attribute__((unused)) char* argv[])
+// Header the client of exercise1 puts in front of every request, in the byte order of the client. Everything is echoed
+// back as is, except that with timestamping enabled the server fills in how long the request waited in the socket
+// queue and how long it took from receiving it to sending the replies. The second reply also carries how long the
+// first one took from the send call to the kernel's transmit timestamp. Only done for clients on the same byte order.
+struct RequestHeader
 {
-    int serverPort;
+    uint32_t magic;
+    uint32_t sequence;
+    int64_t sentAtNs;
+    int64_t serverQueueNs;
+    int64_t serverProcessingNs;
+    int64_t serverSendNs;
+};
 
-    // Read the server port from the command line arguments.
-    if (argc != 2)
+// Counters printed periodically instead of logging every datagram. Each worker thread only writes its own counters
+// and the main thread reads them for the reports, so every worker gets a cache line of its own.
+struct WorkerStats
+{
+    uint64_t packets;
+    uint64_t bytes;
+    uint64_t replies;
+    uint64_t sendFailures;
+    uint64_t receiveCalls;
+    // Datagrams cut short because they didn't fit in the buffer, and receives that carried several GRO segments.
+    uint64_t truncated;
+    uint64_t coalesced;
+    // Requests that got a kernel receive timestamp and the total time they spent in the socket queue.
+    uint64_t timestamped;
+    uint64_t queueNs;
+    // First replies that got a kernel transmit timestamp and the total time from the send call to it.
+    uint64_t sendTimestamped;
+    uint64_t sendNs;
+} __attribute__((aligned(64)));
+
+struct Worker
+{
+    pthread_t thread;
+    int socketfd;
+    int cpu;
+    int batchSize;
+    int gro;
+    int timestamps;
+    // With SOF_TIMESTAMPING_OPT_ID the kernel numbers the datagrams sent on the socket, this is the next number.
+    uint32_t transmitKey;
+    struct WorkerStats stats;
+};
+
+// Control message buffer big enough for the GRO segment size and a receive timestamp, aligned as cmsghdr requires.
+union ControlBuffer
+{
+    char buffer[CMSG_SPACE(sizeof(int)) + CMSG_SPACE(sizeof(struct scm_timestamping))];
+    struct cmsghdr align;
+};
+
+// Returns the current time of the monotonic clock in microseconds.
+int64_t getMonotonicTimeUs()
+{
+    struct timespec now;
+    if (clock_gettime(CLOCK_MONOTONIC, &now) < 0)
     {
-        fprintf(stderr, "usage: %s <server port>\n", argv[0]);
+        perror("Failed to get monotonic time");
         exit(1);
     }
-    serverPort = atoi(argv[1]);
+    return now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
 
-    // Create a socket
-    struct sockaddr_in serverAddress, clientAddress;
-    int listenSocketfd;
-    if ((listenSocketfd = socket(PF_INET, SOCK_DGRAM, PF_UNSPEC)) < 0)
+// Returns the current time of the realtime clock in nanoseconds, the clock the kernel timestamps are taken with.
+int64_t getRealTimeNs()
+{
+    struct timespec now;
+    if (clock_gettime(CLOCK_REALTIME, &now) < 0)
+    {
+        perror("Failed to get realtime");
+        exit(1);
+    }
+    return now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// Reads all counters of a worker. Relaxed loads are enough as the counters are independent of each other.
+void loadStats(struct WorkerStats* stats, struct WorkerStats* result)
+{
+    result->packets = __atomic_load_n(&stats->packets, __ATOMIC_RELAXED);
+    result->bytes = __atomic_load_n(&stats->bytes, __ATOMIC_RELAXED);
+    result->replies = __atomic_load_n(&stats->replies, __ATOMIC_RELAXED);
+    result->sendFailures = __atomic_load_n(&stats->sendFailures, __ATOMIC_RELAXED);
+    result->receiveCalls = __atomic_load_n(&stats->receiveCalls, __ATOMIC_RELAXED);
+    result->truncated = __atomic_load_n(&stats->truncated, __ATOMIC_RELAXED);
+    result->coalesced = __atomic_load_n(&stats->coalesced, __ATOMIC_RELAXED);
+    result->timestamped = __atomic_load_n(&stats->timestamped, __ATOMIC_RELAXED);
+    result->queueNs = __atomic_load_n(&stats->queueNs, __ATOMIC_RELAXED);
+    result->sendTimestamped = __atomic_load_n(&stats->sendTimestamped, __ATOMIC_RELAXED);
+    result->sendNs = __atomic_load_n(&stats->sendNs, __ATOMIC_RELAXED);
+}
+
+// Prints the counters accumulated between the "previous" and "current" snapshots.
+void reportStats(char* name, struct WorkerStats* previous, struct WorkerStats* current, int64_t elapsedUs)
+{
+    double seconds = (double)elapsedUs / 1000000;
+    uint64_t packets = current->packets - previous->packets;
+    uint64_t receiveCalls = current->receiveCalls - previous->receiveCalls;
+    uint64_t sendFailures = current->sendFailures - previous->sendFailures;
+    fprintf(stderr, "%s: received %lu datagrams (%.0f/s, %.2f MB/s, %.1f per receive call), sent %lu replies", name, packets, packets / seconds, (double)(current->bytes - previous->bytes) / 1024 / 1024 / seconds, receiveCalls > 0 ? (double)packets / receiveCalls : 0, current->replies - previous->replies);
+    if (sendFailures > 0)
+        fprintf(stderr, ", %lu sends failed", sendFailures);
+    if (current->truncated > previous->truncated)
+        fprintf(stderr, ", %lu truncated", current->truncated - previous->truncated);
+    if (current->coalesced > previous->coalesced)
+        fprintf(stderr, ", %lu coalesced receives", current->coalesced - previous->coalesced);
+    if (current->timestamped > previous->timestamped)
+        fprintf(stderr, ", %.1fus average socket queueing", (double)(current->queueNs - previous->queueNs) / (current->timestamped - previous->timestamped) / 1000);
+    if (current->sendTimestamped > previous->sendTimestamped)
+        fprintf(stderr, ", %.1fus average send", (double)(current->sendNs - previous->sendNs) / (current->sendTimestamped - previous->sendTimestamped) / 1000);
+    fprintf(stderr, "\n");
+}
+
+// Returns the GRO segment size from the control messages of a received message or 0 if it wasn't coalesced.
+int getGroSegmentSize(struct msghdr* header)
+{
+    for (struct cmsghdr* control = CMSG_FIRSTHDR(header); control != NULL; control = CMSG_NXTHDR(header, control))
+    {
+        if (control->cmsg_level == SOL_UDP && control->cmsg_type == UDP_GRO)
+        {
+            int segmentSize;
+            memcpy(&segmentSize, CMSG_DATA(control), sizeof(segmentSize));
+            return segmentSize;
+        }
+    }
+    return 0;
+}
+
+// Returns the software receive timestamp from the control messages of a received message or 0 if there is none.
+int64_t getReceiveTimestamp(struct msghdr* header)
+{
+    for (struct cmsghdr* control = CMSG_FIRSTHDR(header); control != NULL; control = CMSG_NXTHDR(header, control))
+    {
+        if (control->cmsg_level == SOL_SOCKET && control->cmsg_type == SO_TIMESTAMPING)
+        {
+            struct scm_timestamping timestamps;
+            memcpy(&timestamps, CMSG_DATA(control), sizeof(timestamps));
+            return timestamps.ts[0].tv_sec * 1000000000 + timestamps.ts[0].tv_nsec;
+        }
+    }
+    return 0;
+}
+
+// Sends "count" messages with as few sendmmsg calls as possible and returns how many datagrams they held. sendmmsg
+// stops at the first message that fails, that one is skipped and the rest of the batch sent. With "sentMessages" set
+// the index of every message sent is stored there in order, which is also the order the kernel numbers them in for
+// the transmit timestamps, and their count is stored in "sentCount".
+uint64_t sendAll(int socketfd, struct mmsghdr* messages, int count, struct iovec* sendVectors, size_t* segmentCounts, int* sendFailures, int* sentMessages, int* sentCount)
+{
+    int sent = 0;
+    uint64_t replies = 0;
+    while (sent < count)
+    {
+        int result = sendmmsg(socketfd, messages + sent, count - sent, 0);
+        if (result < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            (*sendFailures)++;
+            sent++;
+            continue;
+        }
+        for (int i = sent; i < sent + result; i++)
+        {
+            replies += segmentCounts[messages[i].msg_hdr.msg_iov - sendVectors];
+            if (sentMessages != NULL)
+                sentMessages[(*sentCount)++] = i;
+        }
+        sent += result;
+    }
+    return replies;
+}
+
+// Reads the transmit timestamps the kernel has queued on the error queue of the socket. Those of the "sentCount"
+// datagrams numbered from "firstKey" on are stored in "transmittedAt" by the index of their message, the rest belong to
+// second replies and earlier batches and are dropped. Software timestamps are taken within the send call, so they are
+// already there for the datagrams that left right away.
+void receiveTransmitTimestamps(int socketfd, uint32_t firstKey, int* sentMessages, int sentCount, int64_t* transmittedAt)
+{
+    while (1)
+    {
+        union
+        {
+            char buffer[CMSG_SPACE(sizeof(struct scm_timestamping)) + CMSG_SPACE(sizeof(struct sock_extended_err) + sizeof(struct sockaddr_in))];
+            struct cmsghdr align;
+        } control;
+        struct msghdr message;
+        memset(&message, 0, sizeof(message));
+        message.msg_control = &control;
+        message.msg_controllen = sizeof(control);
+        if (recvmsg(socketfd, &message, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return;
+            if (errno == EINTR)
+                continue;
+            perror("Failed to read the socket error queue");
+            exit(1);
+        }
+
+        int64_t timestamp = 0;
+        int hasKey = 0;
+        uint32_t key = 0;
+        for (struct cmsghdr* header = CMSG_FIRSTHDR(&message); header != NULL; header = CMSG_NXTHDR(&message, header))
+        {
+            if (header->cmsg_level == SOL_SOCKET && header->cmsg_type == SO_TIMESTAMPING)
+            {
+                struct scm_timestamping timestamps;
+                memcpy(&timestamps, CMSG_DATA(header), sizeof(timestamps));
+                timestamp = timestamps.ts[0].tv_sec * 1000000000 + timestamps.ts[0].tv_nsec;
+            }
+            else if (header->cmsg_level == SOL_IP && header->cmsg_type == IP_RECVERR)
+            {
+                struct sock_extended_err error;
+                memcpy(&error, CMSG_DATA(header), sizeof(error));
+                if (error.ee_origin == SO_EE_ORIGIN_TIMESTAMPING)
+                {
+                    key = error.ee_data;
+                    hasKey = 1;
+                }
+            }
+        }
+        if (timestamp > 0 && hasKey && key - firstKey < (uint32_t)sentCount)
+            transmittedAt[sentMessages[key - firstKey]] = timestamp;
+    }
+}
+
+// Writes the given timings into the header of every request in a received message. "segmentSize" is the length of
+// each request when the message holds several coalesced by GRO. Fields given as -1 are left as they are.
+void writeTimings(char* buffer, size_t length, size_t segmentSize, int64_t queueNs, int64_t processingNs, int64_t sendNs)
+{
+    for (size_t offset = 0; offset + sizeof(struct RequestHeader) <= length; offset += segmentSize)
+    {
+        struct RequestHeader header;
+        memcpy(&header, buffer + offset, sizeof(header));
+        if (header.magic != REQUEST_MAGIC)
+            continue;
+        if (queueNs >= 0)
+            header.serverQueueNs = queueNs;
+        if (processingNs >= 0)
+            header.serverProcessingNs = processingNs;
+        if (sendNs >= 0)
+            header.serverSendNs = sendNs;
+        memcpy(buffer + offset, &header, sizeof(header));
+    }
+}
+
+// Receives up to "batchSize" datagrams with one recvmmsg call and sends both copies of every one of them back with
+// sendmmsg, so a full batch costs two system calls instead of three per datagram. With GRO enabled one received
+// message may hold several datagrams of the same size back to back. Those are sent back with UDP_SEGMENT so the
+// kernel splits them into the original datagrams again. With timestamping enabled the time each request spent in the
+// socket queue and in this loop is written into its header before the replies are sent. The first replies of the
+// batch then go out before the second ones, so that the time the first reply of every request took through the send
+// path, taken from its transmit timestamp, can be written into the second reply.
+void* serveBatched(void* argument)
+{
+    struct Worker* worker = argument;
+    int socketfd = worker->socketfd;
+    int batchSize = worker->batchSize;
+
+    // Pin the thread to its own core so the socket, the thread and its counters stay local to that core.
+    if (worker->cpu >= 0)
+    {
+        cpu_set_t cpuSet;
+        CPU_ZERO(&cpuSet);
+        CPU_SET(worker->cpu, &cpuSet);
+        int result = pthread_setaffinity_np(pthread_self(), sizeof(cpuSet), &cpuSet);
+        if (result != 0)
+            fprintf(stderr, "Warning: Failed to pin worker to cpu %d: %s\n", worker->cpu, strerror(result));
+    }
+
+    char(*buffers)[BUFFER_SIZE] = malloc(batchSize * sizeof(*buffers));
+    struct sockaddr_in* clientAddresses = malloc(batchSize * sizeof(*clientAddresses));
+    struct iovec* receiveVectors = malloc(batchSize * sizeof(*receiveVectors));
+    struct iovec* sendVectors = malloc(batchSize * sizeof(*sendVectors));
+    struct mmsghdr* receiveMessages = calloc(batchSize, sizeof(*receiveMessages));
+    struct mmsghdr* sendMessages = calloc(2 * batchSize, sizeof(*sendMessages));
+    union ControlBuffer* receiveControls = calloc(batchSize, sizeof(*receiveControls));
+    union ControlBuffer* sendControls = calloc(batchSize, sizeof(*sendControls));
+    size_t* segmentCounts = malloc(batchSize * sizeof(*segmentCounts));
+    size_t* segmentSizes = malloc(batchSize * sizeof(*segmentSizes));
+    int* sentMessages = malloc(batchSize * sizeof(*sentMessages));
+    int64_t* transmittedAt = malloc(batchSize * sizeof(*transmittedAt));
+    if (segmentCounts == NULL || segmentSizes == NULL || sentMessages == NULL || transmittedAt == NULL || buffers == NULL || clientAddresses == NULL || receiveVectors == NULL || sendVectors == NULL || receiveMessages == NULL || sendMessages == NULL || receiveControls == NULL || sendControls == NULL)
+    {
+        perror("Failed to allocate batch buffers");
+        exit(1);
+    }
+    for (int i = 0; i < batchSize; i++)
+    {
+        receiveVectors[i].iov_base = buffers[i];
+        receiveVectors[i].iov_len = BUFFER_SIZE;
+        receiveMessages[i].msg_hdr.msg_iov = &receiveVectors[i];
+        receiveMessages[i].msg_hdr.msg_iovlen = 1;
+        receiveMessages[i].msg_hdr.msg_name = &clientAddresses[i];
+    }
+
+    while (1)
+    {
+        // The kernel overwrites the address and control lengths, so they need to be reset before every call.
+        for (int i = 0; i < batchSize; i++)
+        {
+            receiveMessages[i].msg_hdr.msg_namelen = sizeof(clientAddresses[i]);
+            if (worker->gro || worker->timestamps)
+            {
+                receiveMessages[i].msg_hdr.msg_control = &receiveControls[i];
+                receiveMessages[i].msg_hdr.msg_controllen = sizeof(receiveControls[i]);
+            }
+        }
+
+        // MSG_WAITFORONE blocks only until the first datagram and then takes whatever else is already queued.
+        int received = recvmmsg(socketfd, receiveMessages, batchSize, MSG_WAITFORONE, NULL);
+        int64_t receivedAt = worker->timestamps ? getRealTimeNs() : 0;
+        if (received < 0)
+        {
+            // idk if these are correct or even exhaustive, but these were in the example of tcp man page
+            if (errno == EINTR || errno == ENETDOWN || errno == EPROTO || errno == ENOPROTOOPT || errno == EHOSTDOWN || errno == EHOSTUNREACH || errno == ENETUNREACH || errno == EOPNOTSUPP || errno == ENOENT)
+                continue;
+            else
+            {
+                perror("Failed to receive messages from clients");
+                exit(1);
+            }
+        }
+
+        // Queue every message twice to send it back to the client twice, all the first replies before the second ones.
+        // A truncated message is only counted, echoing the part that fit would look like a whole line to the client.
+        int queued = 0;
+        uint64_t bytes = 0;
+        uint64_t datagrams = 0;
+        int truncated = 0;
+        int coalesced = 0;
+        uint64_t timestamped = 0;
+        uint64_t queueNs = 0;
+        for (int i = 0; i < received; i++)
+        {
+            size_t length = receiveMessages[i].msg_len;
+            if (receiveMessages[i].msg_hdr.msg_flags & MSG_TRUNC)
+            {
+                truncated++;
+                segmentCounts[i] = 0;
+                continue;
+            }
+
+            int segmentSize = worker->gro ? getGroSegmentSize(&receiveMessages[i].msg_hdr) : 0;
+            size_t segments = 1;
+            if (segmentSize > 0 && length > (size_t)segmentSize)
+            {
+                segments = (length + segmentSize - 1) / segmentSize;
+                coalesced++;
+            }
+
+            sendVectors[i].iov_base = buffers[i];
+            sendVectors[i].iov_len = length;
+            struct msghdr* header = &sendMessages[queued].msg_hdr;
+            header->msg_iov = &sendVectors[i];
+            header->msg_iovlen = 1;
+            header->msg_name = &clientAddresses[i];
+            header->msg_namelen = receiveMessages[i].msg_hdr.msg_namelen;
+            header->msg_control = NULL;
+            header->msg_controllen = 0;
+            if (segments > 1)
+            {
+                header->msg_control = &sendControls[i];
+                header->msg_controllen = CMSG_SPACE(sizeof(uint16_t));
+                struct cmsghdr* control = CMSG_FIRSTHDR(header);
+                control->cmsg_level = SOL_UDP;
+                control->cmsg_type = UDP_SEGMENT;
+                control->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+                uint16_t gsoSize = segmentSize;
+                memcpy(CMSG_DATA(control), &gsoSize, sizeof(gsoSize));
+            }
+            segmentCounts[i] = segments;
+            segmentSizes[i] = segments > 1 ? (size_t)segmentSize : length;
+            queued++;
+            bytes += length;
+            datagrams += segments;
+
+            int64_t receiveTimestamp = worker->timestamps ? getReceiveTimestamp(&receiveMessages[i].msg_hdr) : 0;
+            if (receiveTimestamp > 0 && receiveTimestamp <= receivedAt)
+            {
+                timestamped += segments;
+                queueNs += segments * (receivedAt - receiveTimestamp);
+            }
+        }
+
+        // Fill in the timings as late as possible, so the processing time covers everything up to the send call.
+        if (worker->timestamps)
+        {
+            int64_t processingNs = getRealTimeNs() - receivedAt;
+            for (int i = 0; i < received; i++)
+            {
+                int64_t receiveTimestamp = getReceiveTimestamp(&receiveMessages[i].msg_hdr);
+                if (segmentCounts[i] > 0 && receiveTimestamp > 0)
+                    writeTimings(buffers[i], sendVectors[i].iov_len, segmentSizes[i], receivedAt - receiveTimestamp, processingNs, 0);
+            }
+        }
+
+        // The second replies are the same messages again
+        memcpy(sendMessages + queued, sendMessages, queued * sizeof(*sendMessages));
+        uint64_t replies = 0;
+        int sendFailures = 0;
+        uint64_t sendTimestamped = 0;
+        uint64_t sendNs = 0;
+        if (worker->timestamps)
+        {
+            // Every datagram sent gets a transmit timestamp, including the second replies, so the numbers keep counting
+            // through both halves
+            int sentCount = 0;
+            uint32_t firstKey = worker->transmitKey;
+            int64_t sendStart = getRealTimeNs();
+            replies += sendAll(socketfd, sendMessages, queued, sendVectors, segmentCounts, &sendFailures, sentMessages, &sentCount);
+            memset(transmittedAt, 0, queued * sizeof(*transmittedAt));
+            receiveTransmitTimestamps(socketfd, firstKey, sentMessages, sentCount, transmittedAt);
+            for (int k = 0; k < queued; k++)
+            {
+                int i = sendMessages[k].msg_hdr.msg_iov - sendVectors;
+                if (transmittedAt[k] < sendStart)
+                    continue;
+                writeTimings(buffers[i], sendVectors[i].iov_len, segmentSizes[i], -1, -1, transmittedAt[k] - sendStart);
+                sendTimestamped += segmentCounts[i];
+                sendNs += segmentCounts[i] * (transmittedAt[k] - sendStart);
+            }
+            int secondCount = 0;
+            replies += sendAll(socketfd, sendMessages + queued, queued, sendVectors, segmentCounts, &sendFailures, sentMessages, &secondCount);
+            worker->transmitKey = firstKey + sentCount + secondCount;
+        }
+        else
+            replies += sendAll(socketfd, sendMessages, 2 * queued, sendVectors, segmentCounts, &sendFailures, NULL, NULL);
+
+        __atomic_fetch_add(&worker->stats.packets, datagrams, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&worker->stats.truncated, truncated, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&worker->stats.coalesced, coalesced, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&worker->stats.timestamped, timestamped, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&worker->stats.queueNs, queueNs, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&worker->stats.sendTimestamped, sendTimestamped, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&worker->stats.sendNs, sendNs, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&worker->stats.bytes, bytes, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&worker->stats.replies, replies, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&worker->stats.sendFailures, sendFailures, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&worker->stats.receiveCalls, 1, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+// Creates a UDP socket bound to the given port. With "reusePort" set several sockets can be bound to the same port
+// and the kernel spreads the incoming datagrams between them. With "gro" set the kernel may coalesce consecutive
+// datagrams of the same flow into one receive. With "timestamps" set every datagram gets the time the kernel received
+// it, and every datagram sent a numbered transmit timestamp on the error queue of the socket.
+int createServerSocket(int serverPort, int reusePort, int gro, int timestamps)
+{
+    int socketfd;
+    if ((socketfd = socket(PF_INET, SOCK_DGRAM, PF_UNSPEC)) < 0)
     {
         perror("Failed to create socket");
-        return 1;
+        exit(1);
+    }
+
+    int enable = 1;
+    if (reusePort && setsockopt(socketfd, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable)) < 0)
+    {
+        perror("Failed to set SO_REUSEPORT");
+        exit(1);
+    }
+    if (gro && setsockopt(socketfd, IPPROTO_UDP, UDP_GRO, &enable, sizeof(enable)) < 0)
+    {
+        perror("Failed to enable UDP_GRO");
+        exit(1);
+    }
+    int timestampFlags = SOF_TIMESTAMPING_TX_SOFTWARE | SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE | SOF_TIMESTAMPING_OPT_ID | SOF_TIMESTAMPING_OPT_TSONLY;
+    if (timestamps && setsockopt(socketfd, SOL_SOCKET, SO_TIMESTAMPING, &timestampFlags, sizeof(timestampFlags)) < 0)
+    {
+        perror("Failed to enable SO_TIMESTAMPING");
+        exit(1);
     }
 
     // Set the port and address to bind the socket to
+    struct sockaddr_in serverAddress;
     memset(&serverAddress, 0, sizeof(serverAddress));
     serverAddress.sin_family = AF_INET;
     serverAddress.sin_addr.s_addr = htonl(INADDR_ANY);
     serverAddress.sin_port = htons(serverPort);
-    if (bind(listenSocketfd, (struct sockaddr*)&serverAddress, sizeof(serverAddress)) < 0)
+    if (bind(socketfd, (struct sockaddr*)&serverAddress, sizeof(serverAddress)) < 0)
     {
         perror("Failed to bind socket");
-        return 1;
+        exit(1);
     }
+    return socketfd;
+}
 
-    fprintf(stderr, "Started listening for UDP messages on port %d\n", serverPort);
-
-    while (1)
+// Attaches a classic BPF program to the reuseport group that picks the socket by the index of the cpu the datagram
+// was received on. The sockets were bound in the order of the cpus their threads are pinned to, so the datagram is
+// handled on the same core that the kernel processed it on.
+void attachCpuSteering(int socketfd, int socketCount)
+{
+    struct sock_filter code[] = {
+        {BPF_LD | BPF_W | BPF_ABS, 0, 0, SKF_AD_OFF + SKF_AD_CPU},
+        {BPF_ALU | BPF_MOD | BPF_K, 0, 0, socketCount},
+        {BPF_RET | BPF_A, 0, 0, 0},
+    };
+    struct sock_fprog program = {sizeof(code) / sizeof(code[0]), code};
+    if (setsockopt(socketfd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &program, sizeof(program)) < 0)
     {
-        int clientAddressSize = sizeof(clientAddress);
+        perror("Failed to attach reuseport cpu steering program");
+        exit(1);
+    }
+}
 
-        char message[BUFFER_SIZE];
-        int messageLength = recvfrom(listenSocketfd, message, BUFFER_SIZE, 0, (struct sockaddr*)&clientAddress, (socklen_t*)&clientAddressSize);
-        if (messageLength < 0)
+int main(__attribute__((unused)) int argc, __attribute__((unused)) char* argv[])
+{
+    int serverPort;
+    int batchSize = DEFAULT_BATCH_SIZE;
+    int64_t reportIntervalUs = 1000000;
+    int threadCount = 1;
+    int cpuSteering = 0;
+    int gro = 0;
+    int timestamps = 0;
+    static struct option longOptions[] = {
+        {"timestamps", no_argument, NULL, 'T'},
+        {"batch", required_argument, NULL, 'b'},
+        {"interval", required_argument, NULL, 'i'},
+        {"threads", required_argument, NULL, 't'},
+        {"cpu-steering", no_argument, NULL, 'c'},
+        {"gro", no_argument, NULL, 'g'},
+        {NULL, 0, NULL, 0},
+    };
+    int option;
+    while ((option = getopt_long(argc, argv, "b:i:t:cgT", longOptions, NULL)) != -1)
+    {
+        switch (option)
         {
-            // idk if these are correct or even exhaustive, but these were in the example of tcp man page
-            if (errno == EINTR || errno == ENETDOWN || errno == EPROTO || errno == ENOPROTOOPT || errno == EHOSTDOWN || errno == EHOSTUNREACH || errno == ENETUNREACH || errno == EOPNOTSUPP || errno == ENOENT)
-                continue;
-            else
+        case 'T':
+            timestamps = 1;
+            break;
+        case 'g':
+            gro = 1;
+            break;
+        case 'b':
+            batchSize = atoi(optarg);
+            if (batchSize < 1 || batchSize > MAX_BATCH_SIZE)
             {
-                perror("Failed to receive message from client");
-                return 1;
+                fprintf(stderr, "Batch size must be between 1 and %d\n", MAX_BATCH_SIZE);
+                exit(1);
             }
+            break;
+        case 'i':
+            reportIntervalUs = (int64_t)(atof(optarg) * 1000000);
+            if (reportIntervalUs <= 0)
+            {
+                fprintf(stderr, "Interval must be a positive number of seconds\n");
+                exit(1);
+            }
+            break;
+        case 't':
+            threadCount = atoi(optarg);
+            if (threadCount < 1 || threadCount > MAX_THREADS)
+            {
+                fprintf(stderr, "Thread count must be between 1 and %d\n", MAX_THREADS);
+                exit(1);
+            }
+            break;
+        case 'c':
+            cpuSteering = 1;
+            break;
+        default:
+            exit(1);
+        }
+    }
+
+    // Read the server port from the command line arguments.
+    if (argc - optind != 1)
+    {
+        fprintf(stderr, "usage: %s [--batch <datagrams per receive call>] [--interval <seconds between reports>] [--threads <count> [--cpu-steering]] [--gro] [--timestamps] <server port>\n", argv[0]);
+        exit(1);
+    }
+    serverPort = atoi(argv[optind]);
+
+    // With more than one thread every worker gets its own SO_REUSEPORT socket and its own core.
+    // A single worker is left unpinned to behave like the plain single socket server.
+    struct Worker* workers = calloc(threadCount, sizeof(struct Worker));
+    if (workers == NULL)
+    {
+        perror("Failed to allocate workers");
+        exit(1);
+    }
+    long cpuCount = sysconf(_SC_NPROCESSORS_ONLN);
+    for (int i = 0; i < threadCount; i++)
+    {
+        workers[i].socketfd = createServerSocket(serverPort, threadCount > 1, gro, timestamps);
+        workers[i].gro = gro;
+        workers[i].timestamps = timestamps;
+        workers[i].cpu = threadCount > 1 ? i % cpuCount : -1;
+        workers[i].batchSize = batchSize;
+    }
+    if (cpuSteering && threadCount > 1)
+        attachCpuSteering(workers[0].socketfd, threadCount);
+
+    fprintf(stderr, "Started listening for UDP messages on port %d with %d thread(s), receiving up to %d per call\n", serverPort, threadCount, batchSize);
+
+    for (int i = 0; i < threadCount; i++)
+    {
+        int result = pthread_create(&workers[i].thread, NULL, serveBatched, &workers[i]);
+        if (result != 0)
+        {
+            fprintf(stderr, "Failed to create worker thread: %s\n", strerror(result));
+            exit(1);
         }
+    }
 
-        fprintf(stderr, "Received %d bytes from client\n", messageLength);
+    // The main thread only prints the per thread and total rates. Nothing is printed while the server is idle.
+    struct WorkerStats* previous = calloc(threadCount, sizeof(struct WorkerStats));
+    struct WorkerStats* current = calloc(threadCount, sizeof(struct WorkerStats));
+    if (previous == NULL || current == NULL)
+    {
+        perror("Failed to allocate statistics");
+        exit(1);
+    }
+    int64_t lastReport = getMonotonicTimeUs();
+    while (1)
+    {
+        struct timespec sleepTime = {reportIntervalUs / 1000000, (reportIntervalUs % 1000000) * 1000};
+        while (nanosleep(&sleepTime, &sleepTime) < 0 && errno == EINTR)
+            ;
+        int64_t now = getMonotonicTimeUs();
 
-        // Send the message back to the client twice
-        if (sendto(listenSocketfd, message, messageLength, 0, (struct sockaddr*)&clientAddress, clientAddressSize) < 0)
+        struct WorkerStats previousTotal, currentTotal;
+        memset(&previousTotal, 0, sizeof(previousTotal));
+        memset(&currentTotal, 0, sizeof(currentTotal));
+        for (int i = 0; i < threadCount; i++)
         {
-            perror("Failed to send message to client");
-            continue;
+            loadStats(&workers[i].stats, &current[i]);
+            previousTotal.packets += previous[i].packets;
+            previousTotal.bytes += previous[i].bytes;
+            previousTotal.replies += previous[i].replies;
+            previousTotal.sendFailures += previous[i].sendFailures;
+            previousTotal.receiveCalls += previous[i].receiveCalls;
+            previousTotal.truncated += previous[i].truncated;
+            previousTotal.coalesced += previous[i].coalesced;
+            previousTotal.timestamped += previous[i].timestamped;
+            previousTotal.queueNs += previous[i].queueNs;
+            previousTotal.sendTimestamped += previous[i].sendTimestamped;
+            previousTotal.sendNs += previous[i].sendNs;
+            currentTotal.packets += current[i].packets;
+            currentTotal.bytes += current[i].bytes;
+            currentTotal.replies += current[i].replies;
+            currentTotal.sendFailures += current[i].sendFailures;
+            currentTotal.receiveCalls += current[i].receiveCalls;
+            currentTotal.truncated += current[i].truncated;
+            currentTotal.coalesced += current[i].coalesced;
+            currentTotal.timestamped += current[i].timestamped;
+            currentTotal.queueNs += current[i].queueNs;
+            currentTotal.sendTimestamped += current[i].sendTimestamped;
+            currentTotal.sendNs += current[i].sendNs;
         }
-        if (sendto(listenSocketfd, message, messageLength, 0, (struct sockaddr*)&clientAddress, clientAddressSize) < 0)
+
+        if (currentTotal.packets != previousTotal.packets || currentTotal.sendFailures != previousTotal.sendFailures)
         {
-            perror("Failed to send message to client");
-            continue;
+            if (threadCount > 1)
+            {
+                for (int i = 0; i < threadCount; i++)
+                {
+                    char name[32];
+                    snprintf(name, sizeof(name), "Thread %d (cpu %d)", i, workers[i].cpu);
+                    reportStats(name, &previous[i], &current[i], now - lastReport);
+                }
+            }
+            reportStats("Total", &previousTotal, &currentTotal, now - lastReport);
         }
+
+        struct WorkerStats* swap = previous;
+        previous = current;
+        current = swap;
+        lastReport = now;
     }
 
     return 0;
-}
\ No newline at end of file
+}
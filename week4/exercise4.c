@@ -1,23 +1,74 @@
+#define _GNU_SOURCE
 #include <errno.h>
 #include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <sched.h>
+#include <linux/futex.h>
 #include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "../week3/lockstats.h"
+#include "../week3/trace.h"
+
 #define LOCKFILE "/tmp/np_lockfile_XXXXXX"
 #define FILE_MODE (S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)
 /* default permissions for new files */
+#define MAX_PROCESSES 26
+#define CACHE_LINE_SIZE 64
+#define LOCK_COUNT 3
+
+// Futex word of one process, woken by whoever hands the turn to it. Padded so that processes don't share the line.
+struct TurnSlot
+{
+    uint32_t wake;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+// Lets the turn passing processes start together. Every process counts itself in "ready" and then sleeps until the
+// parent sets "go", so the forks aren't timed.
+struct StartGate
+{
+    uint32_t ready;
+    uint32_t go;
+};
+
+// Turn passing state shared by all the processes. The process whose turn it is is turn % processes.
+struct TurnState
+{
+    uint32_t turn;
+    int processes;
+    struct StartGate gate;
+    struct TurnSlot slots[MAX_PROCESSES];
+};
+
+// Handoff timing shared by all the processes: when the previous operation finished and, for each operation, how long
+// it took from there until the next process started its operation.
+struct Timing
+{
+    int64_t lastDoneNs;
+    int64_t handoffNs[];
+};
 
 volatile int childStarted = 0;
+static int quiet = 0;
+static struct Timing *timing;
 
 static struct flock lock_it, unlock_it;
 static int lock_fd1 = -1, lock_fd2 = -1, lock_fd3 = -1;
+static struct lock_stats_block *lock_stats_block;
+static struct trace_ring *trace_ring;
+static struct lock_stats *lock_stats[LOCK_COUNT];
+static int64_t lock_acquired_at_ns[LOCK_COUNT];
 
 void sigusrHandler(__attribute__((unused)) int signo)
 {
@@ -44,6 +95,176 @@ void createSignalHandler()
     }
 }
 
+int64_t getMonotonicTimeNs()
+{
+    struct timespec now;
+    if (clock_gettime(CLOCK_MONOTONIC, &now) < 0)
+    {
+        perror("Failed to get monotonic time");
+        exit(1);
+    }
+    return now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// Maps the shared lock statistics when NP_LOCKSTATS is set in the environment. Without it the locks aren't timed at
+// all and lock_stats_find returns NULL.
+void lock_stats_open()
+{
+    if (lock_stats_block != NULL || getenv("NP_LOCKSTATS") == NULL)
+        return;
+
+    int fd = shm_open(LOCK_STATS_NAME, O_RDWR | O_CREAT, FILE_MODE);
+    if (fd < 0)
+    {
+        perror("shm_open failed for lock statistics");
+        exit(1);
+    }
+    // A new object is filled with zeros, so every process can size it without caring who was first
+    if (ftruncate(fd, sizeof(struct lock_stats_block)) < 0)
+    {
+        perror("Failed to size lock statistics");
+        exit(1);
+    }
+    lock_stats_block = mmap(NULL, sizeof(struct lock_stats_block), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (lock_stats_block == MAP_FAILED)
+    {
+        perror("mmap failed for lock statistics");
+        exit(1);
+    }
+    close(fd);
+
+    lock_stats_check_layout(lock_stats_block);
+}
+
+// Returns the statistics of the named lock, claiming a free entry if no process has used the name yet.
+struct lock_stats *lock_stats_find(const char *name)
+{
+    if (lock_stats_block == NULL)
+        return NULL;
+
+    for (int i = 0; i < LOCK_STATS_MAX_LOCKS; i++)
+    {
+        struct lock_stats *stats = &lock_stats_block->locks[i];
+        uint32_t state = 0;
+        if (__atomic_compare_exchange_n(&stats->state, &state, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE))
+        {
+            strncpy(stats->name, name, LOCK_STATS_NAME_LENGTH - 1);
+            __atomic_store_n(&stats->state, 2, __ATOMIC_RELEASE);
+            return stats;
+        }
+        while (state == 1)
+        {
+            sched_yield();
+            state = __atomic_load_n(&stats->state, __ATOMIC_ACQUIRE);
+        }
+        if (strncmp(stats->name, name, LOCK_STATS_NAME_LENGTH - 1) == 0)
+            return stats;
+    }
+    fprintf(stderr, "No room for the statistics of lock %s, it won't be profiled\n", name);
+    return NULL;
+}
+
+void lock_stats_record(uint64_t *buckets, uint64_t *total_ns, uint64_t *max_ns, uint64_t ns)
+{
+    int bucket = ns == 0 ? 0 : 63 - __builtin_clzll(ns);
+    __atomic_add_fetch(&buckets[bucket], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(total_ns, ns, __ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(max_ns, __ATOMIC_RELAXED);
+    while (ns > max && !__atomic_compare_exchange_n(max_ns, &max, ns, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+// Records an acquisition that started waiting at "wait_start_ns". Returns the time the lock was acquired, which is
+// handed back to lock_stats_released.
+int64_t lock_stats_acquired(struct lock_stats *stats, int64_t wait_start_ns)
+{
+    int64_t now = getMonotonicTimeNs();
+    __atomic_add_fetch(&stats->acquisitions, 1, __ATOMIC_RELAXED);
+    lock_stats_record(stats->wait_buckets, &stats->wait_total_ns, &stats->wait_max_ns, now - wait_start_ns);
+    return now;
+}
+
+void lock_stats_released(struct lock_stats *stats, int64_t acquired_at_ns)
+{
+    lock_stats_record(stats->hold_buckets, &stats->hold_total_ns, &stats->hold_max_ns, getMonotonicTimeNs() - acquired_at_ns);
+}
+
+// Creates this process' trace ring when NP_TRACE is set in the environment. NP_TRACE_RECORDS can set how many records
+// the ring holds. Has to be called again after a fork, the child gets a ring of its own.
+void trace_open()
+{
+    if ((trace_ring != NULL && trace_ring->pid == getpid()) || getenv("NP_TRACE") == NULL)
+        return;
+
+    uint64_t capacity = getenv("NP_TRACE_RECORDS") != NULL ? strtoull(getenv("NP_TRACE_RECORDS"), NULL, 10) : 0;
+    if (capacity == 0)
+        capacity = TRACE_DEFAULT_CAPACITY;
+    size_t size = sizeof(struct trace_ring) + capacity * sizeof(struct trace_record);
+
+    char name[32];
+    snprintf(name, sizeof(name), TRACE_NAME_FORMAT, getpid());
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_TRUNC, FILE_MODE);
+    if (fd < 0)
+    {
+        perror("shm_open failed for trace ring");
+        exit(1);
+    }
+    if (ftruncate(fd, size) < 0)
+    {
+        perror("Failed to size trace ring");
+        exit(1);
+    }
+    trace_ring = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (trace_ring == MAP_FAILED)
+    {
+        perror("mmap failed for trace ring");
+        exit(1);
+    }
+    close(fd);
+
+    trace_ring->pid = getpid();
+    trace_ring->capacity = capacity;
+    trace_ring->record_size = sizeof(struct trace_record);
+    __atomic_store_n(&trace_ring->magic, TRACE_MAGIC, __ATOMIC_RELEASE);
+}
+
+// Records an event if tracing is on. Returns 0 when it is off so the caller can print the event instead.
+int trace_event(uint16_t tag, int64_t value, uint16_t detail)
+{
+    if (trace_ring == NULL)
+        return 0;
+
+    uint64_t head = trace_ring->head;
+    struct trace_record *record = &trace_ring->records[head % trace_ring->capacity];
+    record->time_ns = getMonotonicTimeNs();
+    record->value = value;
+    record->pid = trace_ring->pid;
+    record->tag = tag;
+    record->detail = detail;
+    __atomic_store_n(&trace_ring->head, head + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+// Starts timing a wait for the lock with the given index if the locks are profiled.
+int64_t lock_wait_start(int lock)
+{
+    return lock_stats[lock] != NULL ? getMonotonicTimeNs() : 0;
+}
+
+void lock_wait_done(int lock, int64_t wait_start_ns)
+{
+    if (lock_stats[lock] != NULL)
+        lock_acquired_at_ns[lock] = lock_stats_acquired(lock_stats[lock], wait_start_ns);
+}
+
+// The scheme releases locks the process doesn't hold too, those aren't counted as holds.
+void lock_release_start(int lock)
+{
+    if (lock_stats[lock] != NULL && lock_acquired_at_ns[lock] != 0)
+        lock_stats_released(lock_stats[lock], lock_acquired_at_ns[lock]);
+    lock_acquired_at_ns[lock] = 0;
+}
+
 void my_lock_init()
 {
     char lock1_path[] = LOCKFILE;
@@ -71,11 +292,20 @@ void my_lock_init()
     unlock_it.l_whence = SEEK_SET;
     unlock_it.l_start = 0;
     unlock_it.l_len = 0;
+
+    lock_stats_open();
+    char name[LOCK_STATS_NAME_LENGTH];
+    for (int lock = 0; lock < LOCK_COUNT; lock++)
+    {
+        snprintf(name, sizeof(name), "exercise4 lock%d", lock + 1);
+        lock_stats[lock] = lock_stats_find(name);
+    }
 }
 
 void my_lock_wait1()
 {
     int rc;
+    int64_t wait_start_ns = lock_wait_start(0);
 
     while ((rc = fcntl(lock_fd1, F_SETLKW, &lock_it)) < 0)
     {
@@ -87,11 +317,13 @@ void my_lock_wait1()
             exit(1);
         }
     }
+    lock_wait_done(0, wait_start_ns);
 }
 
 void my_lock_wait2()
 {
     int rc;
+    int64_t wait_start_ns = lock_wait_start(1);
 
     while ((rc = fcntl(lock_fd2, F_SETLKW, &lock_it)) < 0)
     {
@@ -103,11 +335,13 @@ void my_lock_wait2()
             exit(1);
         }
     }
+    lock_wait_done(1, wait_start_ns);
 }
 
 void my_lock_wait3()
 {
     int rc;
+    int64_t wait_start_ns = lock_wait_start(2);
 
     while ((rc = fcntl(lock_fd3, F_SETLKW, &lock_it)) < 0)
     {
@@ -119,10 +353,12 @@ void my_lock_wait3()
             exit(1);
         }
     }
+    lock_wait_done(2, wait_start_ns);
 }
 
 void my_lock_release1()
 {
+    lock_release_start(0);
     if (fcntl(lock_fd1, F_SETLKW, &unlock_it) < 0)
     {
         perror("fcntl error for my_lock_release1");
@@ -132,6 +368,7 @@ void my_lock_release1()
 
 void my_lock_release2()
 {
+    lock_release_start(1);
     if (fcntl(lock_fd2, F_SETLKW, &unlock_it) < 0)
     {
         perror("fcntl error for my_lock_release2");
@@ -141,6 +378,7 @@ void my_lock_release2()
 
 void my_lock_release3()
 {
+    lock_release_start(2);
     if (fcntl(lock_fd3, F_SETLKW, &unlock_it) < 0)
     {
         perror("fcntl error for my_lock_release3");
@@ -148,59 +386,116 @@ void my_lock_release3()
     }
 }
 
-void processOperation(int *ptr, size_t mapSize, char character)
+int compareInt64(const void* a, const void* b)
 {
-    int newVal = (*ptr)++;
-    if (newVal + sizeof(int) >= mapSize)
-    {
-        fprintf(stderr, "Index to write character is out of mapped memory range. Needed to reset/delete file.\n");
-        exit(1);
-    }
-    ((char *)ptr)[newVal + sizeof(int)] = character;
-    printf("%c: %d\n", character, newVal);
+    int64_t first = *(const int64_t*)a;
+    int64_t second = *(const int64_t*)b;
+    return (first > second) - (first < second);
 }
 
-int main(int argc, char **argv)
+// Returns the given percentile of the sorted values.
+int64_t percentile(int64_t* sorted, size_t count, double percent)
 {
-    int fd, i, nloop;
-    int *ptr;
-    size_t mapSize;
+    size_t index = (size_t)(percent / 100 * count);
+    if (index >= count)
+        index = count - 1;
+    return sorted[index];
+}
 
-    if (argc != 3)
+// The turn words are in a mapping shared between processes, so the shared (non private) futex operations are needed.
+long futex(uint32_t *address, int operation, uint32_t value)
+{
+    return syscall(SYS_futex, address, operation, value, NULL, NULL, 0);
+}
+
+// Counts the calling process as ready and waits until the parent opens the gate.
+void startGateWait(struct StartGate *gate)
+{
+    __atomic_fetch_add(&gate->ready, 1, __ATOMIC_RELEASE);
+    if (futex(&gate->ready, FUTEX_WAKE, 1) < 0)
+        perror("futex wake failed");
+    while (__atomic_load_n(&gate->go, __ATOMIC_ACQUIRE) == 0)
     {
-        fprintf(stderr, "Usage: %s <pathname> <#loops>\n", argv[0]);
-        exit(1);
+        if (futex(&gate->go, FUTEX_WAIT, 0) < 0 && errno != EAGAIN && errno != EINTR)
+        {
+            perror("futex wait failed");
+            exit(1);
+        }
     }
-    nloop = atoi(argv[2]);
-    mapSize = sizeof(int) + nloop * 2;
-
-    // Disable buffering for stdout to ensure that the output is printed immediately.
-    setbuf(stdout, NULL);
+}
 
-    // Open the provided file and resize it to the required size.
-    if ((fd = open(argv[1], O_RDWR | O_CREAT, FILE_MODE)) < 0)
+// Waits until "processes" processes are ready and lets them all go at once. Returns the time they were let go at.
+int64_t startGateOpen(struct StartGate *gate, int processes)
+{
+    uint32_t ready;
+    while ((ready = __atomic_load_n(&gate->ready, __ATOMIC_ACQUIRE)) < (uint32_t)processes)
     {
-        perror("open failed");
-        exit(1);
+        if (futex(&gate->ready, FUTEX_WAIT, ready) < 0 && errno != EAGAIN && errno != EINTR)
+        {
+            perror("futex wait failed");
+            exit(1);
+        }
     }
-    if (ftruncate(fd, 0) < 0 || ftruncate(fd, mapSize) < 0)
+    int64_t now = getMonotonicTimeNs();
+    __atomic_store_n(&gate->go, 1, __ATOMIC_RELEASE);
+    if (futex(&gate->go, FUTEX_WAKE, INT_MAX) < 0)
+        perror("futex wake failed");
+    return now;
+}
+
+// Blocks until the shared turn counter reaches the given turn. The wake word is read before checking the turn, so a
+// handoff that happens in between changes the word and makes FUTEX_WAIT return immediately instead of sleeping.
+void waitTurn(struct TurnState *state, int process, uint32_t turn)
+{
+    struct TurnSlot *slot = &state->slots[process];
+    while (1)
     {
-        perror("Failed to reset file");
-        exit(1);
+        uint32_t wake = __atomic_load_n(&slot->wake, __ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&state->turn, __ATOMIC_ACQUIRE) == turn)
+            return;
+        if (futex(&slot->wake, FUTEX_WAIT, wake) < 0 && errno != EAGAIN && errno != EINTR)
+        {
+            perror("futex wait failed");
+            exit(1);
+        }
     }
+}
 
-    // Map the file to memory.
-    ptr = mmap(NULL, mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-    if (ptr == MAP_FAILED)
+// Gives the turn to the next process in round-robin order and wakes only that process.
+void passTurn(struct TurnState *state)
+{
+    uint32_t turn = __atomic_add_fetch(&state->turn, 1, __ATOMIC_RELEASE);
+    struct TurnSlot *slot = &state->slots[turn % state->processes];
+    __atomic_add_fetch(&slot->wake, 1, __ATOMIC_RELEASE);
+    if (futex(&slot->wake, FUTEX_WAKE, 1) < 0)
     {
-        perror("Mmap failed");
+        perror("futex wake failed");
         exit(1);
     }
-    if (close(fd) < 0)
+}
+
+void processOperation(int *ptr, size_t mapSize, char character)
+{
+    int64_t startNs = getMonotonicTimeNs();
+    int newVal = (*ptr)++;
+    if (newVal + sizeof(int) >= mapSize)
     {
-        perror("Close failed");
+        fprintf(stderr, "Index to write character is out of mapped memory range. Needed to reset/delete file.\n");
         exit(1);
     }
+    ((char *)ptr)[newVal + sizeof(int)] = character;
+    if (!quiet && !trace_event(TRACE_OPERATION, newVal, character))
+        printf("%c: %d\n", character, newVal);
+
+    // The first operation has nobody to take the turn from
+    timing->handoffNs[newVal] = newVal > 0 ? startNs - timing->lastDoneNs : -1;
+    timing->lastDoneNs = getMonotonicTimeNs();
+}
+
+// Runs nloop rounds of strict A/B alternation with the three lock scheme. Returns the time it took in nanoseconds.
+int64_t runLocks(int *ptr, size_t mapSize, int nloop)
+{
+    int i;
 
     // Create 3 locks for the parent and child to use.
     my_lock_init();
@@ -221,10 +516,16 @@ int main(int argc, char **argv)
     }
     if (pid == 0) // Child
     {
-        // Signal the parent that the child has started meaning that the child has acquired the inherited locks.
+        // fcntl locks aren't inherited, so the child holds none of the parent's locks
+        memset(lock_acquired_at_ns, 0, sizeof(lock_acquired_at_ns));
+        trace_open();
+
+        // Signal the parent that the child is running. It holds none of the parent's locks, fcntl locks belong to the
+        // process that took them.
         kill(getppid(), SIGUSR1);
 
-        // Release the initial lock to allow the parent to start.
+        // Meant to let the parent start, but as the child never took lock 2 this releases nothing. The scheme relies on
+        // the child holding it, so the processes don't always alternate; --bench checks the result.
         my_lock_release2();
 
         for (i = 0; i < nloop; i++)
@@ -241,18 +542,22 @@ int main(int argc, char **argv)
 
         my_lock_release3();
 
-        exit(0);
+        _exit(0);
     }
     // Parent
 
-    // Wait for the child to start to ensure that the child has acquired the inherited locks.
+    // Wait for the child to start, so that the timing doesn't include the fork.
     // If waiting would not be done, the parent would happily aquire all the three locks and would do multiple operations before the child would even start.
     while (!childStarted)
     {
         pause();
     }
 
+    // With NP_TRACE set the operations go to the trace rings of the processes instead of being printed
+    trace_open();
+
     // Release the initial lock to allow the child to start.
+    int64_t startNs = getMonotonicTimeNs();
     my_lock_release1();
 
     for (i = 0; i < nloop; i++)
@@ -276,5 +581,231 @@ int main(int argc, char **argv)
         exit(1);
     }
 
+    return getMonotonicTimeNs() - startNs;
+}
+
+// Runs nloop rounds in which each of the processes takes its turn in round-robin order, handing the turn over with a
+// futex instead of locks. Returns the time it took in nanoseconds.
+int64_t runFutex(int *ptr, size_t mapSize, int nloop, int processes)
+{
+    struct TurnState *state = mmap(NULL, sizeof(struct TurnState), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (state == MAP_FAILED)
+    {
+        perror("Mmap failed");
+        exit(1);
+    }
+    state->processes = processes;
+
+    // The turn counter starts at the first process' turn and the others sleep until it is handed to them. The start
+    // gate only keeps the forks out of the timing.
+    fflush(stdout);
+    for (int process = 0; process < processes; process++)
+    {
+        pid_t pid;
+        if ((pid = fork()) < 0)
+        {
+            perror("Fork failed");
+            exit(1);
+        }
+        if (pid == 0)
+        {
+            trace_open();
+            startGateWait(&state->gate);
+            for (int i = 0; i < nloop; i++)
+            {
+                waitTurn(state, process, i * processes + process);
+                processOperation(ptr, mapSize, 'A' + process);
+                passTurn(state);
+            }
+            _exit(0);
+        }
+    }
+
+    int64_t startNs = startGateOpen(&state->gate, processes);
+    int status;
+    for (int process = 0; process < processes; process++)
+    {
+        if (wait(&status) < 0)
+        {
+            perror("Wait failed");
+            exit(1);
+        }
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        {
+            fprintf(stderr, "Turn passing process failed\n");
+            exit(1);
+        }
+    }
+    int64_t elapsedNs = getMonotonicTimeNs() - startNs;
+
+    if (munmap(state, sizeof(struct TurnState)) < 0)
+    {
+        perror("Munmap failed");
+        exit(1);
+    }
+    return elapsedNs;
+}
+
+// Returns how many of the "turns" characters written to the file are not the ones strict round-robin order between
+// "processes" processes would have written, starting from whichever process went first.
+int countOutOfTurn(int *ptr, int processes, int turns)
+{
+    char *characters = (char *)ptr + sizeof(int);
+    int first = turns > 0 ? characters[0] - 'A' : 0;
+    int outOfTurn = 0;
+    for (int i = 0; i < turns; i++)
+    {
+        if (characters[i] != 'A' + (first + i) % processes)
+            outOfTurn++;
+    }
+    return outOfTurn;
+}
+
+// Prints the turn rate and the handoff latency percentiles of the operations that were just run, and warns if the
+// characters in the file show that the processes didn't take strict turns.
+void reportHandoffs(int *ptr, const char *name, int processes, int turns, int64_t elapsedNs)
+{
+    int64_t *sorted = malloc(turns * sizeof(int64_t));
+    if (sorted == NULL)
+    {
+        perror("Malloc failed");
+        exit(1);
+    }
+    size_t count = 0;
+    for (int i = 0; i < turns; i++)
+    {
+        if (timing->handoffNs[i] >= 0)
+            sorted[count++] = timing->handoffNs[i];
+    }
+    qsort(sorted, count, sizeof(int64_t), compareInt64);
+
+    printf("%-8s %2d processes: %d turns in %.3fs, %.0f turns/s", name, processes, turns, elapsedNs / 1e9, turns / (elapsedNs / 1e9));
+    if (count > 0)
+    {
+        printf(", handoff p50 %ldns p90 %ldns p99 %ldns max %ldns", percentile(sorted, count, 50), percentile(sorted, count, 90), percentile(sorted, count, 99), sorted[count - 1]);
+    }
+    printf("\n");
+    free(sorted);
+
+    int outOfTurn = countOutOfTurn(ptr, processes, turns);
+    if (outOfTurn > 0)
+        fprintf(stderr, "Warning: %s with %d processes did not alternate, %d of %d operations were out of turn, so its numbers are not comparable\n", name, processes, outOfTurn, turns);
+}
+
+int main(int argc, char **argv)
+{
+    int fd, nloop;
+    int *ptr;
+    size_t mapSize;
+    int useFutex = 0;
+    int processes = 2;
+    int bench = 0;
+
+    static struct option longOptions[] = {
+        {"futex", no_argument, NULL, 'f'},
+        {"processes", required_argument, NULL, 'n'},
+        {"bench", no_argument, NULL, 'b'},
+        {NULL, 0, NULL, 0},
+    };
+    int option;
+    while ((option = getopt_long(argc, argv, "fn:b", longOptions, NULL)) != -1)
+    {
+        switch (option)
+        {
+        case 'f':
+            useFutex = 1;
+            break;
+        case 'n':
+            processes = atoi(optarg);
+            if (processes < 2 || processes > MAX_PROCESSES)
+            {
+                fprintf(stderr, "Process count must be between 2 and %d\n", MAX_PROCESSES);
+                exit(1);
+            }
+            useFutex = 1;
+            break;
+        case 'b':
+            bench = 1;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [--futex [--processes <count>]] [--bench] <pathname> <#loops>\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (argc - optind != 2)
+    {
+        fprintf(stderr, "Usage: %s [--futex [--processes <count>]] [--bench] <pathname> <#loops>\n", argv[0]);
+        exit(1);
+    }
+    nloop = atoi(argv[optind + 1]);
+    if (nloop < 1 || (long)nloop * processes > INT_MAX / 2)
+    {
+        fprintf(stderr, "Invalid number of loops\n");
+        exit(1);
+    }
+    mapSize = sizeof(int) + nloop * processes;
+
+    // Disable buffering for stdout to ensure that the output is printed immediately.
+    setbuf(stdout, NULL);
+
+    // Open the provided file and resize it to the required size.
+    if ((fd = open(argv[optind], O_RDWR | O_CREAT, FILE_MODE)) < 0)
+    {
+        perror("open failed");
+        exit(1);
+    }
+    if (ftruncate(fd, 0) < 0 || ftruncate(fd, mapSize) < 0)
+    {
+        perror("Failed to reset file");
+        exit(1);
+    }
+
+    // Map the file to memory.
+    ptr = mmap(NULL, mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (ptr == MAP_FAILED)
+    {
+        perror("Mmap failed");
+        exit(1);
+    }
+    if (close(fd) < 0)
+    {
+        perror("Close failed");
+        exit(1);
+    }
+
+    // The timing is kept out of the file so that the file only has the counter and the characters.
+    timing = mmap(NULL, sizeof(struct Timing) + nloop * processes * sizeof(int64_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (timing == MAP_FAILED)
+    {
+        perror("Mmap failed");
+        exit(1);
+    }
+
+    if (!bench)
+    {
+        if (useFutex)
+            runFutex(ptr, mapSize, nloop, processes);
+        else
+            runLocks(ptr, mapSize, nloop);
+        exit(0);
+    }
+
+    // The benchmark runs the three lock scheme, which only works for two processes, against futex turn passing with
+    // two processes and with the requested count.
+    quiet = 1;
+    int64_t elapsedNs = runLocks(ptr, mapSize, nloop);
+    reportHandoffs(ptr, "3 locks", 2, *ptr, elapsedNs);
+
+    *ptr = 0;
+    elapsedNs = runFutex(ptr, mapSize, nloop, 2);
+    reportHandoffs(ptr, "futex", 2, *ptr, elapsedNs);
+
+    if (processes > 2)
+    {
+        *ptr = 0;
+        elapsedNs = runFutex(ptr, mapSize, nloop, processes);
+        reportHandoffs(ptr, "futex", processes, *ptr, elapsedNs);
+    }
+
     exit(0);
 }
\ No newline at end of file
@@ -1,6 +1,7 @@
 #include <arpa/inet.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <getopt.h>
 #include <netinet/ip.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -10,21 +11,95 @@
 #include <sys/wait.h>
 #include <unistd.h>
 
-int main(__attribute__((unused)) int argc, __attribute__((unused)) char* argv[])
+// Largest UDP payload that fits in an IPv4 datagram.
+#define MAX_DATAGRAM_SIZE 65507
+// IPv4 header without options plus the UDP header.
+#define HEADER_OVERHEAD 28
+// How many times the search is repeated if ICMP "fragmentation needed" replies lower the path MTU afterwards.
+#define MAX_ROUNDS 4
+
+// Sends one datagram of the given length. Returns 1 if it was accepted, 0 if it was too big and exits on other errors.
+int probe(int socketfd, char* message, size_t length, int* probes)
+{
+    (*probes)++;
+    while (send(socketfd, message, length, 0) < 0)
+    {
+        if (errno == EMSGSIZE)
+            return 0;
+        // A previous probe may have caused an ICMP error that gets reported on this send instead
+        if (errno == EINTR || errno == ECONNREFUSED || errno == EHOSTUNREACH)
+            continue;
+        perror("Failed to send probe");
+        exit(1);
+    }
+    return 1;
+}
+
+// Binary searches the largest payload the socket accepts between low (known to fit) and high (inclusive).
+size_t findMaxPayload(int socketfd, char* message, size_t low, size_t high, int* probes)
+{
+    while (low < high)
+    {
+        size_t middle = low + (high - low + 1) / 2;
+        if (probe(socketfd, message, middle, probes))
+            low = middle;
+        else
+            high = middle - 1;
+    }
+    return low;
+}
+
+int getPathMtu(int socketfd)
+{
+    int mtu;
+    socklen_t length = sizeof(mtu);
+    if (getsockopt(socketfd, IPPROTO_IP, IP_MTU, &mtu, &length) < 0)
+    {
+        perror("Failed to get IP_MTU");
+        exit(1);
+    }
+    return mtu;
+}
+
+int main(int argc, char* argv[])
 {
     int serverPort;
     char* serverAddressString;
     int socketfd;
     struct sockaddr_in serverAddress;
+    int waitMs = 100;
+    int dontFragment = 1;
+
+    static struct option longOptions[] = {
+        {"wait", required_argument, NULL, 'w'},
+        {"fragment", no_argument, NULL, 'f'},
+        {NULL, 0, NULL, 0},
+    };
+    int option;
+    while ((option = getopt_long(argc, argv, "w:f", longOptions, NULL)) != -1)
+    {
+        switch (option)
+        {
+        case 'w':
+            waitMs = atoi(optarg);
+            break;
+        case 'f':
+            dontFragment = 0;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [--wait <ms>] [--fragment] <server ip address> <server port>\n", argv[0]);
+            return 1;
+        }
+    }
 
     // Read the server address and port from the command line arguments.
-    if (argc != 3)
+    if (argc - optind != 2)
     {
-        fprintf(stderr, "Usage: %s <server ip address> <server port>\n", argv[0]);
+        fprintf(stderr, "Usage: %s [--wait <ms>] [--fragment] <server ip address> <server port>\n", argv[0]);
         return 1;
     }
-    serverAddressString = argv[1];
-    serverPort = atoi(argv[2]);
+    serverAddressString = argv[optind];
+    serverPort = atoi(argv[optind + 1]);
 
     // Create a datagram socket for the connection
     if ((socketfd = socket(PF_INET, SOCK_DGRAM, 0)) < 0)
@@ -33,9 +108,15 @@ int main(__attribute__((unused)) int argc, __attribute__((unused)) char* argv[])
         return 1; // Exit with error if socket creation fails
     }
 
-    // Enabling the don't fragment bit causes the max length to be 1472
-    // int val = IP_PMTUDISC_DO;
-    // setsockopt(socketfd, IPPROTO_IP, IP_MTU_DISCOVER, &val, sizeof(val));
+    // With the don't fragment bit set the kernel refuses datagrams bigger than the path MTU it knows of with EMSGSIZE,
+    // and ICMP "fragmentation needed" replies from routers on the way lower that MTU. Without it the only limit is the
+    // maximum size of an IP datagram.
+    int val = dontFragment ? IP_PMTUDISC_DO : IP_PMTUDISC_DONT;
+    if (setsockopt(socketfd, IPPROTO_IP, IP_MTU_DISCOVER, &val, sizeof(val)) < 0)
+    {
+        perror("Failed to set IP_MTU_DISCOVER");
+        return 1;
+    }
 
     // Initialize serverAddress struct with server IP address and port
     memset(&serverAddress, 0, sizeof(serverAddress));
@@ -47,32 +128,54 @@ int main(__attribute__((unused)) int argc, __attribute__((unused)) char* argv[])
     }
     serverAddress.sin_port = htons(serverPort);
 
-    socklen_t serverAddressLength = sizeof(serverAddress);
+    // Connecting the socket is needed for IP_MTU and makes the kernel report ICMP errors for the path on it
+    if (connect(socketfd, (struct sockaddr*)&serverAddress, sizeof(serverAddress)) < 0)
+    {
+        perror("Failed to connect socket");
+        return 1;
+    }
 
-    size_t messageLength = 0;
-    while (1)
+    // Every probe is sent from the same buffer, only the length changes
+    static char message[MAX_DATAGRAM_SIZE];
+
+    int probes = 0;
+    size_t maxPayload = 0;
+    size_t high = MAX_DATAGRAM_SIZE;
+    if (dontFragment)
     {
-        void* message = malloc(messageLength);
-        if (message == NULL)
-        {
-            perror("Failed to allocate memory for message");
-            return 1;
-        }
-        fprintf(stderr, "Sending message of length %zu\n", messageLength);
+        // Start from what the kernel already knows about the path, it is the upper bound for the search
+        int mtu = getPathMtu(socketfd);
+        if (mtu - HEADER_OVERHEAD < (int)high)
+            high = mtu > HEADER_OVERHEAD ? mtu - HEADER_OVERHEAD : 0;
+    }
+    for (int round = 0; round < MAX_ROUNDS; round++)
+    {
+        maxPayload = findMaxPayload(socketfd, message, 0, high, &probes);
+        fprintf(stderr, "Round %d: largest accepted payload %zu bytes after %d probes\n", round + 1, maxPayload, probes);
+        if (!dontFragment || waitMs <= 0)
+            break;
 
-        if (sendto(socketfd, message, messageLength, 0, (struct sockaddr*)&serverAddress, serverAddressLength) < 0)
+        // Give routers on the way time to answer the biggest probe with an ICMP error, then see if the MTU dropped
+        usleep(waitMs * 1000);
+        if (!probe(socketfd, message, maxPayload, &probes))
         {
-            perror("Failed to send data to processing server");
-            exit(1);
+            // Nothing smaller than an empty payload is left to search
+            if (maxPayload == 0)
+                break;
+            high = maxPayload - 1;
+            continue;
         }
-
-        free(message);
-
-        // usleep(2000);
-
-        messageLength++;
+        int mtu = getPathMtu(socketfd);
+        if (mtu - HEADER_OVERHEAD >= (int)maxPayload)
+            break;
+        high = mtu > HEADER_OVERHEAD ? mtu - HEADER_OVERHEAD : 0;
     }
 
+    printf("Max payload: %zu\n", maxPayload);
+    if (dontFragment)
+        printf("Path MTU: %d\n", getPathMtu(socketfd));
+    printf("Probes: %d\n", probes);
+
     // Close the socket
     if (close(socketfd) < 0)
     {
@@ -81,4 +184,4 @@ int main(__attribute__((unused)) int argc, __attribute__((unused)) char* argv[])
     }
 
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,538 @@
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <getopt.h>
+#include <linux/net_tstamp.h>
+#include <netinet/ip.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+// Largest UDP payload that fits in an IPv4 datagram.
+#define MAX_DATAGRAM_SIZE 65507
+// IPv4 header without options plus the UDP header, counted into the bit rate.
+#define HEADER_OVERHEAD 28
+// sendmmsg can take more, but more than this per call does not make sending any cheaper.
+#define MAX_BATCH_SIZE 512
+// The timer is not armed any faster than this, so at high rates several packets are sent per tick.
+#define MIN_TICK_NS 50000
+
+// Written to the start of every datagram big enough for it, so a receiver can detect loss and measure delay.
+struct GeneratorHeader
+{
+    uint64_t sequence;
+    int64_t sentAtNs;
+};
+
+enum SizeDistribution
+{
+    SIZE_FIXED,
+    SIZE_UNIFORM,
+    SIZE_IMIX,
+};
+
+struct SizeSpec
+{
+    enum SizeDistribution distribution;
+    int min;
+    int max;
+};
+
+// Simple IMIX: 7 parts of 64 byte, 4 parts of 576 byte and 1 part of 1500 byte IP packets.
+int imixSizes[] = {64 - HEADER_OVERHEAD, 576 - HEADER_OVERHEAD, 1500 - HEADER_OVERHEAD};
+int imixWeights[] = {7, 4, 1};
+
+// "packets" and "bytes" only count what the kernel accepted, failed sends are counted separately, so the rates
+// computed from them are what actually left.
+struct GeneratorStats
+{
+    uint64_t scheduled;
+    uint64_t packets;
+    uint64_t bytes;
+    uint64_t sendCalls;
+    uint64_t sendFailures;
+    // How late each batch left compared to when its last packet was due
+    int64_t* lateness;
+    size_t latenessCount;
+    size_t latenessCapacity;
+    // Gaps between the starts of consecutive batches and how much each gap differed from the previous one. Only the
+    // batches are timed: without --txtime the packets of a batch leave back to back.
+    double gapSum;
+    double gapDifferenceSum;
+    uint64_t gapCount;
+};
+
+// Returns the current time of the monotonic clock in nanoseconds.
+int64_t getMonotonicTimeNs()
+{
+    struct timespec now;
+    if (clock_gettime(CLOCK_MONOTONIC, &now) < 0)
+    {
+        perror("Failed to get monotonic time");
+        exit(1);
+    }
+    return now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// Parses a rate with an optional k, M or G (decimal) suffix, eg. "100M" or "25000".
+// Returns -1 if the string is not a valid rate.
+double parseRate(char* string)
+{
+    char* endPtr;
+    errno = 0;
+    double parsed = strtod(string, &endPtr);
+    if (errno != 0 || endPtr == string || parsed <= 0)
+        return -1;
+
+    switch (*endPtr)
+    {
+    case 'k':
+    case 'K':
+        parsed *= 1e3;
+        endPtr++;
+        break;
+    case 'm':
+    case 'M':
+        parsed *= 1e6;
+        endPtr++;
+        break;
+    case 'g':
+    case 'G':
+        parsed *= 1e9;
+        endPtr++;
+        break;
+    }
+    if (*endPtr != '\0')
+        return -1;
+
+    return parsed;
+}
+
+// Parses "<size>", "<min>-<max>" or "imix". Returns -1 if the string is not valid.
+int parseSizeSpec(char* string, struct SizeSpec* spec)
+{
+    if (strcmp(string, "imix") == 0)
+    {
+        spec->distribution = SIZE_IMIX;
+        spec->min = imixSizes[0];
+        spec->max = imixSizes[2];
+        return 0;
+    }
+    char* endPtr;
+    long min = strtol(string, &endPtr, 10);
+    long max = min;
+    if (*endPtr == '-')
+        max = strtol(endPtr + 1, &endPtr, 10);
+    if (endPtr == string || *endPtr != '\0' || min < 0 || max < min || max > MAX_DATAGRAM_SIZE)
+        return -1;
+    spec->distribution = min == max ? SIZE_FIXED : SIZE_UNIFORM;
+    spec->min = min;
+    spec->max = max;
+    return 0;
+}
+
+int nextSize(struct SizeSpec* spec)
+{
+    switch (spec->distribution)
+    {
+    case SIZE_UNIFORM:
+        return spec->min + (int)(drand48() * (spec->max - spec->min + 1));
+    case SIZE_IMIX:
+    {
+        int pick = (int)(drand48() * 12);
+        for (int i = 0; i < 3; i++)
+        {
+            if (pick < imixWeights[i])
+                return imixSizes[i];
+            pick -= imixWeights[i];
+        }
+        return imixSizes[2];
+    }
+    default:
+        return spec->min;
+    }
+}
+
+double meanSize(struct SizeSpec* spec)
+{
+    switch (spec->distribution)
+    {
+    case SIZE_UNIFORM:
+        return (spec->min + spec->max) / 2.0;
+    case SIZE_IMIX:
+        return (7.0 * imixSizes[0] + 4.0 * imixSizes[1] + imixSizes[2]) / 12;
+    default:
+        return spec->min;
+    }
+}
+
+int compareInt64(const void* a, const void* b)
+{
+    int64_t first = *(const int64_t*)a;
+    int64_t second = *(const int64_t*)b;
+    return (first > second) - (first < second);
+}
+
+// Returns the given percentile of the sorted values.
+int64_t percentile(int64_t* sorted, size_t count, double percent)
+{
+    size_t index = (size_t)(percent / 100 * count);
+    if (index >= count)
+        index = count - 1;
+    return sorted[index];
+}
+
+void recordLateness(struct GeneratorStats* stats, int64_t lateness)
+{
+    if (stats->latenessCount == stats->latenessCapacity)
+    {
+        stats->latenessCapacity = stats->latenessCapacity ? stats->latenessCapacity * 2 : 4096;
+        if ((stats->lateness = realloc(stats->lateness, stats->latenessCapacity * sizeof(int64_t))) == NULL)
+        {
+            perror("Failed to allocate lateness buffer");
+            exit(1);
+        }
+    }
+    stats->lateness[stats->latenessCount++] = lateness;
+}
+
+// Sends paced datagrams to the connected socket for "durationNs". The pace is kept as a budget that grows with the
+// elapsed time: "rate" units per second, where a packet costs one unit in packets/sec mode and its size on the wire in
+// bytes in bits/sec mode. A timerfd wakes the loop every tick and everything due by then is sent with sendmmsg, at most
+// "burst" packets per call. With "txTime" every packet carries the exact time it is due as SCM_TXTIME, so a qdisc
+// supporting it (fq or etf) spreads the packets of a batch instead of sending them back to back.
+void generate(int socketfd, struct SizeSpec* sizes, double rate, int bitMode, int burst, int txTime, int64_t durationNs, int64_t intervalNs, struct GeneratorStats* stats)
+{
+    double unitsPerPacket = bitMode ? meanSize(sizes) + HEADER_OVERHEAD : 1;
+    int64_t tickNs = (int64_t)(1e9 * unitsPerPacket * burst / rate);
+    if (tickNs < MIN_TICK_NS)
+        tickNs = MIN_TICK_NS;
+
+    int timerfd = timerfd_create(CLOCK_MONOTONIC, 0);
+    if (timerfd < 0)
+    {
+        perror("Failed to create timerfd");
+        exit(1);
+    }
+    struct itimerspec timerSpec = {{tickNs / 1000000000, tickNs % 1000000000}, {tickNs / 1000000000, tickNs % 1000000000}};
+    if (timerfd_settime(timerfd, 0, &timerSpec, NULL) < 0)
+    {
+        perror("Failed to arm timerfd");
+        exit(1);
+    }
+
+    static struct mmsghdr messages[MAX_BATCH_SIZE];
+    static struct iovec vectors[MAX_BATCH_SIZE];
+    static union
+    {
+        char buffer[CMSG_SPACE(sizeof(uint64_t))];
+        struct cmsghdr align;
+    } controls[MAX_BATCH_SIZE];
+    size_t bufferStride = sizes->max > (int)sizeof(struct GeneratorHeader) ? (size_t)sizes->max : sizeof(struct GeneratorHeader);
+    char* buffers = calloc(burst, bufferStride);
+    if (buffers == NULL)
+    {
+        perror("Failed to allocate send buffers");
+        exit(1);
+    }
+
+    int64_t start = getMonotonicTimeNs();
+    int64_t lastReport = start;
+    int64_t lastBatchStart = 0;
+    int64_t lastGap = -1;
+    uint64_t packetsAtLastReport = 0;
+    uint64_t bytesAtLastReport = 0;
+    // Units spent so far and the size of the next packet, drawn in advance so its cost is known
+    double spent = 0;
+    int pendingSize = nextSize(sizes);
+
+    while (1)
+    {
+        uint64_t expirations;
+        if (read(timerfd, &expirations, sizeof(expirations)) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("Failed to read timerfd");
+            exit(1);
+        }
+
+        int64_t now = getMonotonicTimeNs();
+        if (now - start >= durationNs)
+            break;
+        double budget = (now - start) * rate / 1e9;
+
+        // Send everything due by now, in batches of at most "burst" packets
+        while (spent + (bitMode ? pendingSize + HEADER_OVERHEAD : 1) <= budget)
+        {
+            int count = 0;
+            int64_t dueAt = 0;
+            while (count < burst && spent + (bitMode ? pendingSize + HEADER_OVERHEAD : 1) <= budget)
+            {
+                spent += bitMode ? pendingSize + HEADER_OVERHEAD : 1;
+                dueAt = start + (int64_t)(spent * 1e9 / rate);
+
+                char* buffer = buffers + count * bufferStride;
+                if (pendingSize >= (int)sizeof(struct GeneratorHeader))
+                {
+                    struct GeneratorHeader header = {stats->scheduled + count, dueAt};
+                    memcpy(buffer, &header, sizeof(header));
+                }
+                vectors[count].iov_base = buffer;
+                vectors[count].iov_len = pendingSize;
+                memset(&messages[count].msg_hdr, 0, sizeof(messages[count].msg_hdr));
+                messages[count].msg_hdr.msg_iov = &vectors[count];
+                messages[count].msg_hdr.msg_iovlen = 1;
+                if (txTime)
+                {
+                    messages[count].msg_hdr.msg_control = &controls[count];
+                    messages[count].msg_hdr.msg_controllen = sizeof(controls[count]);
+                    struct cmsghdr* control = CMSG_FIRSTHDR(&messages[count].msg_hdr);
+                    control->cmsg_level = SOL_SOCKET;
+                    control->cmsg_type = SCM_TXTIME;
+                    control->cmsg_len = CMSG_LEN(sizeof(uint64_t));
+                    uint64_t due = dueAt;
+                    memcpy(CMSG_DATA(control), &due, sizeof(due));
+                }
+                count++;
+                pendingSize = nextSize(sizes);
+            }
+
+            int64_t batchStart = getMonotonicTimeNs();
+            if (lastBatchStart != 0)
+            {
+                int64_t gap = batchStart - lastBatchStart;
+                stats->gapSum += gap;
+                if (lastGap >= 0)
+                    stats->gapDifferenceSum += gap > lastGap ? gap - lastGap : lastGap - gap;
+                stats->gapCount++;
+                lastGap = gap;
+            }
+            lastBatchStart = batchStart;
+
+            int sent = 0;
+            while (sent < count)
+            {
+                int result = sendmmsg(socketfd, messages + sent, count - sent, 0);
+                stats->sendCalls++;
+                if (result < 0)
+                {
+                    if (errno == EINTR)
+                        continue;
+                    // The receiver not listening or the queue being full loses the packet, like it would on the wire
+                    if (errno == ECONNREFUSED || errno == ENOBUFS || errno == EAGAIN)
+                    {
+                        stats->sendFailures++;
+                        sent++;
+                        continue;
+                    }
+                    perror("Failed to send datagrams");
+                    exit(1);
+                }
+                for (int i = sent; i < sent + result; i++)
+                {
+                    stats->bytes += vectors[i].iov_len;
+                }
+                stats->packets += result;
+                sent += result;
+            }
+            stats->scheduled += count;
+            recordLateness(stats, getMonotonicTimeNs() - dueAt);
+        }
+
+        if (intervalNs > 0 && now - lastReport >= intervalNs)
+        {
+            double seconds = (now - lastReport) / 1e9;
+            uint64_t packets = stats->packets - packetsAtLastReport;
+            uint64_t bytes = stats->bytes - bytesAtLastReport;
+            fprintf(stderr, "%.1fs: %.0f packets/s, %.2f Mbit/s\n", (now - start) / 1e9, packets / seconds, (bytes + packets * HEADER_OVERHEAD) * 8 / seconds / 1e6);
+            lastReport = now;
+            packetsAtLastReport = stats->packets;
+            bytesAtLastReport = stats->bytes;
+        }
+    }
+
+    free(buffers);
+    if (close(timerfd) < 0)
+    {
+        perror("Failed to close timerfd");
+        exit(1);
+    }
+}
+
+void printStats(struct GeneratorStats* stats, double rate, int bitMode, int txTime, double seconds)
+{
+    double packetRate = stats->packets / seconds;
+    double bitRate = (stats->bytes + stats->packets * HEADER_OVERHEAD) * 8 / seconds;
+    double achieved = bitMode ? bitRate : packetRate;
+    fprintf(stderr, "Sent %lu of %lu scheduled packets (%lu bytes) in %.2fs with %lu send calls, %lu packets failed to send\n", stats->packets, stats->scheduled, stats->bytes, seconds, stats->sendCalls, stats->sendFailures);
+    fprintf(stderr, "Achieved %.0f packets/s, %.2f Mbit/s\n", packetRate, bitRate / 1e6);
+    if (bitMode)
+        fprintf(stderr, "Target %.2f Mbit/s, achieved %.2f%% of it\n", rate / 1e6, achieved / rate * 100);
+    else
+        fprintf(stderr, "Target %.0f packets/s, achieved %.2f%% of it\n", rate, achieved / rate * 100);
+
+    if (stats->gapCount > 0)
+    {
+        // Jitter as in RFC 3550: the mean difference between consecutive gaps
+        double jitter = stats->gapCount > 1 ? stats->gapDifferenceSum / (stats->gapCount - 1) : 0;
+        fprintf(stderr, "Gap between batches: mean %.1fus, jitter %.1fus (batch level only, %s)\n", stats->gapSum / stats->gapCount / 1000, jitter / 1000,
+                txTime ? "the qdisc spaces the packets of a batch by their SCM_TXTIME" : "the packets of a batch leave back to back");
+    }
+    if (stats->latenessCount > 0)
+    {
+        qsort(stats->lateness, stats->latenessCount, sizeof(int64_t), compareInt64);
+        fprintf(stderr, "Batch lateness: p50 %.1fus, p90 %.1fus, p99 %.1fus, max %.1fus\n", percentile(stats->lateness, stats->latenessCount, 50) / 1000.0, percentile(stats->lateness, stats->latenessCount, 90) / 1000.0, percentile(stats->lateness, stats->latenessCount, 99) / 1000.0, stats->lateness[stats->latenessCount - 1] / 1000.0);
+    }
+}
+
+void printUsage(char* name)
+{
+    fprintf(stderr, "Usage: %s (--pps <rate> | --bps <rate>) [--size <n>|<min>-<max>|imix] [--burst <packets>] [--txtime] [--time <s>] [--interval <s>] <server ip address> <server port>\n", name);
+}
+
+int main(int argc, char* argv[])
+{
+    int serverPort;
+    char* serverAddressString;
+    int socketfd;
+    struct sockaddr_in serverAddress;
+    double rate = -1;
+    int bitMode = 0;
+    struct SizeSpec sizes = {SIZE_FIXED, 64, 64};
+    int burst = 1;
+    int txTime = 0;
+    double durationSeconds = 10;
+    double intervalSeconds = 1;
+
+    static struct option longOptions[] = {
+        {"pps", required_argument, NULL, 'p'},
+        {"bps", required_argument, NULL, 'b'},
+        {"size", required_argument, NULL, 's'},
+        {"burst", required_argument, NULL, 'B'},
+        {"txtime", no_argument, NULL, 'x'},
+        {"time", required_argument, NULL, 't'},
+        {"interval", required_argument, NULL, 'i'},
+        {NULL, 0, NULL, 0},
+    };
+    int option;
+    while ((option = getopt_long(argc, argv, "p:b:s:B:xt:i:", longOptions, NULL)) != -1)
+    {
+        switch (option)
+        {
+        case 'p':
+        case 'b':
+            bitMode = option == 'b';
+            if ((rate = parseRate(optarg)) < 0)
+            {
+                fprintf(stderr, "Invalid rate: %s\n", optarg);
+                return 1;
+            }
+            // The budget is kept in bytes in bits/sec mode
+            if (bitMode)
+                rate /= 8;
+            break;
+        case 's':
+            if (parseSizeSpec(optarg, &sizes) < 0)
+            {
+                fprintf(stderr, "Invalid size: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'B':
+            burst = atoi(optarg);
+            if (burst < 1 || burst > MAX_BATCH_SIZE)
+            {
+                fprintf(stderr, "Burst must be between 1 and %d\n", MAX_BATCH_SIZE);
+                return 1;
+            }
+            break;
+        case 'x':
+            txTime = 1;
+            break;
+        case 't':
+            durationSeconds = atof(optarg);
+            if (durationSeconds <= 0)
+            {
+                fprintf(stderr, "Time must be a positive number of seconds\n");
+                return 1;
+            }
+            break;
+        case 'i':
+            intervalSeconds = atof(optarg);
+            if (intervalSeconds <= 0)
+            {
+                fprintf(stderr, "Interval must be a positive number of seconds\n");
+                return 1;
+            }
+            break;
+        default:
+            printUsage(argv[0]);
+            return 1;
+        }
+    }
+
+    // Read the server address and port from the command line arguments.
+    if (argc - optind != 2 || rate < 0)
+    {
+        printUsage(argv[0]);
+        return 1;
+    }
+    serverAddressString = argv[optind];
+    serverPort = atoi(argv[optind + 1]);
+
+    // Create a datagram socket for the connection
+    if ((socketfd = socket(PF_INET, SOCK_DGRAM, 0)) < 0)
+    {
+        perror("Failed to create socket");
+        return 1; // Exit with error if socket creation fails
+    }
+
+    if (txTime)
+    {
+        struct sock_txtime config = {CLOCK_MONOTONIC, 0};
+        if (setsockopt(socketfd, SOL_SOCKET, SO_TXTIME, &config, sizeof(config)) < 0)
+        {
+            perror("Failed to enable SO_TXTIME");
+            return 1;
+        }
+    }
+
+    // Initialize serverAddress struct with server IP address and port
+    memset(&serverAddress, 0, sizeof(serverAddress));
+    serverAddress.sin_family = AF_INET;
+    if (inet_aton(serverAddressString, &serverAddress.sin_addr) == 0)
+    {
+        perror("Invalid server IP address");
+        return 1;
+    }
+    serverAddress.sin_port = htons(serverPort);
+
+    if (connect(socketfd, (struct sockaddr*)&serverAddress, sizeof(serverAddress)) < 0)
+    {
+        perror("Failed to connect socket");
+        return 1;
+    }
+
+    srand48(getMonotonicTimeNs());
+    struct GeneratorStats stats;
+    memset(&stats, 0, sizeof(stats));
+    int64_t start = getMonotonicTimeNs();
+    generate(socketfd, &sizes, rate, bitMode, burst, txTime, (int64_t)(durationSeconds * 1e9), (int64_t)(intervalSeconds * 1e9), &stats);
+    printStats(&stats, bitMode ? rate * 8 : rate, bitMode, txTime, (getMonotonicTimeNs() - start) / 1e9);
+    free(stats.lateness);
+
+    // Close the socket
+    if (close(socketfd) < 0)
+    {
+        perror("Failed to close socket");
+        return 1;
+    }
+
+    return 0;
+}
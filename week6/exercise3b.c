@@ -1,16 +1,508 @@
+#define _GNU_SOURCE
 #include <arpa/inet.h>
+#include <endian.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <getopt.h>
 #include <netinet/in.h>
+#include <netinet/ip.h>
+#include <poll.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
 #include <sys/socket.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
 #define BUFFER_SIZE 100
+#define PACKET_MAGIC 0x6e705544
+#define DEFAULT_MAX_WINDOW 256
+#define MAX_RETRANSMITS 16
+#define INITIAL_RETRANSMISSION_TIMEOUT_NS 100000000
+#define MIN_RETRANSMISSION_TIMEOUT_NS 1000000
+#define MAX_RETRANSMISSION_TIMEOUT_NS 2000000000
+// IPv4 header without options plus the UDP header.
+#define HEADER_OVERHEAD 28
+#define DEFAULT_FLUSH_TIMEOUT_US 1000
+// Largest UDP payload that fits in an IPv4 datagram.
+#define MAX_PACK_SIZE 65507
+// A datagram is retransmitted without waiting for its timer once this many later datagrams have been acknowledged.
+#define FAST_RETRANSMIT_THRESHOLD 3
+
+enum PacketType
+{
+    PACKET_DATA = 1,
+    PACKET_ACK = 2,
+    // Sent to a multicast group. Never acknowledged, the sequence number only lets receivers count lost datagrams.
+    PACKET_MULTICAST = 3
+};
+
+// With the reliability layer enabled every datagram starts with this header, all fields in network byte order.
+// For data "sequence" is the sequence number of the datagram and "timestamp" its send time. For acknowledgements
+// "sequence" is the first sequence number not yet received, "timestamp" echoes the send time of the datagram that
+// triggered the acknowledgement and bit i of "selective" tells that sequence + 1 + i has been received.
+struct PacketHeader
+{
+    uint32_t magic;
+    uint16_t type;
+    uint16_t flags;
+    uint32_t sequence;
+    uint32_t reserved;
+    uint64_t timestamp;
+};
+
+struct AckPacket
+{
+    struct PacketHeader header;
+    uint64_t selective;
+};
+
+// A datagram that has been sent but not acknowledged yet, kept for retransmitting it.
+struct PendingDatagram
+{
+    char* data;
+    size_t length;
+    size_t capacity;
+    int64_t timeoutNs;
+    int64_t retransmissionTimeoutNs;
+    int retransmits;
+    int fastRetransmitted;
+    int acknowledged;
+};
+
+// Optional reliability layer between the line framer and the socket. Every datagram gets a sequence number and stays
+// in the window until the receiver acknowledges it, either cumulatively or selectively. Unacknowledged datagrams are
+// retransmitted when their timer runs out or when enough later datagrams have been acknowledged. The number of
+// datagrams in flight is limited by a congestion window that grows by one per acknowledged datagram in slow start and
+// by one per window after that, and is halved at most once per window of datagrams when one is found lost.
+// Acknowledged datagrams are delivered by the receiver as they arrive, so a lost one doesn't hold back the others.
+struct Sender
+{
+    int socketfd;
+    int reliable;
+    // Probability of dropping each outgoing datagram and incoming acknowledgement on purpose.
+    double lossProbability;
+    uint64_t injectedLosses;
+    uint64_t datagramsSent;
+
+    int maxWindow;
+    int windowCapacity;
+    struct PendingDatagram* window;
+    uint32_t nextSequence;
+    // All datagrams before this one have been acknowledged or given up on.
+    uint32_t lowestUnacknowledged;
+    int64_t highestAcknowledged;
+    uint32_t recoveryPoint;
+    uint32_t inFlight;
+    double congestionWindow;
+    double slowStartThreshold;
+    int64_t smoothedRttNs;
+    int64_t rttVarianceNs;
+    int64_t retransmissionTimeoutNs;
+    uint64_t retransmissions;
+    uint64_t timeouts;
+    uint64_t fastRetransmissions;
+    uint64_t failed;
+
+    // With packing enabled lines are collected into "pack" until the next one doesn't fit in "packSize" bytes or the
+    // first one has waited for "flushTimeoutNs", and then sent as one datagram.
+    size_t packSize;
+    char* pack;
+    size_t packLength;
+    int64_t packDeadlineNs;
+    int64_t flushTimeoutNs;
+    uint64_t linesQueued;
+
+    // In multicast mode every datagram is prefixed with a header built in "multicastBuffer".
+    int multicast;
+    char* multicastBuffer;
+};
+
+// Returns the current time of the monotonic clock in nanoseconds.
+int64_t getMonotonicTimeNs()
+{
+    struct timespec now;
+    if (clock_gettime(CLOCK_MONOTONIC, &now) < 0)
+    {
+        perror("Failed to get monotonic time");
+        exit(1);
+    }
+    return now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+void senderInit(struct Sender* sender, int socketfd, int reliable, int maxWindow, double lossProbability)
+{
+    memset(sender, 0, sizeof(*sender));
+    sender->socketfd = socketfd;
+    sender->reliable = reliable;
+    sender->lossProbability = lossProbability;
+    sender->maxWindow = maxWindow;
+    sender->highestAcknowledged = -1;
+    sender->congestionWindow = 4;
+    sender->slowStartThreshold = maxWindow;
+    sender->retransmissionTimeoutNs = INITIAL_RETRANSMISSION_TIMEOUT_NS;
+    srand48(getpid() ^ getMonotonicTimeNs());
+
+    if (reliable)
+    {
+        // One read from the input may produce up to BUFFER_SIZE / 2 datagrams past the congestion window.
+        sender->windowCapacity = maxWindow + BUFFER_SIZE;
+        sender->window = calloc(sender->windowCapacity, sizeof(struct PendingDatagram));
+        if (sender->window == NULL)
+        {
+            perror("Failed to allocate retransmission window");
+            exit(1);
+        }
+    }
+}
+
+// Returns 1 if the datagram should be dropped by the loss injection.
+int injectLoss(struct Sender* sender)
+{
+    if (sender->lossProbability <= 0 || drand48() >= sender->lossProbability)
+        return 0;
+    sender->injectedLosses++;
+    return 1;
+}
+
+// Sends a datagram unless the loss injection drops it.
+void transmit(struct Sender* sender, void* data, size_t length)
+{
+    sender->datagramsSent++;
+    if (injectLoss(sender))
+        return;
+    if (send(sender->socketfd, data, length, 0) < 0)
+    {
+        // The receiver not running yet shows up as ECONNREFUSED. With the reliability layer the datagram gets
+        // retransmitted later, without it the datagram is lost just like it would be in the network.
+        if (errno == ECONNREFUSED)
+            return;
+        perror("Failed to send data to processing server");
+        exit(1);
+    }
+}
+
+// Sends the pending datagram with the given sequence number with a fresh timestamp in its header.
+void transmitPending(struct Sender* sender, uint32_t sequence)
+{
+    struct PendingDatagram* pending = &sender->window[sequence % sender->windowCapacity];
+    struct PacketHeader header = {htonl(PACKET_MAGIC), htons(PACKET_DATA), 0, htonl(sequence), 0, htobe64(getMonotonicTimeNs())};
+    memcpy(pending->data, &header, sizeof(header));
+    transmit(sender, pending->data, pending->length);
+}
+
+// Returns 1 if the window has room for another datagram.
+int senderCanSend(struct Sender* sender)
+{
+    return !sender->reliable || sender->nextSequence - sender->lowestUnacknowledged < (uint32_t)sender->congestionWindow;
+}
+
+// Sends "length" bytes of "data" as one datagram, through the reliability layer if it is enabled.
+void senderSend(struct Sender* sender, char* data, size_t length)
+{
+    if (sender->multicast)
+    {
+        struct PacketHeader header = {htonl(PACKET_MAGIC), htons(PACKET_MULTICAST), 0, htonl(sender->nextSequence++), 0, htobe64(getMonotonicTimeNs())};
+        memcpy(sender->multicastBuffer, &header, sizeof(header));
+        memcpy(sender->multicastBuffer + sizeof(header), data, length);
+        transmit(sender, sender->multicastBuffer, sizeof(header) + length);
+        return;
+    }
+    if (!sender->reliable)
+    {
+        transmit(sender, data, length);
+        return;
+    }
+
+    uint32_t sequence = sender->nextSequence++;
+    struct PendingDatagram* pending = &sender->window[sequence % sender->windowCapacity];
+    if (pending->capacity < sizeof(struct PacketHeader) + length)
+    {
+        pending->capacity = sizeof(struct PacketHeader) + length;
+        if ((pending->data = realloc(pending->data, pending->capacity)) == NULL)
+        {
+            perror("Failed to allocate retransmission buffer");
+            exit(1);
+        }
+    }
+    memcpy(pending->data + sizeof(struct PacketHeader), data, length);
+    pending->length = sizeof(struct PacketHeader) + length;
+    pending->retransmits = 0;
+    pending->fastRetransmitted = 0;
+    pending->acknowledged = 0;
+    pending->retransmissionTimeoutNs = sender->retransmissionTimeoutNs;
+    pending->timeoutNs = getMonotonicTimeNs() + pending->retransmissionTimeoutNs;
+    sender->inFlight++;
+
+    transmitPending(sender, sequence);
+}
+
+// Enables sending to a multicast group, with a sequence numbered header in front of every datagram.
+void senderEnableMulticast(struct Sender* sender)
+{
+    sender->multicast = 1;
+    if ((sender->multicastBuffer = malloc(sizeof(struct PacketHeader) + MAX_PACK_SIZE)) == NULL)
+    {
+        perror("Failed to allocate multicast buffer");
+        exit(1);
+    }
+}
+
+// Enables packing many lines into each datagram, "packSize" bytes of payload at most.
+void senderEnablePacking(struct Sender* sender, size_t packSize, int64_t flushTimeoutNs)
+{
+    sender->packSize = packSize;
+    sender->flushTimeoutNs = flushTimeoutNs;
+    if ((sender->pack = malloc(packSize)) == NULL)
+    {
+        perror("Failed to allocate packing buffer");
+        exit(1);
+    }
+}
+
+// Sends the lines collected so far as one datagram.
+void senderFlush(struct Sender* sender)
+{
+    if (sender->packLength == 0)
+        return;
+    senderSend(sender, sender->pack, sender->packLength);
+    sender->packLength = 0;
+}
+
+// Sends one line, either right away as its own datagram or packed together with the following lines.
+void senderQueueLine(struct Sender* sender, char* line, size_t length)
+{
+    sender->linesQueued++;
+    if (sender->packSize == 0 || length > sender->packSize)
+    {
+        // The lines already packed go first so that the order of the lines is kept
+        senderFlush(sender);
+        senderSend(sender, line, length);
+        return;
+    }
+
+    if (sender->packLength + length > sender->packSize)
+        senderFlush(sender);
+    if (sender->packLength == 0)
+        sender->packDeadlineNs = getMonotonicTimeNs() + sender->flushTimeoutNs;
+    memcpy(sender->pack + sender->packLength, line, length);
+    sender->packLength += length;
+    if (sender->packLength == sender->packSize)
+        senderFlush(sender);
+}
+
+// Updates the round trip time estimate as in RFC 6298.
+void updateRoundTripTime(struct Sender* sender, int64_t roundTripNs)
+{
+    if (sender->smoothedRttNs == 0)
+    {
+        sender->smoothedRttNs = roundTripNs;
+        sender->rttVarianceNs = roundTripNs / 2;
+    }
+    else
+    {
+        int64_t difference = sender->smoothedRttNs - roundTripNs;
+        sender->rttVarianceNs = (3 * sender->rttVarianceNs + (difference < 0 ? -difference : difference)) / 4;
+        sender->smoothedRttNs = (7 * sender->smoothedRttNs + roundTripNs) / 8;
+    }
+    sender->retransmissionTimeoutNs = sender->smoothedRttNs + 4 * sender->rttVarianceNs;
+    if (sender->retransmissionTimeoutNs < MIN_RETRANSMISSION_TIMEOUT_NS)
+        sender->retransmissionTimeoutNs = MIN_RETRANSMISSION_TIMEOUT_NS;
+    if (sender->retransmissionTimeoutNs > MAX_RETRANSMISSION_TIMEOUT_NS)
+        sender->retransmissionTimeoutNs = MAX_RETRANSMISSION_TIMEOUT_NS;
+}
+
+// Marks a datagram acknowledged and grows the congestion window.
+void acknowledge(struct Sender* sender, uint32_t sequence)
+{
+    if (sequence < sender->lowestUnacknowledged || sequence >= sender->nextSequence)
+        return;
+    struct PendingDatagram* pending = &sender->window[sequence % sender->windowCapacity];
+    if (pending->acknowledged)
+        return;
+    pending->acknowledged = 1;
+    sender->inFlight--;
+    if ((int64_t)sequence > sender->highestAcknowledged)
+        sender->highestAcknowledged = sequence;
+
+    if (sender->congestionWindow < sender->slowStartThreshold)
+        sender->congestionWindow += 1;
+    else
+        sender->congestionWindow += 1 / sender->congestionWindow;
+    if (sender->congestionWindow > sender->maxWindow)
+        sender->congestionWindow = sender->maxWindow;
+}
+
+// Reads every acknowledgement that is already queued on the socket.
+void senderReceiveAcks(struct Sender* sender)
+{
+    struct AckPacket ack;
+    ssize_t readResult;
+    while ((readResult = recv(sender->socketfd, &ack, sizeof(ack), MSG_DONTWAIT)) >= 0 || errno == EINTR || errno == ECONNREFUSED)
+    {
+        if (readResult != sizeof(ack) || ntohl(ack.header.magic) != PACKET_MAGIC || ntohs(ack.header.type) != PACKET_ACK || injectLoss(sender))
+            continue;
+
+        int64_t roundTripNs = getMonotonicTimeNs() - (int64_t)be64toh(ack.header.timestamp);
+        if (roundTripNs > 0)
+            updateRoundTripTime(sender, roundTripNs);
+
+        uint32_t cumulative = ntohl(ack.header.sequence);
+        uint64_t selective = be64toh(ack.selective);
+        for (uint32_t sequence = sender->lowestUnacknowledged; sequence < cumulative && sequence < sender->nextSequence; sequence++)
+        {
+            acknowledge(sender, sequence);
+        }
+        for (int bit = 0; bit < 64; bit++)
+        {
+            if (selective & ((uint64_t)1 << bit))
+                acknowledge(sender, cumulative + 1 + bit);
+        }
+    }
+    if (errno != EAGAIN && errno != EWOULDBLOCK)
+    {
+        perror("Failed to receive acknowledgements");
+        exit(1);
+    }
+
+    while (sender->lowestUnacknowledged < sender->nextSequence && sender->window[sender->lowestUnacknowledged % sender->windowCapacity].acknowledged)
+    {
+        sender->lowestUnacknowledged++;
+    }
+}
+
+// Halves the congestion window, unless it was already halved for a loss within the current window of datagrams.
+void onDatagramLost(struct Sender* sender, uint32_t sequence)
+{
+    if (sequence < sender->recoveryPoint)
+        return;
+    sender->slowStartThreshold = sender->congestionWindow / 2 < 2 ? 2 : sender->congestionWindow / 2;
+    sender->congestionWindow = sender->slowStartThreshold;
+    sender->recoveryPoint = sender->nextSequence;
+}
+
+// Retransmits every unacknowledged datagram whose timer has run out or that has been overtaken by enough acknowledged
+// datagrams. Returns the time the next timer runs out or -1 if nothing is in flight.
+int64_t senderCheckRetransmissions(struct Sender* sender)
+{
+    int64_t now = getMonotonicTimeNs();
+    int64_t nextTimeout = -1;
+    for (uint32_t sequence = sender->lowestUnacknowledged; sequence < sender->nextSequence; sequence++)
+    {
+        struct PendingDatagram* pending = &sender->window[sequence % sender->windowCapacity];
+        if (pending->acknowledged)
+            continue;
+
+        int timedOut = now >= pending->timeoutNs;
+        int overtaken = !pending->fastRetransmitted && sender->highestAcknowledged - (int64_t)sequence >= FAST_RETRANSMIT_THRESHOLD;
+        if (timedOut || overtaken)
+        {
+            if (pending->retransmits == MAX_RETRANSMITS)
+            {
+                // Give up on the datagram. Treating it as acknowledged lets the window move on.
+                fprintf(stderr, "Warning: Giving up on datagram %u after %d retransmissions\n", sequence, MAX_RETRANSMITS);
+                pending->acknowledged = 1;
+                sender->inFlight--;
+                sender->failed++;
+                continue;
+            }
+
+            onDatagramLost(sender, sequence);
+            if (timedOut)
+            {
+                // Back off exponentially for datagrams that keep timing out.
+                sender->timeouts++;
+                pending->retransmissionTimeoutNs *= 2;
+                if (pending->retransmissionTimeoutNs > MAX_RETRANSMISSION_TIMEOUT_NS)
+                    pending->retransmissionTimeoutNs = MAX_RETRANSMISSION_TIMEOUT_NS;
+            }
+            else
+            {
+                sender->fastRetransmissions++;
+                pending->fastRetransmitted = 1;
+            }
+            pending->retransmits++;
+            sender->retransmissions++;
+            pending->timeoutNs = now + pending->retransmissionTimeoutNs;
+            transmitPending(sender, sequence);
+        }
+
+        if (nextTimeout < 0 || pending->timeoutNs < nextTimeout)
+            nextTimeout = pending->timeoutNs;
+    }
+    while (sender->lowestUnacknowledged < sender->nextSequence && sender->window[sender->lowestUnacknowledged % sender->windowCapacity].acknowledged)
+    {
+        sender->lowestUnacknowledged++;
+    }
+    return nextTimeout;
+}
+
+// Waits until the input is readable (if "waitForInput" is set and the window has room) while receiving
+// acknowledgements, retransmitting and flushing packed lines that have waited long enough. Returns 1 if the input can
+// be read and 0 if only the socket or a timer needed attention.
+int senderWait(struct Sender* sender, int input, int waitForInput)
+{
+    if (!sender->reliable && sender->packLength == 0)
+        return 1;
+
+    int64_t timeoutNs = -1;
+    int64_t nextTimeout = sender->reliable ? senderCheckRetransmissions(sender) : -1;
+    if (sender->packLength > 0 && (nextTimeout < 0 || sender->packDeadlineNs < nextTimeout))
+        nextTimeout = sender->packDeadlineNs;
+    if (nextTimeout >= 0)
+    {
+        timeoutNs = nextTimeout - getMonotonicTimeNs();
+        if (timeoutNs < 0)
+            timeoutNs = 0;
+    }
+    int readInput = waitForInput && senderCanSend(sender);
+
+    // Without the reliability layer nothing arrives on the socket, so only the input is polled.
+    struct pollfd pollfds[2] = {
+        {sender->reliable ? sender->socketfd : -1, POLLIN, 0},
+        {input, POLLIN, 0},
+    };
+    struct timespec timeout = {timeoutNs / 1000000000, timeoutNs % 1000000000};
+    int ready = ppoll(pollfds, readInput ? 2 : 1, timeoutNs >= 0 ? &timeout : NULL, NULL);
+    if (ready < 0)
+    {
+        if (errno == EINTR)
+            return 0;
+        perror("Failed to poll input and socket");
+        exit(1);
+    }
+    if (pollfds[0].revents & (POLLIN | POLLERR))
+        senderReceiveAcks(sender);
+    if (sender->packLength > 0 && getMonotonicTimeNs() >= sender->packDeadlineNs)
+        senderFlush(sender);
+    return readInput && (pollfds[1].revents & (POLLIN | POLLHUP | POLLERR));
+}
+
+// Keeps retransmitting until every datagram has been acknowledged or given up on.
+void senderFinish(struct Sender* sender)
+{
+    senderFlush(sender);
+    if (sender->packSize > 0)
+        fprintf(stderr, "Lines sent: %lu in %lu datagrams (%.1f lines per datagram)\n", sender->linesQueued, sender->datagramsSent - sender->retransmissions, (double)sender->linesQueued / (sender->datagramsSent - sender->retransmissions));
+    if (sender->multicast)
+        fprintf(stderr, "Datagrams sent to the multicast group: %u\n", sender->nextSequence);
+    free(sender->pack);
+    free(sender->multicastBuffer);
+    if (sender->reliable)
+    {
+        while (sender->inFlight > 0)
+        {
+            senderWait(sender, -1, 0);
+        }
+        fprintf(stderr, "Datagrams sent: %u, retransmissions: %lu (%lu after timeout, %lu fast), given up on: %lu\n", sender->nextSequence, sender->retransmissions, sender->timeouts, sender->fastRetransmissions, sender->failed);
+        fprintf(stderr, "Final congestion window: %.1f, smoothed rtt: %.1fus, retransmission timeout: %.1fus\n", sender->congestionWindow, sender->smoothedRttNs / 1000.0, sender->retransmissionTimeoutNs / 1000.0);
+    }
+    if (sender->lossProbability > 0)
+        fprintf(stderr, "Datagrams dropped by loss injection: %lu\n", sender->injectedLosses);
+}
 
 // Inclusively returns the number of characters until the next newline character.
 // Returns -1 if no newline character is found in "length" bytes.
@@ -43,7 +535,7 @@ ssize_t loopedWrite(int file, void* data, size_t length)
     return writeResult;
 }
 
-void lineProcesser(int input, int output, struct sockaddr* serverAddress, int serverAddressLength)
+void lineProcesser(int input, struct Sender* sender)
 {
     // Keep reading max 100 characters to "data" until EOF is reached.
     // Data is read to "data + readBufferOffset" to allow continuation of reading a line
@@ -52,8 +544,13 @@ void lineProcesser(int input, int output, struct sockaddr* serverAddress, int se
     ssize_t charactersRead;
     size_t readBufferOffset = 0;
     char shouldSkipUntilNewline = 0;
-    while ((charactersRead = read(input, data + readBufferOffset, BUFFER_SIZE - readBufferOffset)) > 0)
+    while (1)
     {
+        // With the reliability layer the input is only read when the window has room for more datagrams.
+        if (!senderWait(sender, input, 1))
+            continue;
+        if ((charactersRead = read(input, data + readBufferOffset, BUFFER_SIZE - readBufferOffset)) <= 0)
+            break;
         charactersRead += readBufferOffset;
 
         // Keep writing lines to processTo until the read buffer is empty or no newlines are found.
@@ -70,14 +567,7 @@ void lineProcesser(int input, int output, struct sockaddr* serverAddress, int se
 
             // If the buffer was full previously, but now a newline was found, we should skip all the additional characters until the next (this) newline.
             if (!shouldSkipUntilNewline)
-            {
-                if (sendto(output, data + charactersWritten, count, 0, serverAddress, serverAddressLength) < 0)
-                // if (loopedWrite(output, data + charactersWritten, count) < 0)
-                {
-                    perror("Failed to send data to processing server");
-                    exit(1);
-                }
-            }
+                senderQueueLine(sender, data + charactersWritten, count);
 
             // As we got to the end of the line, we can stop skipping characters until the next newline.
             shouldSkipUntilNewline = 0;
@@ -126,15 +616,93 @@ int main(__attribute__((unused)) int argc, __attribute__((unused)) char* argv[])
     char* serverAddressString;
     int socketfd;
     struct sockaddr_in serverAddress;
+    int reliable = 0;
+    int maxWindow = DEFAULT_MAX_WINDOW;
+    double lossProbability = 0;
+    int packSize = -1;
+    int64_t flushTimeoutUs = DEFAULT_FLUSH_TIMEOUT_US;
+    int multicastTtl = 1;
+    int multicastLoop = 1;
+    char* multicastInterface = NULL;
+
+    static struct option longOptions[] = {
+        {"pack", required_argument, NULL, 'p'},
+        {"flush", required_argument, NULL, 'f'},
+        {"ttl", required_argument, NULL, 't'},
+        {"no-loop", no_argument, NULL, 'n'},
+        {"interface", required_argument, NULL, 'I'},
+        {"reliable", no_argument, NULL, 'r'},
+        {"window", required_argument, NULL, 'w'},
+        {"loss", required_argument, NULL, 'l'},
+        {NULL, 0, NULL, 0},
+    };
+    int option;
+    while ((option = getopt_long(argc, argv, "rw:l:p:f:t:nI:", longOptions, NULL)) != -1)
+    {
+        switch (option)
+        {
+        case 't':
+            multicastTtl = atoi(optarg);
+            if (multicastTtl < 0 || multicastTtl > 255)
+            {
+                fprintf(stderr, "TTL must be between 0 and 255\n");
+                return 1;
+            }
+            break;
+        case 'n':
+            multicastLoop = 0;
+            break;
+        case 'I':
+            multicastInterface = optarg;
+            break;
+        case 'p':
+            packSize = atoi(optarg);
+            if (packSize != 0 && (packSize < BUFFER_SIZE || packSize > MAX_PACK_SIZE))
+            {
+                fprintf(stderr, "Pack size must be 0 for the path MTU or between %d and %d bytes\n", BUFFER_SIZE, MAX_PACK_SIZE);
+                return 1;
+            }
+            break;
+        case 'f':
+            flushTimeoutUs = atoll(optarg);
+            if (flushTimeoutUs < 0)
+            {
+                fprintf(stderr, "Flush timeout can't be negative\n");
+                return 1;
+            }
+            break;
+        case 'r':
+            reliable = 1;
+            break;
+        case 'w':
+            maxWindow = atoi(optarg);
+            if (maxWindow < 2)
+            {
+                fprintf(stderr, "Window must be at least 2 datagrams\n");
+                return 1;
+            }
+            break;
+        case 'l':
+            lossProbability = atof(optarg) / 100;
+            if (lossProbability < 0 || lossProbability >= 1)
+            {
+                fprintf(stderr, "Loss must be a percentage from 0 up to but not including 100\n");
+                return 1;
+            }
+            break;
+        default:
+            return 1;
+        }
+    }
 
     // Read the server address and port from the command line arguments.
-    if (argc != 3)
+    if (argc - optind != 2)
     {
-        fprintf(stderr, "Usage: %s <server ip address> <server port>\n", argv[0]);
+        fprintf(stderr, "Usage: %s [--reliable [--window <max datagrams in flight>]] [--loss <percent>] [--pack <payload bytes, 0 for path MTU> [--flush <us>]] [--ttl <hops>] [--no-loop] [--interface <ip address>] <server or multicast group ip address> <server port>\n", argv[0]);
         return 1;
     }
-    serverAddressString = argv[1];
-    serverPort = atoi(argv[2]);
+    serverAddressString = argv[optind];
+    serverPort = atoi(argv[optind + 1]);
 
     // Create a datagram socket for the connection
     if ((socketfd = socket(PF_INET, SOCK_DGRAM, 0)) < 0)
@@ -158,6 +726,41 @@ int main(__attribute__((unused)) int argc, __attribute__((unused)) char* argv[])
     }
     serverAddress.sin_port = htons(serverPort);
 
+    // Sending to a multicast group reaches every receiver that has joined it with a single send. Acknowledgements from
+    // all of them can't drive one retransmission window, so the reliability layer is not available there.
+    int multicast = IN_MULTICAST(ntohl(serverAddress.sin_addr.s_addr));
+    if (multicast)
+    {
+        if (reliable)
+        {
+            fprintf(stderr, "The reliability layer can't be used with a multicast group\n");
+            return 1;
+        }
+        // The TTL limits how many routers the datagrams cross, 1 keeps them in the local network. Loopback delivers
+        // a copy to the receivers on this host too.
+        unsigned char ttl = multicastTtl;
+        unsigned char loop = multicastLoop;
+        if (setsockopt(socketfd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl)) < 0 || setsockopt(socketfd, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop)) < 0)
+        {
+            perror("Failed to set multicast options");
+            return 1;
+        }
+        if (multicastInterface != NULL)
+        {
+            struct in_addr interfaceAddress;
+            if (inet_aton(multicastInterface, &interfaceAddress) == 0)
+            {
+                fprintf(stderr, "Invalid interface address: %s\n", multicastInterface);
+                return 1;
+            }
+            if (setsockopt(socketfd, IPPROTO_IP, IP_MULTICAST_IF, &interfaceAddress, sizeof(interfaceAddress)) < 0)
+            {
+                perror("Failed to set multicast interface");
+                return 1;
+            }
+        }
+    }
+
     // connect to server
     if (connect(socketfd, (struct sockaddr*)&serverAddress, sizeof(serverAddress)) < 0)
     {
@@ -166,7 +769,35 @@ int main(__attribute__((unused)) int argc, __attribute__((unused)) char* argv[])
     }
 
     // Start client program that reads from standard input, sends to server and reads from server, writes to standard output
-    lineProcesser(STDIN_FILENO, socketfd, (struct sockaddr*)&serverAddress, sizeof(serverAddress));
+    struct Sender sender;
+    senderInit(&sender, socketfd, reliable, maxWindow, lossProbability);
+    if (multicast)
+        senderEnableMulticast(&sender);
+    if (packSize >= 0)
+    {
+        if (packSize == 0)
+        {
+            // The connected socket knows the MTU of the route to the receiver. Packing up to it keeps the datagrams
+            // from being fragmented.
+            int mtu;
+            socklen_t mtuLength = sizeof(mtu);
+            if (getsockopt(socketfd, IPPROTO_IP, IP_MTU, &mtu, &mtuLength) < 0)
+            {
+                perror("Failed to get IP_MTU");
+                return 1;
+            }
+            packSize = mtu - HEADER_OVERHEAD;
+            if (packSize > MAX_PACK_SIZE)
+                packSize = MAX_PACK_SIZE;
+        }
+        // The reliability layer and multicast mode put their header in front of the packed lines.
+        if (reliable || multicast)
+            packSize -= sizeof(struct PacketHeader);
+        fprintf(stderr, "Packing lines into datagrams of up to %d bytes\n", packSize);
+        senderEnablePacking(&sender, packSize, flushTimeoutUs * 1000);
+    }
+    lineProcesser(STDIN_FILENO, &sender);
+    senderFinish(&sender);
 
     // Close the socket
     if (close(socketfd) < 0)
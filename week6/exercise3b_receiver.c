@@ -0,0 +1,420 @@
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BUFFER_SIZE 65536
+#define PACKET_MAGIC 0x6e705544
+// How far past the first missing datagram the receiver keeps track of datagrams. Anything further is dropped
+// unacknowledged and will be retransmitted, which can't happen with the sender's window being smaller than this.
+#define RECEIVE_WINDOW 65536
+
+enum PacketType
+{
+    PACKET_DATA = 1,
+    PACKET_ACK = 2,
+    // Sent to a multicast group. Never acknowledged, the sequence number only lets receivers count lost datagrams.
+    PACKET_MULTICAST = 3
+};
+
+// Header in front of every datagram sent with the reliability layer of exercise3b, all fields in network byte order.
+// For data "sequence" is the sequence number of the datagram and "timestamp" its send time. For acknowledgements
+// "sequence" is the first sequence number not yet received, "timestamp" echoes the send time of the datagram that
+// triggered the acknowledgement and bit i of "selective" tells that sequence + 1 + i has been received.
+struct PacketHeader
+{
+    uint32_t magic;
+    uint16_t type;
+    uint16_t flags;
+    uint32_t sequence;
+    uint32_t reserved;
+    uint64_t timestamp;
+};
+
+struct AckPacket
+{
+    struct PacketHeader header;
+    uint64_t selective;
+};
+
+// Which datagrams of the current sender have been received. Entries are indexed by sequence % RECEIVE_WINDOW and are
+// valid for sequence numbers from "cumulative" up to cumulative + RECEIVE_WINDOW.
+struct ReceiveState
+{
+    struct sockaddr_in sender;
+    int hasSender;
+    uint32_t cumulative;
+    uint8_t received[RECEIVE_WINDOW];
+};
+
+// Which multicast datagrams have been seen from the current sender. Every sequence number between the first one and
+// "highest" that was not received counts as lost. "seen" is indexed by sequence % RECEIVE_WINDOW and is valid for the
+// RECEIVE_WINDOW sequence numbers up to "highest" that are not before "first". A datagram arriving there for the first
+// time counts as reordered and takes back the loss counted for it, one arriving again counts as a duplicate. Anything
+// older can't be told apart and only counts as reordered. The totals cover everything since the sender was first seen.
+struct MulticastState
+{
+    struct sockaddr_in sender;
+    int hasSender;
+    uint32_t first;
+    uint32_t highest;
+    uint64_t totalReceived;
+    uint64_t totalLost;
+    uint8_t seen[RECEIVE_WINDOW];
+};
+
+// Counters for one report interval. For multicast "lost" is the number of gaps found in the interval and "recovered"
+// the number of those, from this or an earlier interval, filled by a reordered datagram later.
+struct ReceiverStats
+{
+    uint64_t datagrams;
+    uint64_t duplicates;
+    // Reliable datagrams too far ahead of the first missing one to be tracked, dropped for the sender to retransmit
+    uint64_t outOfWindow;
+    uint64_t lines;
+    uint64_t bytes;
+    uint64_t lost;
+    uint64_t recovered;
+    uint64_t reordered;
+};
+
+// Returns the current time of the monotonic clock in microseconds.
+int64_t getMonotonicTimeUs()
+{
+    struct timespec now;
+    if (clock_gettime(CLOCK_MONOTONIC, &now) < 0)
+    {
+        perror("Failed to get monotonic time");
+        exit(1);
+    }
+    return now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+// Writes "length" bytes from "data" to "file" and returns the number of bytes written or -1 if an error occurred.
+// Implemented because write does not guarantee to write all bytes if the output file is eg. full or a signal causes the write to be interrupted.
+ssize_t loopedWrite(int file, void* data, size_t length)
+{
+    ssize_t writeResult;
+    size_t charactersWritten = 0;
+    while ((writeResult = write(file, data + charactersWritten, length - charactersWritten)) >= 0)
+    {
+        charactersWritten += writeResult;
+        if (charactersWritten == length)
+            break;
+    }
+    return writeResult;
+}
+
+enum ReceiveResult
+{
+    RECEIVED_NEW,
+    RECEIVED_DUPLICATE,
+    RECEIVED_OUT_OF_WINDOW
+};
+
+// Records a received data datagram. Only a new datagram should be delivered.
+enum ReceiveResult markReceived(struct ReceiveState* state, uint32_t sequence)
+{
+    if (sequence < state->cumulative)
+        return RECEIVED_DUPLICATE;
+    if (sequence - state->cumulative >= RECEIVE_WINDOW)
+        return RECEIVED_OUT_OF_WINDOW;
+    if (state->received[sequence % RECEIVE_WINDOW])
+        return RECEIVED_DUPLICATE;
+    state->received[sequence % RECEIVE_WINDOW] = 1;
+
+    // Move past every datagram received in order, freeing their entries for the datagrams a window later.
+    while (state->received[state->cumulative % RECEIVE_WINDOW])
+    {
+        state->received[state->cumulative % RECEIVE_WINDOW] = 0;
+        state->cumulative++;
+    }
+    return RECEIVED_NEW;
+}
+
+// Acknowledges everything received so far to the sender of the datagram.
+void sendAck(int socketfd, struct ReceiveState* state, uint64_t echoedTimestamp)
+{
+    struct AckPacket ack;
+    memset(&ack, 0, sizeof(ack));
+    ack.header.magic = htonl(PACKET_MAGIC);
+    ack.header.type = htons(PACKET_ACK);
+    ack.header.sequence = htonl(state->cumulative);
+    ack.header.timestamp = echoedTimestamp;
+
+    uint64_t selective = 0;
+    for (int bit = 0; bit < 64; bit++)
+    {
+        if (state->received[(state->cumulative + 1 + bit) % RECEIVE_WINDOW])
+            selective |= (uint64_t)1 << bit;
+    }
+    ack.selective = htobe64(selective);
+
+    if (sendto(socketfd, &ack, sizeof(ack), 0, (struct sockaddr*)&state->sender, sizeof(state->sender)) < 0)
+        perror("Failed to send acknowledgement");
+}
+
+// Records a multicast datagram. Returns 1 if it is new and should be delivered, 0 if it was already received.
+int markMulticastReceived(struct MulticastState* state, struct ReceiverStats* stats, uint32_t sequence)
+{
+    int32_t ahead = (int32_t)(sequence - state->highest);
+    if (ahead > 0)
+    {
+        // Everything skipped over is lost until it arrives. Their entries still hold datagrams a window earlier.
+        uint32_t skipped = ahead - 1;
+        for (uint32_t i = 1; i < (uint32_t)ahead && i <= RECEIVE_WINDOW; i++)
+            state->seen[(state->highest + i) % RECEIVE_WINDOW] = 0;
+        stats->lost += skipped;
+        state->totalLost += skipped;
+        state->highest = sequence;
+        state->seen[sequence % RECEIVE_WINDOW] = 1;
+        state->totalReceived++;
+        return 1;
+    }
+
+    if ((uint32_t)-ahead >= RECEIVE_WINDOW || (int32_t)(sequence - state->first) < 0)
+    {
+        stats->reordered++;
+        state->totalReceived++;
+        return 1;
+    }
+    if (state->seen[sequence % RECEIVE_WINDOW])
+    {
+        stats->duplicates++;
+        return 0;
+    }
+    state->seen[sequence % RECEIVE_WINDOW] = 1;
+    stats->reordered++;
+    stats->recovered++;
+    state->totalLost--;
+    state->totalReceived++;
+    return 1;
+}
+
+void reportStats(struct ReceiverStats* stats, struct MulticastState* multicastState, int multicast, int64_t elapsedUs)
+{
+    double seconds = (double)elapsedUs / 1000000;
+    uint64_t delivered = stats->datagrams - stats->duplicates - stats->outOfWindow;
+    fprintf(stderr, "Received %lu datagrams (%lu duplicates, %lu out of window), %lu lines (%.1f per datagram, %.0f lines/s, %.2f MB/s)\n", stats->datagrams, stats->duplicates, stats->outOfWindow, stats->lines, delivered > 0 ? (double)stats->lines / delivered : 0.0, stats->lines / seconds, (double)stats->bytes / 1024 / 1024 / seconds);
+    if (multicast && multicastState->hasSender)
+    {
+        uint64_t expected = multicastState->totalReceived + multicastState->totalLost;
+        fprintf(stderr, "Multicast: %lu new gaps, %lu gaps filled by late datagrams, %lu reordered; %lu of %lu lost in total (%.2f%%)\n", stats->lost, stats->recovered, stats->reordered, multicastState->totalLost, expected, multicastState->totalLost * 100.0 / expected);
+    }
+    memset(stats, 0, sizeof(*stats));
+}
+
+// Receives datagrams and writes the lines in them to output. A datagram may hold any number of complete lines, so
+// packed datagrams need no unpacking beyond writing them out whole. Datagrams sent with the reliability layer are
+// acknowledged, deduplicated and written in the order they arrive. Anything else is written as is.
+// Only one reliable sender is tracked at a time, a datagram from another sender restarts the tracking. Datagrams sent
+// to a multicast group are written in the order they arrive and only used for counting lost ones.
+void receiveLines(int socketfd, int output, int multicast, int64_t reportIntervalUs)
+{
+    char* buffer = malloc(BUFFER_SIZE);
+    struct ReceiveState* state = calloc(1, sizeof(struct ReceiveState));
+    struct MulticastState* multicastState = calloc(1, sizeof(struct MulticastState));
+    if (buffer == NULL || state == NULL || multicastState == NULL)
+    {
+        perror("Failed to allocate receive buffers");
+        exit(1);
+    }
+
+    struct timeval timeout = {reportIntervalUs / 1000000, reportIntervalUs % 1000000};
+    if (setsockopt(socketfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) < 0)
+    {
+        perror("Failed to set receive timeout");
+        exit(1);
+    }
+
+    struct ReceiverStats stats;
+    memset(&stats, 0, sizeof(stats));
+    int64_t lastReport = getMonotonicTimeUs();
+    while (1)
+    {
+        int64_t now = getMonotonicTimeUs();
+        if (now - lastReport >= reportIntervalUs)
+        {
+            if (stats.datagrams > 0)
+                reportStats(&stats, multicastState, multicast, now - lastReport);
+            lastReport = now;
+        }
+
+        struct sockaddr_in senderAddress;
+        socklen_t senderAddressLength = sizeof(senderAddress);
+        ssize_t readResult = recvfrom(socketfd, buffer, BUFFER_SIZE, 0, (struct sockaddr*)&senderAddress, &senderAddressLength);
+        if (readResult < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+                continue;
+            perror("Failed to receive datagram");
+            exit(1);
+        }
+        stats.datagrams++;
+
+        char* payload = buffer;
+        size_t payloadLength = readResult;
+        struct PacketHeader header;
+        if ((size_t)readResult >= sizeof(header))
+        {
+            memcpy(&header, buffer, sizeof(header));
+            if (ntohl(header.magic) == PACKET_MAGIC && ntohs(header.type) == PACKET_MULTICAST)
+            {
+                uint32_t sequence = ntohl(header.sequence);
+                if (!multicastState->hasSender || multicastState->sender.sin_addr.s_addr != senderAddress.sin_addr.s_addr || multicastState->sender.sin_port != senderAddress.sin_port)
+                {
+                    memset(multicastState, 0, sizeof(*multicastState));
+                    multicastState->sender = senderAddress;
+                    multicastState->hasSender = 1;
+                    multicastState->first = sequence;
+                    multicastState->highest = sequence - 1;
+                }
+                if (!markMulticastReceived(multicastState, &stats, sequence))
+                    continue;
+                payload += sizeof(header);
+                payloadLength -= sizeof(header);
+            }
+            else if (ntohl(header.magic) == PACKET_MAGIC && ntohs(header.type) == PACKET_DATA)
+            {
+                if (!state->hasSender || state->sender.sin_addr.s_addr != senderAddress.sin_addr.s_addr || state->sender.sin_port != senderAddress.sin_port)
+                {
+                    memset(state, 0, sizeof(*state));
+                    state->sender = senderAddress;
+                    state->hasSender = 1;
+                }
+
+                enum ReceiveResult result = markReceived(state, ntohl(header.sequence));
+                sendAck(socketfd, state, header.timestamp);
+                if (result == RECEIVED_DUPLICATE)
+                    stats.duplicates++;
+                if (result == RECEIVED_OUT_OF_WINDOW)
+                    stats.outOfWindow++;
+                if (result != RECEIVED_NEW)
+                    continue;
+                payload += sizeof(header);
+                payloadLength -= sizeof(header);
+            }
+        }
+
+        for (size_t i = 0; i < payloadLength; i++)
+        {
+            if (payload[i] == '\n')
+                stats.lines++;
+        }
+        stats.bytes += payloadLength;
+        if (loopedWrite(output, payload, payloadLength) < 0)
+        {
+            perror("Failed to write to output");
+            exit(1);
+        }
+    }
+}
+
+int main(__attribute__((unused)) int argc, __attribute__((unused)) char* argv[])
+{
+    int64_t reportIntervalUs = 1000000;
+    char* group = NULL;
+    char* interface = NULL;
+    static struct option longOptions[] = {
+        {"interval", required_argument, NULL, 'i'},
+        {"group", required_argument, NULL, 'g'},
+        {"interface", required_argument, NULL, 'I'},
+        {NULL, 0, NULL, 0},
+    };
+    int option;
+    while ((option = getopt_long(argc, argv, "i:g:I:", longOptions, NULL)) != -1)
+    {
+        switch (option)
+        {
+        case 'g':
+            group = optarg;
+            break;
+        case 'I':
+            interface = optarg;
+            break;
+        case 'i':
+            reportIntervalUs = (int64_t)(atof(optarg) * 1000000);
+            if (reportIntervalUs <= 0)
+            {
+                fprintf(stderr, "Interval must be a positive number of seconds\n");
+                return 1;
+            }
+            break;
+        default:
+            return 1;
+        }
+    }
+
+    // Read the port from the command line arguments.
+    if (argc - optind != 1)
+    {
+        fprintf(stderr, "Usage: %s [--interval <seconds between reports>] [--group <multicast group> [--interface <ip address>]] <port>\n", argv[0]);
+        return 1;
+    }
+    int port = atoi(argv[optind]);
+
+    int socketfd;
+    if ((socketfd = socket(PF_INET, SOCK_DGRAM, 0)) < 0)
+    {
+        perror("Failed to create socket");
+        return 1;
+    }
+
+    // Every receiver of a multicast group on this host binds the same port, each of them still gets every datagram.
+    int enable = 1;
+    if (group != NULL && (setsockopt(socketfd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable)) < 0 || setsockopt(socketfd, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable)) < 0))
+    {
+        perror("Failed to allow sharing the port");
+        return 1;
+    }
+
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    address.sin_port = htons(port);
+    if (bind(socketfd, (struct sockaddr*)&address, sizeof(address)) < 0)
+    {
+        perror("Failed to bind socket");
+        return 1;
+    }
+
+    if (group != NULL)
+    {
+        struct ip_mreq membership;
+        memset(&membership, 0, sizeof(membership));
+        membership.imr_interface.s_addr = htonl(INADDR_ANY);
+        if (inet_aton(group, &membership.imr_multiaddr) == 0 || !IN_MULTICAST(ntohl(membership.imr_multiaddr.s_addr)))
+        {
+            fprintf(stderr, "Invalid multicast group: %s\n", group);
+            return 1;
+        }
+        if (interface != NULL && inet_aton(interface, &membership.imr_interface) == 0)
+        {
+            fprintf(stderr, "Invalid interface address: %s\n", interface);
+            return 1;
+        }
+        if (setsockopt(socketfd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &membership, sizeof(membership)) < 0)
+        {
+            perror("Failed to join multicast group");
+            return 1;
+        }
+        fprintf(stderr, "Joined multicast group %s\n", group);
+    }
+
+    fprintf(stderr, "Receiving lines on port %d\n", port);
+    receiveLines(socketfd, STDOUT_FILENO, group != NULL, reportIntervalUs);
+
+    return 0;
+}
@@ -0,0 +1,880 @@
+// -pthread
+#define _GNU_SOURCE
+#include <errno.h>
+#include <getopt.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAXNITEMS 1000000
+#define MAXNTHREADS 100
+#define CACHE_LINE_SIZE 64
+#define DEFAULT_RING_CAPACITY 1024
+// How many times a full or empty ring is retried before going to sleep on the futex
+#define SPIN_LIMIT 64
+#define MAX_BATCH 4096
+
+#define min(a, b) ((a) < (b) ? (a) : (b))
+
+// Which queue the producers and consumers go through: the book's mutex protected array with a condition variable, or
+// the bounded lock free ring.
+enum queue_type
+{
+    QUEUE_MUTEX,
+    QUEUE_RING,
+    QUEUE_TYPE_COUNT
+};
+char *queue_names[QUEUE_TYPE_COUNT] = {"mutex", "ring"};
+
+// Where the benchmark threads run. Producer i and consumer i are threads 2i and 2i + 1 of the run. Compact puts
+// neighbouring threads on neighbouring CPUs, sharing CPUs only once there are more threads than CPUs. Scatter spreads
+// the threads over all the allowed CPUs as evenly as it can.
+enum pin_policy
+{
+    PIN_NONE,
+    PIN_COMPACT,
+    PIN_SCATTER,
+    PIN_POLICY_COUNT
+};
+char *pin_names[PIN_POLICY_COUNT] = {"none", "compact", "scatter"};
+
+/* include globals */
+int nitems; /* read-only by producer and consumer */
+int buff[MAXNITEMS];
+struct
+{
+    pthread_mutex_t mutex;
+    int nput; /* next index to store */
+    int nval; /* next value to store */
+} put = {PTHREAD_MUTEX_INITIALIZER, 0, 0};
+
+struct
+{
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int nready; /* number ready for consumer */
+    int nget;   /* next index to consume */
+} nready = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, 0};
+/* end globals */
+
+// One cell of the ring. "sequence" tells whose turn the cell is: equal to the position for the producer that is to
+// fill it, one past the position for the consumer that is to empty it.
+struct cell
+{
+    size_t sequence;
+    int value;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+// A futex word that is bumped whenever sleeping threads are woken, and how many threads went to sleep since the last
+// wake. The waker takes all of them at once, so while they get to run the following changes to the ring skip the
+// system call.
+struct waitpoint
+{
+    uint32_t word;
+    uint32_t waiters;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+// Bounded multi-producer multi-consumer queue from Dmitry Vyukov. Producers and consumers claim positions with a
+// compare and swap on their own counter and hand cells to each other through the cell sequence numbers, so a
+// producer and a consumer only touch the same cache line when they work on the same cell.
+struct ring
+{
+    struct cell *cells;
+    size_t mask;
+    size_t enqueue_position __attribute__((aligned(CACHE_LINE_SIZE)));
+    size_t dequeue_position __attribute__((aligned(CACHE_LINE_SIZE)));
+    struct waitpoint not_full;
+    struct waitpoint not_empty;
+    // Items handed out to producers and consumers, so that every thread knows when it is done without waiting
+    int produced __attribute__((aligned(CACHE_LINE_SIZE)));
+    int consumed __attribute__((aligned(CACHE_LINE_SIZE)));
+    long consumed_sum;
+};
+
+// What one benchmark run measured. Fairness is Jain's index of the items each thread handled: 1 when all threads did
+// the same share, 1/n when one thread did everything.
+struct run_result
+{
+    int64_t elapsed_ns;
+    double producer_fairness;
+    double consumer_fairness;
+    int64_t latency_p50_ns;
+    int64_t latency_p99_ns;
+    int64_t latency_p999_ns;
+    int64_t latency_max_ns;
+};
+
+static enum queue_type queue_type = QUEUE_MUTEX;
+static struct ring ring;
+static enum pin_policy pin_policy = PIN_NONE;
+static int cpus[CPU_SETSIZE];
+static int cpu_count;
+// When items are timed, the time each item was made and how long it took to be consumed, indexed by the item. Off
+// with --no-latency, so that the throughput can be measured without the two clock reads per item.
+static int measure_latency;
+static int64_t *enqueued_at;
+static int64_t *item_latency;
+// How many items the threads reserve and publish at once, and how long a producer may keep items buffered before
+// publishing a partial batch (0 for no limit)
+static int batch = 1;
+static int64_t flush_timeout_ns;
+// The threads of a run and the thread timing it wait here, so that the run is timed from the moment all of them start
+// and not from when the first of them is created
+static pthread_barrier_t start_barrier;
+
+void *produce(void *), *consume(void *);
+void *ring_produce(void *), *ring_consume(void *);
+
+// Returns the current time of the monotonic clock in nanoseconds.
+int64_t get_monotonic_time_ns()
+{
+    struct timespec now;
+    if (clock_gettime(CLOCK_MONOTONIC, &now) < 0)
+    {
+        perror("Failed to get monotonic time");
+        exit(1);
+    }
+    return now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// The ring is only shared between threads, so the private futex operations are enough.
+long futex(uint32_t *address, int operation, uint32_t value)
+{
+    return syscall(SYS_futex, address, operation, value, NULL, NULL, 0);
+}
+
+void check_pthread(int result, const char *message)
+{
+    if (result != 0)
+    {
+        fprintf(stderr, "%s: %s\n", message, strerror(result));
+        exit(1);
+    }
+}
+
+int compare_int64(const void *a, const void *b)
+{
+    int64_t first = *(const int64_t *)a;
+    int64_t second = *(const int64_t *)b;
+    return (first > second) - (first < second);
+}
+
+// Returns the given percentile of the sorted values.
+int64_t percentile(int64_t *sorted, size_t count, double percent)
+{
+    size_t index = (size_t)(percent / 100 * count);
+    if (index >= count)
+        index = count - 1;
+    return sorted[index];
+}
+
+double jain_fairness(int *counts, int n)
+{
+    double sum = 0, squares = 0;
+    for (int i = 0; i < n; i++)
+    {
+        sum += counts[i];
+        squares += (double)counts[i] * counts[i];
+    }
+    return squares == 0 ? 1 : sum * sum / (n * squares);
+}
+
+// Reads the CPUs this process may run on, which the pinning policies choose from.
+void load_cpus()
+{
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0)
+    {
+        perror("sched_getaffinity failed");
+        exit(1);
+    }
+    cpu_count = 0;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+    {
+        if (CPU_ISSET(cpu, &allowed))
+            cpus[cpu_count++] = cpu;
+    }
+}
+
+// Returns the CPU thread "thread" out of "total" runs on with the current policy.
+int pin_cpu(int thread, int total)
+{
+    if (pin_policy == PIN_COMPACT && total > cpu_count)
+        return cpus[(long)thread * cpu_count / total];
+    if (pin_policy == PIN_COMPACT)
+        return cpus[thread];
+    if (total < cpu_count)
+        return cpus[(long)thread * cpu_count / total];
+    return cpus[thread % cpu_count];
+}
+
+void create_thread(pthread_t *tid, void *(*function)(void *), void *arg, int thread, int total)
+{
+    pthread_attr_t attributes;
+    pthread_attr_init(&attributes);
+    if (pin_policy != PIN_NONE)
+    {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(pin_cpu(thread, total), &set);
+        check_pthread(pthread_attr_setaffinity_np(&attributes, sizeof(set), &set), "pthread_attr_setaffinity_np error");
+    }
+    check_pthread(pthread_create(tid, &attributes, function, arg), "pthread_create error");
+    pthread_attr_destroy(&attributes);
+}
+
+// Waits until every thread of the run has been created.
+void wait_for_start()
+{
+    int result = pthread_barrier_wait(&start_barrier);
+    if (result != 0 && result != PTHREAD_BARRIER_SERIAL_THREAD)
+        check_pthread(result, "pthread_barrier_wait error");
+}
+
+void cpu_relax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+void ring_init(size_t capacity)
+{
+    free(ring.cells);
+    memset(&ring, 0, sizeof(ring));
+    ring.cells = aligned_alloc(CACHE_LINE_SIZE, capacity * sizeof(struct cell));
+    if (ring.cells == NULL)
+    {
+        perror("Failed to allocate ring");
+        exit(1);
+    }
+    for (size_t i = 0; i < capacity; i++)
+        ring.cells[i].sequence = i;
+    ring.mask = capacity - 1;
+}
+
+// Waits for the thread that claimed the cell before to finish with it. A range is claimed only once its last cell is
+// seen ready, so every thread waited for here is already past its own claim and done in a moment.
+void cell_wait(struct cell *cell, size_t sequence)
+{
+    int spins = 0;
+    while (__atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE) != sequence)
+    {
+        if (++spins < SPIN_LIMIT)
+            cpu_relax();
+        else
+            sched_yield();
+    }
+}
+
+// Claims "n" consecutive cells with one compare and swap and fills them with the values. Returns 0 if the ring
+// doesn't have room for all of them.
+int ring_try_enqueue(int *values, int n)
+{
+    size_t position = __atomic_load_n(&ring.enqueue_position, __ATOMIC_RELAXED);
+    while (1)
+    {
+        struct cell *last = &ring.cells[(position + n - 1) & ring.mask];
+        size_t sequence = __atomic_load_n(&last->sequence, __ATOMIC_ACQUIRE);
+        intptr_t difference = (intptr_t)sequence - (intptr_t)(position + n - 1);
+        if (difference == 0)
+        {
+            if (__atomic_compare_exchange_n(&ring.enqueue_position, &position, position + n, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            {
+                for (int i = 0; i < n; i++)
+                {
+                    struct cell *cell = &ring.cells[(position + i) & ring.mask];
+                    cell_wait(cell, position + i);
+                    cell->value = values[i];
+                    __atomic_store_n(&cell->sequence, position + i + 1, __ATOMIC_RELEASE);
+                }
+                return 1;
+            }
+        }
+        else if (difference < 0)
+            return 0;
+        else
+            position = __atomic_load_n(&ring.enqueue_position, __ATOMIC_RELAXED);
+    }
+}
+
+// Claims up to "max" consecutive filled cells with one compare and swap and empties them into "values". Returns how
+// many it got, 0 if the ring is empty.
+int ring_try_dequeue(int *values, int max)
+{
+    size_t position = __atomic_load_n(&ring.dequeue_position, __ATOMIC_RELAXED);
+    int n = max;
+    while (1)
+    {
+        struct cell *last = &ring.cells[(position + n - 1) & ring.mask];
+        size_t sequence = __atomic_load_n(&last->sequence, __ATOMIC_ACQUIRE);
+        intptr_t difference = (intptr_t)sequence - (intptr_t)(position + n);
+        if (difference == 0)
+        {
+            if (__atomic_compare_exchange_n(&ring.dequeue_position, &position, position + n, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            {
+                for (int i = 0; i < n; i++)
+                {
+                    struct cell *cell = &ring.cells[(position + i) & ring.mask];
+                    cell_wait(cell, position + i + 1);
+                    values[i] = cell->value;
+                    __atomic_store_n(&cell->sequence, position + i + ring.mask + 1, __ATOMIC_RELEASE);
+                }
+                return n;
+            }
+            n = max;
+        }
+        else if (difference < 0)
+        {
+            // Fewer than "n" items are ready, try with fewer
+            if (n == 1)
+                return 0;
+            n /= 2;
+        }
+        else
+        {
+            position = __atomic_load_n(&ring.dequeue_position, __ATOMIC_RELAXED);
+            n = max;
+        }
+    }
+}
+
+// Sleeps until the waitpoint is signaled. The word is read before announcing the wait and retrying, so a signal
+// that comes after the retry failed changes the word and makes FUTEX_WAIT return at once instead of sleeping.
+void waitpoint_sleep(struct waitpoint *point, uint32_t word)
+{
+    if (futex(&point->word, FUTEX_WAIT_PRIVATE, word) < 0 && errno != EAGAIN && errno != EINTR)
+    {
+        perror("futex wait failed");
+        exit(1);
+    }
+}
+
+// Wakes the sleepers after the ring was changed. The fence pairs with the sequentially consistent registration in
+// the waiting side: either the waiter sees the change when it retries, or this sees the waiter.
+void waitpoint_signal(struct waitpoint *point)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&point->waiters, __ATOMIC_RELAXED) == 0)
+        return;
+    uint32_t waiters = __atomic_exchange_n(&point->waiters, 0, __ATOMIC_RELAXED);
+    if (waiters == 0)
+        return;
+    __atomic_add_fetch(&point->word, 1, __ATOMIC_RELEASE);
+    if (futex(&point->word, FUTEX_WAKE_PRIVATE, waiters) < 0)
+    {
+        perror("futex wake failed");
+        exit(1);
+    }
+}
+
+// Enqueues all the values, spinning for a while and then sleeping while the ring doesn't have room for them.
+void ring_enqueue(int *values, int n)
+{
+    for (int spin = 0; spin < SPIN_LIMIT; spin++)
+    {
+        if (ring_try_enqueue(values, n))
+        {
+            waitpoint_signal(&ring.not_empty);
+            return;
+        }
+        cpu_relax();
+    }
+    // A registration left behind when the retry succeeds isn't taken back, it only costs one needless wake later
+    while (1)
+    {
+        uint32_t word = __atomic_load_n(&ring.not_full.word, __ATOMIC_ACQUIRE);
+        __atomic_add_fetch(&ring.not_full.waiters, 1, __ATOMIC_SEQ_CST);
+        int done = ring_try_enqueue(values, n);
+        if (!done)
+            waitpoint_sleep(&ring.not_full, word);
+        if (done)
+        {
+            waitpoint_signal(&ring.not_empty);
+            return;
+        }
+    }
+}
+
+// Dequeues up to "max" values, spinning for a while and then sleeping while the ring is empty. Returns how many.
+int ring_dequeue(int *values, int max)
+{
+    int n;
+    for (int spin = 0; spin < SPIN_LIMIT; spin++)
+    {
+        if ((n = ring_try_dequeue(values, max)) > 0)
+        {
+            waitpoint_signal(&ring.not_full);
+            return n;
+        }
+        cpu_relax();
+    }
+    while (1)
+    {
+        uint32_t word = __atomic_load_n(&ring.not_empty.word, __ATOMIC_ACQUIRE);
+        __atomic_add_fetch(&ring.not_empty.waiters, 1, __ATOMIC_SEQ_CST);
+        n = ring_try_dequeue(values, max);
+        if (n == 0)
+            waitpoint_sleep(&ring.not_empty, word);
+        if (n > 0)
+        {
+            waitpoint_signal(&ring.not_full);
+            return n;
+        }
+    }
+}
+
+// Runs "nthreads" producers and as many consumers through the selected queue and fills in what was measured.
+// With "verbose" set prints how many items each thread handled, like the book's version.
+void run(int nthreads, int verbose, struct run_result *result)
+{
+    int i, count[MAXNTHREADS], consumeCount[MAXNTHREADS];
+    pthread_t tid_produce[MAXNTHREADS], tid_consume[MAXNTHREADS];
+    void *(*producer)(void *) = queue_type == QUEUE_RING ? ring_produce : produce;
+    void *(*consumer)(void *) = queue_type == QUEUE_RING ? ring_consume : consume;
+
+    put.nput = put.nval = 0;
+    nready.nready = nready.nget = 0;
+    check_pthread(pthread_barrier_init(&start_barrier, NULL, 2 * nthreads + 1), "pthread_barrier_init error");
+
+    /* 4create all producers and all consumers */
+    for (i = 0; i < nthreads; i++)
+    {
+        count[i] = 0;
+        create_thread(&tid_produce[i], producer, &count[i], 2 * i, 2 * nthreads);
+    }
+
+    for (i = 0; i < nthreads; i++)
+    {
+        consumeCount[i] = 0;
+        create_thread(&tid_consume[i], consumer, &consumeCount[i], 2 * i + 1, 2 * nthreads);
+    }
+    wait_for_start();
+    int64_t start = get_monotonic_time_ns();
+
+    /* wait for all producers and consumers */
+    for (i = 0; i < nthreads; i++)
+    {
+        check_pthread(pthread_join(tid_produce[i], NULL), "pthread_join error");
+        if (verbose)
+            printf("count[%d] = %d\n", i, count[i]);
+    }
+    for (i = 0; i < nthreads; i++)
+    {
+        check_pthread(pthread_join(tid_consume[i], NULL), "pthread_join error");
+        if (verbose)
+            printf("consumeCount[%d] = %d\n", i, consumeCount[i]);
+    }
+    result->elapsed_ns = get_monotonic_time_ns() - start;
+    check_pthread(pthread_barrier_destroy(&start_barrier), "pthread_barrier_destroy error");
+
+    if (queue_type == QUEUE_RING && ring.consumed_sum != (long)nitems * (nitems - 1) / 2)
+        fprintf(stderr, "ring: consumed values don't add up, items were lost or duplicated\n");
+
+    result->producer_fairness = jain_fairness(count, nthreads);
+    result->consumer_fairness = jain_fairness(consumeCount, nthreads);
+    if (measure_latency)
+    {
+        qsort(item_latency, nitems, sizeof(int64_t), compare_int64);
+        result->latency_p50_ns = percentile(item_latency, nitems, 50);
+        result->latency_p99_ns = percentile(item_latency, nitems, 99);
+        result->latency_p999_ns = percentile(item_latency, nitems, 99.9);
+        result->latency_max_ns = item_latency[nitems - 1];
+    }
+    else
+        result->latency_p50_ns = result->latency_p99_ns = result->latency_p999_ns = result->latency_max_ns = 0;
+}
+
+// Returns the median of one field of the results, picked with "offset".
+int64_t median_int64(struct run_result *results, int count, size_t offset)
+{
+    int64_t values[count];
+    for (int i = 0; i < count; i++)
+        values[i] = *(int64_t *)((char *)&results[i] + offset);
+    qsort(values, count, sizeof(int64_t), compare_int64);
+    return values[count / 2];
+}
+
+double median_double(struct run_result *results, int count, size_t offset)
+{
+    // The fairness indexes are between 0 and 1, scaling them keeps enough precision to sort them as integers
+    int64_t values[count];
+    for (int i = 0; i < count; i++)
+        values[i] = (int64_t)(*(double *)((char *)&results[i] + offset) * 1e9);
+    qsort(values, count, sizeof(int64_t), compare_int64);
+    return values[count / 2] / 1e9;
+}
+
+// Benchmarks the queue with each of the thread counts: "warmup" runs that aren't measured, then "repeat" runs whose
+// medians are printed on one line per thread count, so the output of two builds can be diffed directly. The
+// throughput columns are the median, the slowest and the fastest run.
+void run_harness(int *thread_counts, int thread_count_count, int *batch_sizes, int batch_size_count, int warmup, int repeat, size_t capacity)
+{
+    struct run_result results[repeat];
+    struct run_result ignored;
+    for (int t = 0; t < thread_count_count * batch_size_count; t++)
+    {
+        int nthreads = thread_counts[t / batch_size_count];
+        batch = batch_sizes[t % batch_size_count];
+        for (int i = 0; i < warmup + repeat; i++)
+        {
+            if (queue_type == QUEUE_RING)
+                ring_init(capacity);
+            run(nthreads, 0, i < warmup ? &ignored : &results[i - warmup]);
+        }
+
+        int64_t slowest = INT64_MIN, fastest = INT64_MAX;
+        for (int i = 0; i < repeat; i++)
+        {
+            if (results[i].elapsed_ns > slowest)
+                slowest = results[i].elapsed_ns;
+            if (results[i].elapsed_ns < fastest)
+                fastest = results[i].elapsed_ns;
+        }
+        int64_t elapsed = median_int64(results, repeat, offsetof(struct run_result, elapsed_ns));
+        printf("%-6s %7d %6d %12.0f %12.0f %12.0f %6.3f %6.3f", queue_names[queue_type], nthreads, batch, nitems / (elapsed / 1e9), nitems / (slowest / 1e9), nitems / (fastest / 1e9),
+               median_double(results, repeat, offsetof(struct run_result, producer_fairness)), median_double(results, repeat, offsetof(struct run_result, consumer_fairness)));
+        if (measure_latency)
+            printf(" %10ld %10ld %10ld %10ld\n", median_int64(results, repeat, offsetof(struct run_result, latency_p50_ns)), median_int64(results, repeat, offsetof(struct run_result, latency_p99_ns)),
+                   median_int64(results, repeat, offsetof(struct run_result, latency_p999_ns)), median_int64(results, repeat, offsetof(struct run_result, latency_max_ns)));
+        else
+            printf(" %10s %10s %10s %10s\n", "-", "-", "-", "-");
+        fflush(stdout);
+    }
+}
+
+// Parses a comma separated list of counts between 1 and "limit" into "counts". Returns how many there were.
+int parse_counts(char *list, int *counts, int max_counts, int limit, const char *what)
+{
+    int n = 0;
+    for (char *item = strtok(list, ","); item != NULL; item = strtok(NULL, ","))
+    {
+        if (n == max_counts)
+        {
+            fprintf(stderr, "too many %s\n", what);
+            exit(1);
+        }
+        counts[n] = atoi(item);
+        if (counts[n] < 1 || counts[n] > limit)
+        {
+            fprintf(stderr, "%s must be between 1 and %d\n", what, limit);
+            exit(1);
+        }
+        n++;
+    }
+    return n;
+}
+
+void usage()
+{
+    fprintf(stderr, "usage: prodcons6 [--queue mutex|ring] [--capacity <ring cells>] [--pin none|compact|scatter] [--batch <size>] [--flush-us <us>] <#items> <#threads>\n"
+                    "       prodcons6 --bench [--queue mutex|ring] [--capacity <ring cells>] [--pin none|compact|scatter] [--threads <n,n,...>] [--batch <n,n,...>] [--flush-us <us>] [--warmup <runs>] [--repeat <runs>] [--no-latency] <#items>\n");
+    exit(1);
+}
+
+/* include main */
+int main(int argc, char **argv)
+{
+    int nthreads;
+    size_t capacity = DEFAULT_RING_CAPACITY;
+    int bench = 0;
+    int queue_selected = 0;
+    int thread_counts[MAXNTHREADS] = {1, 2, 4, 8, 16, 32, 64};
+    int thread_count_count = 7;
+    int batch_sizes[MAXNTHREADS] = {1};
+    int batch_size_count = 1;
+    int warmup = 1;
+    int repeat = 5;
+    int no_latency = 0;
+
+    static struct option long_options[] = {
+        {"queue", required_argument, NULL, 'q'},
+        {"capacity", required_argument, NULL, 'c'},
+        {"bench", no_argument, NULL, 'b'},
+        {"pin", required_argument, NULL, 'p'},
+        {"threads", required_argument, NULL, 't'},
+        {"warmup", required_argument, NULL, 'w'},
+        {"repeat", required_argument, NULL, 'r'},
+        {"batch", required_argument, NULL, 'k'},
+        {"flush-us", required_argument, NULL, 'f'},
+        {"no-latency", no_argument, NULL, 'n'},
+        {NULL, 0, NULL, 0},
+    };
+    int option;
+    while ((option = getopt_long(argc, argv, "q:c:bp:t:w:r:k:f:n", long_options, NULL)) != -1)
+    {
+        switch (option)
+        {
+        case 'p':
+            for (pin_policy = 0; pin_policy < PIN_POLICY_COUNT; pin_policy++)
+            {
+                if (strcmp(optarg, pin_names[pin_policy]) == 0)
+                    break;
+            }
+            if (pin_policy == PIN_POLICY_COUNT)
+            {
+                fprintf(stderr, "unknown pinning policy %s, expected none, compact or scatter\n", optarg);
+                exit(1);
+            }
+            break;
+        case 't':
+            thread_count_count = parse_counts(optarg, thread_counts, MAXNTHREADS, MAXNTHREADS, "thread counts");
+            break;
+        case 'k':
+            batch_size_count = parse_counts(optarg, batch_sizes, MAXNTHREADS, MAX_BATCH, "batch sizes");
+            break;
+        case 'f':
+            flush_timeout_ns = atol(optarg) * 1000;
+            break;
+        case 'w':
+            warmup = atoi(optarg);
+            break;
+        case 'r':
+            repeat = atoi(optarg);
+            break;
+        case 'q':
+            queue_selected = 1;
+            for (queue_type = 0; queue_type < QUEUE_TYPE_COUNT; queue_type++)
+            {
+                if (strcmp(optarg, queue_names[queue_type]) == 0)
+                    break;
+            }
+            if (queue_type == QUEUE_TYPE_COUNT)
+            {
+                fprintf(stderr, "unknown queue %s, expected mutex or ring\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'c':
+            capacity = strtoul(optarg, NULL, 10);
+            if (capacity < 2 || (capacity & (capacity - 1)) != 0)
+            {
+                fprintf(stderr, "ring capacity must be a power of two\n");
+                exit(1);
+            }
+            break;
+        case 'b':
+            bench = 1;
+            break;
+        case 'n':
+            no_latency = 1;
+            break;
+        default:
+            usage();
+        }
+    }
+
+    if (argc - optind != (bench ? 1 : 2) || warmup < 0 || repeat < 1 || thread_count_count == 0)
+        usage();
+    nitems = min(atoi(argv[optind]), MAXNITEMS);
+    if (nitems < 1)
+    {
+        fprintf(stderr, "need at least one item\n");
+        exit(1);
+    }
+    for (int i = 0; i < batch_size_count; i++)
+    {
+        if ((size_t)batch_sizes[i] > capacity)
+        {
+            fprintf(stderr, "batch size %d doesn't fit in a ring of %zu cells\n", batch_sizes[i], capacity);
+            exit(1);
+        }
+    }
+    batch = batch_sizes[0];
+    load_cpus();
+
+    if (bench)
+    {
+        // Unless turned off every item is timed from when its producer makes it to when a consumer takes it
+        measure_latency = !no_latency;
+        if (measure_latency)
+        {
+            enqueued_at = malloc(nitems * sizeof(int64_t));
+            item_latency = malloc(nitems * sizeof(int64_t));
+            if (enqueued_at == NULL || item_latency == NULL)
+            {
+                perror("malloc failed");
+                exit(1);
+            }
+        }
+
+        printf("# items %d, warmup %d, repeat %d, pin %s, ring capacity %zu, flush %ldus, cpus %d\n", nitems, warmup, repeat, pin_names[pin_policy], capacity, flush_timeout_ns / 1000, cpu_count);
+        printf("%-6s %7s %6s %12s %12s %12s %6s %6s %10s %10s %10s %10s\n", "queue", "threads", "batch", "items/s", "slowest/s", "fastest/s", "pfair", "cfair", "p50 ns", "p99 ns", "p99.9 ns", "max ns");
+        // Both queues unless one was asked for
+        for (int type = 0; type < QUEUE_TYPE_COUNT; type++)
+        {
+            if (queue_selected && type != (int)queue_type)
+                continue;
+            enum queue_type selected = queue_type;
+            queue_type = type;
+            run_harness(thread_counts, thread_count_count, batch_sizes, batch_size_count, warmup, repeat, capacity);
+            queue_type = selected;
+        }
+        exit(0);
+    }
+
+    nthreads = min(atoi(argv[optind + 1]), MAXNTHREADS);
+    if (nthreads < 1)
+    {
+        fprintf(stderr, "need at least one thread\n");
+        exit(1);
+    }
+    if (queue_type == QUEUE_RING)
+        ring_init(capacity);
+    struct run_result result;
+    run(nthreads, 1, &result);
+    printf("%s, batch %d: %d items in %.3fs, %.0f items/s\n", queue_names[queue_type], batch, nitems, result.elapsed_ns / 1e9, nitems / (result.elapsed_ns / 1e9));
+
+    exit(0);
+}
+/* end main */
+
+/* include prodcons */
+// Reserves up to "batch" slots of the array at once and publishes them to the consumers with one nready update.
+void *
+produce(void *arg)
+{
+    wait_for_start();
+    for (;;)
+    {
+        pthread_mutex_lock(&put.mutex);
+        if (put.nput >= nitems)
+        {
+            pthread_mutex_unlock(&put.mutex);
+            return (NULL); /* array is full, we're done */
+        }
+        int n = min(batch, nitems - put.nput);
+        for (int k = 0; k < n; k++)
+        {
+            buff[put.nput] = put.nval;
+            if (measure_latency)
+                enqueued_at[put.nput] = get_monotonic_time_ns();
+            put.nput++;
+            put.nval++;
+        }
+        pthread_mutex_unlock(&put.mutex);
+
+        pthread_mutex_lock(&nready.mutex);
+        if (nready.nready == 0)
+            pthread_cond_broadcast(&nready.cond);
+        nready.nready += n;
+        pthread_mutex_unlock(&nready.mutex);
+
+        *((int *)arg) += n;
+    }
+}
+
+// Every item is consumed exactly once: the consumers take up to "batch" ready items at a time in order through
+// nready.nget and stop once all of them are taken, waking the others so that they notice too.
+void *
+consume(void *arg)
+{
+    wait_for_start();
+    for (;;)
+    {
+        pthread_mutex_lock(&nready.mutex);
+        while (nready.nready == 0 && nready.nget < nitems)
+            pthread_cond_wait(&nready.cond, &nready.mutex);
+        if (nready.nget >= nitems)
+        {
+            pthread_cond_broadcast(&nready.cond);
+            pthread_mutex_unlock(&nready.mutex);
+            return (NULL); /* all items consumed, we're done */
+        }
+        int n = min(batch, nready.nready);
+        nready.nready -= n;
+        int first = nready.nget;
+        nready.nget += n;
+        pthread_mutex_unlock(&nready.mutex);
+
+        for (int i = first; i < first + n; i++)
+        {
+            if (buff[i] != i)
+                printf("buff[%d] = %d\n", i, buff[i]);
+            if (measure_latency)
+                item_latency[i] = get_monotonic_time_ns() - enqueued_at[i];
+        }
+
+        *((int *)arg) += n;
+    }
+}
+/* end prodcons */
+
+// Claims item numbers a batch at a time and buffers the items locally, publishing them when "batch" of them are
+// buffered or the oldest has waited for the flush timeout. Items are made instantly here, so the size limit is
+// normally what triggers; the timeout bounds the delay when making items takes time.
+void *
+ring_produce(void *arg)
+{
+    int values[MAX_BATCH];
+    int buffered = 0;
+    int64_t oldest_ns = 0;
+    wait_for_start();
+    for (;;)
+    {
+        int value = __atomic_fetch_add(&ring.produced, batch, __ATOMIC_RELAXED);
+        if (value >= nitems)
+            break;
+        int end = min(value + batch, nitems);
+        for (; value < end; value++)
+        {
+            int64_t now = measure_latency || flush_timeout_ns > 0 ? get_monotonic_time_ns() : 0;
+            if (measure_latency)
+                enqueued_at[value] = now;
+            if (buffered == 0)
+                oldest_ns = now;
+            values[buffered++] = value;
+            if (buffered == batch || (flush_timeout_ns > 0 && now - oldest_ns >= flush_timeout_ns))
+            {
+                ring_enqueue(values, buffered);
+                *((int *)arg) += buffered;
+                buffered = 0;
+            }
+        }
+    }
+    if (buffered > 0)
+    {
+        ring_enqueue(values, buffered);
+        *((int *)arg) += buffered;
+    }
+    return (NULL);
+}
+
+// Claims items before dequeuing them, so no consumer ever waits for an item that no producer is going to make.
+void *
+ring_consume(void *arg)
+{
+    int values[MAX_BATCH];
+    long sum = 0;
+    wait_for_start();
+    for (;;)
+    {
+        int claimed = __atomic_fetch_add(&ring.consumed, batch, __ATOMIC_RELAXED);
+        if (claimed >= nitems)
+            break;
+        for (int wanted = min(batch, nitems - claimed); wanted > 0;)
+        {
+            int n = ring_dequeue(values, wanted);
+            int64_t now = measure_latency ? get_monotonic_time_ns() : 0;
+            for (int i = 0; i < n; i++)
+            {
+                if (measure_latency)
+                    item_latency[values[i]] = now - enqueued_at[values[i]];
+                sum += values[i];
+            }
+            *((int *)arg) += n;
+            wanted -= n;
+        }
+    }
+    __atomic_add_fetch(&ring.consumed_sum, sum, __ATOMIC_RELAXED);
+    return (NULL);
+}